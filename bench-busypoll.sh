@@ -0,0 +1,24 @@
+#!/bin/sh
+# Compares round-trip latency of nonblocking-demo's block, spin and adaptive
+# poll modes (see busypoll.h), with back-to-back messages and with a pause
+# between messages that exceeds the spin cap.
+#
+# usage: ./bench-busypoll.sh [port] [seconds] [max_spin_us]
+#
+# Expects the binaries in the current directory, built as
+#   gcc -O2 -pthread nonblocking-demo.c busypoll.c utils.c logger.c -o nonblocking-demo
+#   gcc -O2 -pthread loadgen.c ktls.c -o loadgen
+PORT=${1:-9988}
+SECS=${2:-5}
+SPIN=${3:-50}
+
+for interval in 0 200; do
+    for mode in block spin adaptive; do
+        LOG_LEVEL=warn ./nonblocking-demo "$PORT" $mode "$SPIN" >/dev/null 2>&1 &
+        pid=$!
+        sleep 0.5
+        echo "=== mode=$mode interval=${interval}us"
+        ./loadgen -t 1 -d "$SECS" -i $interval echo 127.0.0.1 "$PORT"
+        wait $pid
+    done
+done
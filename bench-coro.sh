@@ -0,0 +1,30 @@
+#!/bin/sh
+# Compares coro-server with epoll-server, which runs the same protocol as a
+# hand-written state machine on the same reactor, to show what the coroutine
+# layer costs.
+#
+# usage: ./bench-coro.sh [port] [seconds]
+#
+# Expects the binaries in the current directory, built as
+#   gcc -O2 -pthread coro-server.c coro.c reactor.c poller.c protocol.c \
+#       handoff.c mailbox.c ktls.c utils.c logger.c metrics.c busypoll.c \
+#       capture.c -o coro-server
+# (epoll-server and loadgen as in bench-pollers.sh). The idle connections
+# need `ulimit -n` above twice their number.
+PORT=${1:-9090}
+SECS=${2:-5}
+
+for server in epoll-server coro-server; do
+    for idle in 0 10000; do
+        PORT=$((PORT + 1))
+        LOG_LEVEL=warn ./$server "$PORT" 2 >/dev/null 2>&1 &
+        pid=$!
+        sleep 0.5
+        echo "=== $server idle=$idle"
+        ./loadgen -t 2 -d "$SECS" -c $idle echo 127.0.0.1 "$PORT"
+        ./loadgen -t 2 -d "$SECS" accept 127.0.0.1 "$PORT"
+        grep VmRSS /proc/$pid/status
+        kill $pid
+        wait $pid 2>/dev/null
+    done
+done
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Latency of light clients sharing one edge-triggered event loop with a
+# sender that never lets up, with and without per-connection budgets.
+#
+# usage: ./bench-fairness.sh [port] [seconds] [light_clients]
+#
+# Expects epoll-server and loadgen in the current directory.
+PORT=${1:-9090}
+SECS=${2:-5}
+LIGHT=${3:-1000}
+
+run() {
+    label=$1
+    heavy=$2
+    shift 2
+    PORT=$((PORT + 1))
+    env "$@" POLLER=epoll-et LOG_LEVEL=warn ./epoll-server "$PORT" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    echo "=== $label"
+    if [ "$heavy" = 1 ]; then
+        ./loadgen -t 1 -d $((SECS + 2)) -s 4096 flood 127.0.0.1 "$PORT" | sed 's/^/  heavy: /' &
+        flood=$!
+        sleep 1
+    fi
+    # Each light client sends a 32-byte message every 20 ms.
+    ./loadgen -t "$LIGHT" -d "$SECS" -i 20000 echo 127.0.0.1 "$PORT"
+    [ "$heavy" = 1 ] && wait $flood
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+run "light clients alone" 0
+run "with a heavy sender, no budget" 1 FAIR_BUDGET=0
+run "with a heavy sender, default budget" 1
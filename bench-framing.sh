@@ -0,0 +1,33 @@
+#!/bin/sh
+# Messages per second by size with ^...$ framing and with the binary
+# length-prefixed framing, one connection waiting for each reply (echo) and
+# one pipelining as fast as it can (flood).
+#
+# usage: ./bench-framing.sh [server] [port] [seconds]
+#
+# Expects the server (epoll-server by default, or coro-server) and loadgen in
+# the current directory.
+SERVER=${1:-epoll-server}
+PORT=${2:-9090}
+SECS=${3:-3}
+
+run() {
+    PORT=$((PORT + 1))
+    SOCKET_TUNING=nodelay LOG_LEVEL=warn ./"$SERVER" "$PORT" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.3
+    ./loadgen -t 1 -d "$SECS" -s "$size" "$@" 127.0.0.1 "$PORT" |
+        awk '/msg\/s/ {printf " %12s", $2}'
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+printf "%8s %12s %12s %12s %12s\n" size echo echo-binary flood flood-binary
+for size in 16 128 1024 8192 30000; do
+    printf "%8s" $size
+    run echo
+    run -b echo
+    run flood
+    run -b flood
+    echo
+done
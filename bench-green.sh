@@ -0,0 +1,34 @@
+#!/bin/sh
+# Compares green-server (green thread per connection) with threaded-server
+# (OS thread per connection): echo throughput and the servers' memory with
+# many connections open.
+#
+# usage: ./bench-green.sh [port] [seconds] [idle_conns]
+#
+# Expects the binaries in the current directory, built as
+#   gcc -O2 -pthread green-server.c green.c serve.c utils.c logger.c \
+#       metrics.c busypoll.c capture.c -o green-server
+# (threaded-server likewise, with serve.c; loadgen as in bench-pollers.sh). serve_connection sends one byte per
+# send() call, so Nagle is turned off to keep delayed ACKs out of the
+# numbers. The idle connections need `ulimit -n` above twice their number.
+# RSS doesn't include the kernel's per-thread cost (a 16 KB kernel stack
+# and task struct each), which only threaded-server pays.
+PORT=${1:-9090}
+SECS=${2:-5}
+IDLE=${3:-5000}
+
+for server in "green-server 2" "threaded-server"; do
+    PORT=$((PORT + 1))
+    set -- $server
+    SOCKET_TUNING=nodelay LOG_LEVEL=warn ./$1 "$PORT" $2 >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    echo "=== $server"
+    ./loadgen -t 2 -d "$SECS" -c "$IDLE" echo 127.0.0.1 "$PORT" &
+    lg=$!
+    sleep $((SECS / 2 + 1))
+    grep -E "VmRSS|Threads" /proc/$pid/status
+    wait $lg
+    kill $pid
+    wait $pid 2>/dev/null
+done
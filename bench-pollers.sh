@@ -0,0 +1,33 @@
+#!/bin/sh
+# Shows what each reactor backend costs as the number of connections grows:
+# one client does ping-pong echo while N other connections sit idle.
+#
+# usage: ./bench-pollers.sh [port] [seconds]
+#
+# Expects the binaries in the current directory, built as
+#   gcc -O2 -pthread epoll-server.c reactor.c poller.c protocol.c handoff.c \
+#       mailbox.c ktls.c utils.c logger.c metrics.c busypoll.c capture.c \
+#       -o epoll-server
+#   gcc -O2 -pthread loadgen.c ktls.c -o loadgen
+# The idle counts need `ulimit -n` above twice the largest one.
+PORT=${1:-9090}
+SECS=${2:-5}
+
+for poller in select poll epoll epoll-et uring; do
+    for idle in 0 100 1000 5000; do
+        # select can't go past FD_SETSIZE (1024).
+        if [ $poller = select ] && [ $idle -ge 1000 ]; then
+            continue
+        fi
+        # io_uring drops its file references asynchronously after exit, so
+        # the previous listener can linger briefly; use a fresh port per run.
+        PORT=$((PORT + 1))
+        POLLER=$poller LOG_LEVEL=warn ./epoll-server "$PORT" >/dev/null 2>&1 &
+        pid=$!
+        sleep 0.5
+        echo "=== poller=$poller idle=$idle"
+        ./loadgen -t 1 -d "$SECS" -c $idle echo 127.0.0.1 "$PORT"
+        kill $pid
+        wait $pid 2>/dev/null
+    done
+done
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Fan-out to many subscribers: deliveries per second by message size, with
+# one shared refcounted buffer per message and with a copy per subscriber.
+#
+# usage: ./bench-pubsub.sh [subscribers] [port] [messages] [window]
+#
+# Expects pubsub-server and pubsub-bench in the current directory. Both ends
+# hold a socket per subscriber, so raise ulimit -n beyond 10k first.
+SUBS=${1:-10000}
+PORT=${2:-9090}
+MSGS=${3:-300}
+WINDOW=${4:-32}
+
+run() {
+    PORT=$((PORT + 1))
+    env "$@" LOG_LEVEL=warn ./pubsub-server "$PORT" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.3
+    ./pubsub-bench -n "$SUBS" -m "$MSGS" -s "$size" -w "$WINDOW" 127.0.0.1 "$PORT" |
+        awk '/deliveries/ {printf " %12s", $7}'
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+printf "%8s %12s %12s\n" size shared copied
+for size in 64 1024 16384; do
+    printf "%8s" $size
+    run PUBSUB_COPY=0
+    run PUBSUB_COPY=1
+    echo
+done
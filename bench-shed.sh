@@ -0,0 +1,51 @@
+#!/bin/sh
+# Latency of threadpool-server under 2x overload, with and without load
+# shedding. Each connection costs WORK_US of pool time before its ack, so the
+# 4 pool threads manage about 4000 connections/s; loadgen's open mode starts
+# twice that on a fixed schedule, however far behind the server falls.
+#
+# The last run has four echo clients hold all four pool threads for its
+# whole length, as long-lived connections do, so that no worker ever
+# dequeues; new connections then have to be turned away by the acceptor
+# rather than queue forever. Its open-mode clients should all come back
+# busy, in about SHED_TARGET_MS + SHED_INTERVAL_MS at most.
+#
+# usage: ./bench-shed.sh [port] [seconds] [rate]
+#
+# Expects threadpool-server and loadgen in the current directory.
+PORT=${1:-9090}
+SECS=${2:-5}
+RATE=${3:-8000}
+
+run() {
+    label=$1
+    shift
+    PORT=$((PORT + 1))
+    env "$@" WORK_US=1000 LOG_LEVEL=warn ./threadpool-server "$PORT" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    echo "=== $label"
+    # Latency counts from each connection's scheduled start to its '*' ack.
+    ./loadgen -t 2 -d "$SECS" -r "$RATE" open 127.0.0.1 "$PORT"
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+held() {
+    PORT=$((PORT + 1))
+    LOG_LEVEL=warn ./threadpool-server "$PORT" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    echo "=== CoDel shedding, every pool thread held by a long-lived connection"
+    ./loadgen -t 4 -d $((SECS + 1)) echo 127.0.0.1 "$PORT" >/dev/null 2>&1 &
+    holders=$!
+    sleep 0.3
+    ./loadgen -t 2 -d "$SECS" -r 100 open 127.0.0.1 "$PORT"
+    kill $pid
+    wait $pid $holders 2>/dev/null
+}
+
+run "no shedding" SHED_TARGET_MS=0
+run "CoDel shedding, 5 ms target"
+run "CoDel shedding, queue capped at 64" MAX_QUEUE=64
+held
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Echo round trips over loopback TCP, a Unix domain socket and shared-memory
+# rings: messages per second and latency, one message in flight per client.
+#
+# usage: ./bench-shm.sh [port] [seconds] [threads]
+#
+# Expects epoll-server, loadgen, shm-server and shm-bench in the current
+# directory. SHM_SPIN_US, if set, applies to both shm-server and shm-bench
+# (see shmring.h); spinning only pays off with a core to spare for each side.
+PORT=${1:-9090}
+SECS=${2:-3}
+THREADS=${3:-1}
+
+row() {
+    printf "%-5s %6s" "$transport" "$size"
+    awk '/\/s:/ {rate = $2} /latency/ {p50 = $3; p99 = $5}
+        END {sub("p50=", "", p50); sub("p99=", "", p99)
+             printf " %12s %10s %10s\n", rate, p50, p99}'
+}
+
+run() {
+    PORT=$((PORT + 1))
+    UNIX_SOCKET=@bench-shm-uds-$PORT SOCKET_TUNING=nodelay LOG_LEVEL=warn \
+        ./epoll-server "$PORT" >/dev/null 2>&1 &
+    server=$!
+    LOG_LEVEL=warn ./shm-server "@bench-shm-$PORT" >/dev/null 2>&1 &
+    shm=$!
+    sleep 0.3
+    transport=tcp
+    ./loadgen -t "$THREADS" -d "$SECS" -s "$size" echo 127.0.0.1 "$PORT" | row
+    transport=uds
+    ./loadgen -t "$THREADS" -d "$SECS" -s "$size" -u "@bench-shm-uds-$PORT" echo | row
+    transport=shm
+    ./shm-bench -t "$THREADS" -d "$SECS" -s "$size" "@bench-shm-$PORT" | row
+    kill $server $shm
+    wait $server $shm 2>/dev/null
+}
+
+printf "%-5s %6s %12s %10s %10s\n" via size msg/s p50-us p99-us
+for size in 16 1024 16384; do
+    run
+done
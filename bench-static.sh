@@ -0,0 +1,38 @@
+#!/bin/sh
+# The generic reactor against its compile-time specialized counterpart:
+# echo throughput and the server's CPU time per message, split into user
+# time (where the loop's indirection would show) and system time.
+#
+# usage: ./bench-static.sh [port] [seconds] [threads]
+#
+# Expects the binaries in the current directory, built as
+#   gcc -O2 -flto -pthread static-epoll-server.c protocol.c utils.c logger.c \
+#       metrics.c busypoll.c capture.c -o static-epoll-server
+# (epoll-server and loadgen as in bench-pollers.sh; epoll-server with -flto
+# too, to compare like with like).
+PORT=${1:-9090}
+SECS=${2:-5}
+THREADS=${3:-4}
+HZ=$(getconf CLK_TCK)
+
+run() {
+    PORT=$((PORT + 1))
+    POLLER=$poller SOCKET_TUNING=nodelay LOG_LEVEL=warn ./"$server" "$PORT" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.3
+    msgs=$(./loadgen -t "$THREADS" -d "$SECS" -s 16 echo 127.0.0.1 "$PORT" |
+        awk '/total/ {sub(",", "", $4); print $4}')
+    awk -v msgs="$msgs" -v secs="$SECS" -v hz="$HZ" -v name="$server $poller" '{
+        printf "%-28s %10.0f %10.0f %10.0f\n", name, msgs / secs,
+            $14 / hz * 1e9 / msgs, $15 / hz * 1e9 / msgs
+    }' /proc/$pid/stat
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+printf "%-28s %10s %10s %10s\n" server msg/s user-ns sys-ns
+for poller in epoll epoll-et; do
+    for server in epoll-server static-epoll-server; do
+        run
+    done
+done
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Connection-setup latency and per-connection memory of threaded-server,
+# with the pre-cache behaviour (default 8 MB stacks, a new thread per
+# connection) against cached threads on 64 KB stacks.
+#
+# usage: ./bench-threads.sh [port] [seconds] [idle_conns]
+#
+# Expects threaded-server and loadgen in the current directory. The idle
+# connections need `ulimit -n` above twice their number.
+PORT=${1:-9090}
+SECS=${2:-5}
+IDLE=${3:-2000}
+
+run() {
+    label=$1
+    shift
+    PORT=$((PORT + 1))
+    env "$@" LOG_LEVEL=warn ./threaded-server "$PORT" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    echo "=== $label"
+    # accept mode times connect until the '*' ack: thread setup included.
+    ./loadgen -t 2 -d "$SECS" accept 127.0.0.1 "$PORT"
+    before=$(awk '/VmRSS/ {print $2}' /proc/$pid/status)
+    ./loadgen -t 1 -d "$SECS" -c "$IDLE" echo 127.0.0.1 "$PORT" >/dev/null &
+    lg=$!
+    sleep $((SECS / 2 + 1))
+    after=$(awk '/VmRSS/ {print $2}' /proc/$pid/status)
+    grep -E "VmSize|Threads" /proc/$pid/status
+    echo "  RSS per connection: $(( (after - before) / IDLE )) KB"
+    wait $lg
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+run "per-connection threads, default stacks" THREAD_STACK_KB=0 THREAD_CACHE_MAX=0
+run "cached threads, 64 KB stacks" THREAD_PRESPAWN=64
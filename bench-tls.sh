@@ -0,0 +1,53 @@
+#!/bin/sh
+# Plaintext against kernel TLS on the same server: messages per second and
+# round-trip latency for echo (one message in flight per connection),
+# replies per second for flood, and connections per second, where every TLS
+# connection pays for a full handshake.
+#
+# usage: ./bench-tls.sh [server] [port] [seconds] [threads]
+#
+# Expects the server (epoll-server by default; any reactor server takes
+# TLS_CERT) and loadgen in the current directory, both built with
+# -DWITH_KTLS and linked with -lssl -lcrypto, and a kernel with the tls
+# module loaded. A self-signed certificate is made in a temporary directory.
+SERVER=${1:-epoll-server}
+PORT=${2:-9090}
+SECS=${3:-3}
+THREADS=${4:-4}
+
+CERTS=$(mktemp -d) || exit 1
+trap 'rm -rf "$CERTS"' EXIT
+./make-cert.sh "$CERTS" 2>/dev/null || exit 1
+
+run() {
+    for transport in plain tls; do
+        PORT=$((PORT + 1))
+        if [ "$transport" = tls ]; then
+            export TLS_CERT=$CERTS/cert.pem TLS_KEY=$CERTS/key.pem
+            flag=-T
+        else
+            unset TLS_CERT TLS_KEY
+            flag=
+        fi
+        SOCKET_TUNING=nodelay LOG_LEVEL=warn ./"$SERVER" "$PORT" >/dev/null 2>&1 &
+        pid=$!
+        sleep 0.3
+        printf "%-6s %-5s %6s" "$mode" "$transport" "$size"
+        ./loadgen $flag -t "$THREADS" -d "$SECS" -s "$size" "$mode" 127.0.0.1 "$PORT" |
+            awk '/\/s:/ {rate = $2} /latency/ {p50 = $3; p99 = $5}
+            END {sub("p50=", "", p50); sub("p99=", "", p99)
+                 printf " %12s %10s %10s\n", rate, p50, p99}'
+        kill $pid
+        wait $pid 2>/dev/null
+    done
+}
+
+printf "%-6s %-5s %6s %12s %10s %10s\n" mode via size rate/s p50-us p99-us
+mode=echo
+for size in 16 1024 16384; do
+    run
+done
+size=16
+for mode in flood accept; do
+    run
+done
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Measures the latency impact of each socket tuning knob (see socket_tuning_t
+# in utils.h) by running epoll-server under every SOCKET_TUNING profile below
+# and driving it with loadgen.
+#
+# usage: ./bench-tuning.sh [server] [port] [seconds]
+#
+# defer_accept is expected to look terrible: the server sends the '*' ack
+# first, so the kernel holds each connection until the timeout expires.
+#
+# Expects the server and loadgen binaries in the current directory, built as
+#   gcc -O2 -pthread epoll-server.c reactor.c poller.c protocol.c handoff.c \
+#       mailbox.c ktls.c utils.c logger.c metrics.c busypoll.c capture.c \
+#       -o epoll-server
+#   gcc -O2 -pthread loadgen.c ktls.c -o loadgen
+SERVER=${1:-./epoll-server}
+PORT=${2:-9090}
+SECS=${3:-5}
+
+PROFILES="
+none
+nodelay
+defer_accept=1
+fastopen=256
+rcvbuf=262144,sndbuf=262144
+busy_poll=50
+incoming_cpu=0
+ipv6
+nodelay,busy_poll=50,rcvbuf=262144,sndbuf=262144
+"
+
+for profile in $PROFILES; do
+    spec=$profile
+    [ "$profile" = none ] && spec=
+    SOCKET_TUNING=$spec LOG_LEVEL=warn $SERVER $PORT >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+    echo "=== SOCKET_TUNING=$profile"
+    ./loadgen -t 1 -d "$SECS" echo 127.0.0.1 "$PORT"
+    ./loadgen -t 4 -d "$SECS" accept 127.0.0.1 "$PORT"
+    kill $pid
+    wait $pid 2>/dev/null
+done
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Loopback TCP against a Unix domain socket on the same server: messages per
+# second and round-trip latency for echo (one message in flight per
+# connection), replies per second for flood, and connections per second.
+#
+# usage: ./bench-unix.sh [server] [port] [seconds] [threads]
+#
+# Expects the server (epoll-server by default; any of them takes
+# UNIX_SOCKET) and loadgen in the current directory.
+SERVER=${1:-epoll-server}
+PORT=${2:-9090}
+SECS=${3:-3}
+THREADS=${4:-4}
+
+load() {
+    if [ "$transport" = tcp ]; then
+        ./loadgen -t "$THREADS" -d "$SECS" -s "$size" "$mode" 127.0.0.1 "$PORT"
+    else
+        ./loadgen -t "$THREADS" -d "$SECS" -s "$size" -u "@bench-unix-$PORT" "$mode"
+    fi
+}
+
+run() {
+    PORT=$((PORT + 1))
+    UNIX_SOCKET=@bench-unix-$PORT SOCKET_TUNING=nodelay LOG_LEVEL=warn \
+        ./"$SERVER" "$PORT" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.3
+    for transport in tcp unix; do
+        printf "%-6s %-5s %6s" "$mode" "$transport" "$size"
+        load | awk '/\/s:/ {rate = $2} /latency/ {p50 = $3; p99 = $5}
+            END {sub("p50=", "", p50); sub("p99=", "", p99)
+                 printf " %12s %10s %10s\n", rate, p50, p99}'
+    done
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+printf "%-6s %-5s %6s %12s %10s %10s\n" mode via size rate/s p50-us p99-us
+mode=echo
+for size in 16 1024 16384; do
+    run
+done
+size=16
+for mode in flood accept; do
+    run
+done
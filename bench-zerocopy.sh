@@ -0,0 +1,33 @@
+#!/bin/sh
+# Echo throughput by reply size: the classic 1 KB path, the zero-copy mode's
+# in-place buffers with plain sends, and with MSG_ZEROCOPY for every reply.
+#
+# usage: ./bench-zerocopy.sh [port] [seconds]
+#
+# Expects epoll-server and loadgen in the current directory. Over loopback
+# the kernel copies zero-copy sends anyway and the server soon switches
+# such connections back to plain sends (see server_zerocopy_copied_total),
+# so the last column mostly measures that fallback; run the server on
+# another host to see zero-copy proper.
+PORT=${1:-9090}
+SECS=${2:-3}
+
+run() {
+    PORT=$((PORT + 1))
+    env "$@" SOCKET_TUNING=nodelay POLLER=epoll-et LOG_LEVEL=warn ./epoll-server "$PORT" >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.3
+    ./loadgen -t 1 -d "$SECS" -s "$size" echo 127.0.0.1 "$PORT" |
+        awk '/msg\/s/ {printf " %10s", $2}'
+    kill $pid
+    wait $pid 2>/dev/null
+}
+
+printf "%8s %10s %10s %10s\n" size classic in-place zerocopy
+for size in 512 2048 4096 8192 16384 32000; do
+    printf "%8s" $size
+    run
+    run ZEROCOPY_MIN_BYTES=100000000
+    run ZEROCOPY_MIN_BYTES=0
+    echo
+done
@@ -0,0 +1,120 @@
+#include "busypoll.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// Weight of the newest gap in the moving average, as a shift: 1/8.
+#define GAP_EWMA_SHIFT 3
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+void adaptive_poller_init(adaptive_poller_t *p, poll_mode_t mode, uint32_t max_spin_us)
+{
+    memset(p, 0, sizeof(*p));
+    p->mode = mode;
+    p->max_spin_ns = (uint64_t)max_spin_us * 1000;
+    p->spin_budget_ns = mode == POLL_MODE_BLOCK ? 0 : p->max_spin_ns;
+}
+
+int poll_mode_parse(const char *name)
+{
+    if (strcmp(name, "block") == 0) {
+        return POLL_MODE_BLOCK;
+    } else if (strcmp(name, "spin") == 0) {
+        return POLL_MODE_SPIN;
+    } else if (strcmp(name, "adaptive") == 0) {
+        return POLL_MODE_ADAPTIVE;
+    }
+    return -1;
+}
+
+// Feeds an arrival into the gap average and recomputes the spin budget.
+// Spinning only pays off when the next message usually shows up within the
+// budget, so the budget is about twice the average gap, and zero once the
+// average gap exceeds max_spin_ns.
+static void record_arrival(adaptive_poller_t *p, uint64_t now)
+{
+    if (p->last_arrival_ns != 0) {
+        uint64_t gap = now - p->last_arrival_ns;
+        if (p->avg_gap_ns == 0) {
+            p->avg_gap_ns = gap;
+        } else {
+            p->avg_gap_ns += ((int64_t)gap - (int64_t)p->avg_gap_ns) >> GAP_EWMA_SHIFT;
+        }
+    }
+    p->last_arrival_ns = now;
+
+    if (p->mode == POLL_MODE_ADAPTIVE) {
+        uint64_t budget = p->avg_gap_ns * 2;
+        p->spin_budget_ns = p->avg_gap_ns > p->max_spin_ns ? 0
+                          : budget > p->max_spin_ns ? p->max_spin_ns
+                          : budget;
+    }
+}
+
+ssize_t adaptive_recv(adaptive_poller_t *p, int sockfd, void *buf, size_t len)
+{
+    uint64_t start = p->spin_budget_ns > 0 ? now_ns() : 0;
+
+    while (1) {
+        ssize_t n = recv(sockfd, buf, len, MSG_DONTWAIT);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            if (n > 0 && p->mode != POLL_MODE_BLOCK) {
+                record_arrival(p, now_ns());
+            }
+            return n;
+        }
+
+        if (start != 0 && now_ns() - start < p->spin_budget_ns) {
+            cpu_relax();
+            continue;
+        }
+
+        struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            return -1;
+        }
+        start = 0;
+    }
+}
+
+int adaptive_wait(adaptive_poller_t *p, int (*wait)(void *arg, int timeout_ms), void *arg)
+{
+    if (p->spin_budget_ns > 0) {
+        uint64_t start = now_ns();
+        do {
+            int n = wait(arg, 0);
+            if (n != 0) {
+                if (n > 0) {
+                    record_arrival(p, now_ns());
+                }
+                return n;
+            }
+            cpu_relax();
+        } while (now_ns() - start < p->spin_budget_ns);
+    }
+
+    int n = wait(arg, -1);
+    if (n > 0 && p->mode != POLL_MODE_BLOCK) {
+        record_arrival(p, now_ns());
+    }
+    return n;
+}
@@ -0,0 +1,43 @@
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+// Low-latency waiting for socket input.
+//
+// Blocking in recv/epoll_wait costs a sleep and a wakeup (tens of
+// microseconds) per message. Spinning on a non-blocking call avoids that but
+// burns a core. The adaptive mode spins only for as long as the next message
+// is likely to take to arrive, based on a moving average of observed
+// inter-arrival gaps, and otherwise falls back to blocking.
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef enum {
+    POLL_MODE_BLOCK,    // Always block in the kernel.
+    POLL_MODE_SPIN,     // Spin for the full max_spin_us, then block.
+    POLL_MODE_ADAPTIVE, // Spin for a budget derived from inter-arrival gaps.
+} poll_mode_t;
+
+typedef struct {
+    poll_mode_t mode;
+    uint64_t max_spin_ns;
+    uint64_t spin_budget_ns;
+    uint64_t last_arrival_ns;
+    uint64_t avg_gap_ns;
+} adaptive_poller_t;
+
+void adaptive_poller_init(adaptive_poller_t *p, poll_mode_t mode, uint32_t max_spin_us);
+
+// Parses "block", "spin" or "adaptive". Returns -1 if unrecognized.
+int poll_mode_parse(const char *name);
+
+// recv() on a non-blocking socket that waits for data according to the
+// poller's mode. Returns like recv(); never returns EAGAIN.
+ssize_t adaptive_recv(adaptive_poller_t *p, int sockfd, void *buf, size_t len);
+
+// Waits for events through wait(arg, timeout_ms): first repeatedly with a
+// zero timeout for as long as the poller's mode allows, then with -1.
+// Returns what wait returned.
+int adaptive_wait(adaptive_poller_t *p, int (*wait)(void *arg, int timeout_ms), void *arg);
+
+#endif
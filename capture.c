@@ -0,0 +1,123 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+#define DEFAULT_MAX_MB 256
+
+static pthread_once_t capture_once = PTHREAD_ONCE_INIT;
+static uint8_t *log_base; // NULL when not capturing.
+static size_t log_size;
+static uint64_t start_ns;
+static _Atomic uint64_t log_tail; // Where the next record goes.
+static _Atomic uint32_t last_conn;
+static _Atomic bool full;
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void capture_init(void)
+{
+    const char *path = getenv("CAPTURE_PATH");
+    if (path == NULL) {
+        return;
+    }
+    size_t max_mb = DEFAULT_MAX_MB;
+    if (getenv("CAPTURE_MAX_MB") != NULL) {
+        max_mb = atoi(getenv("CAPTURE_MAX_MB"));
+    }
+    log_size = max_mb << 20;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open capture log");
+        exit(1);
+    }
+    if (ftruncate(fd, log_size) < 0) {
+        perror("ftruncate capture log");
+        exit(1);
+    }
+    log_base = mmap(NULL, log_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (log_base == MAP_FAILED) {
+        perror("mmap capture log");
+        exit(1);
+    }
+    close(fd);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    start_ns = monotonic_ns();
+    capture_header_t header = {.start_unix_ns = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec};
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    memcpy(log_base, &header, sizeof(header));
+    atomic_store(&log_tail, sizeof(header));
+    log_info("capturing traffic to %s (up to %zu MB)", path, max_mb);
+}
+
+static void append(uint32_t conn, capture_kind_t kind, const void *buf, size_t len)
+{
+    uint64_t now = monotonic_ns() - start_ns;
+    size_t size = CAPTURE_RECORD_SIZE(len);
+    uint64_t offset = atomic_fetch_add_explicit(&log_tail, size, memory_order_relaxed);
+    if (offset + size > log_size) {
+        if (!atomic_exchange(&full, true)) {
+            log_warn("capture log full, no longer capturing");
+        }
+        return;
+    }
+
+    capture_record_t *rec = (capture_record_t *)(log_base + offset);
+    rec->time_ns = now;
+    rec->conn = conn;
+    if (len > 0) {
+        memcpy(rec + 1, buf, len);
+    }
+    atomic_store_explicit((_Atomic uint32_t *)&rec->kind_len, (uint32_t)kind << 24 | len,
+                          memory_order_release);
+}
+
+uint32_t capture_open_conn(void)
+{
+    pthread_once(&capture_once, capture_init);
+    if (log_base == NULL) {
+        return 0;
+    }
+    uint32_t conn = atomic_fetch_add_explicit(&last_conn, 1, memory_order_relaxed) + 1;
+    append(conn, CAPTURE_OPEN, NULL, 0);
+    return conn;
+}
+
+void capture_data(uint32_t conn, const void *buf, size_t len)
+{
+    if (conn == 0) {
+        return;
+    }
+    // Payload lengths have 24 bits.
+    while (len > 0) {
+        size_t chunk = len < 0xffffff ? len : 0xffffff;
+        append(conn, CAPTURE_DATA, buf, chunk);
+        buf = (const uint8_t *)buf + chunk;
+        len -= chunk;
+    }
+}
+
+void capture_close_conn(uint32_t conn)
+{
+    if (conn != 0) {
+        append(conn, CAPTURE_CLOSE, NULL, 0);
+    }
+}
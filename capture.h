@@ -0,0 +1,56 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Traffic capture: records what every connection sends the server, with
+// timestamps, so that the replay tool can re-drive it later against any
+// server.
+//
+// Set CAPTURE_PATH to turn it on. The log is a file of CAPTURE_MAX_MB (256
+// by default) mapped into memory and filled front to back: a writer claims
+// its record's space with one atomic add and copies the record in, so
+// capturing costs no system calls or locks on the serving path. The file is
+// sparse until written, and whatever was written survives the server being
+// killed. Once it's full, further traffic isn't recorded.
+//
+// Layout, in host byte order: a capture_header_t, then capture_record_t
+// headers each followed by len payload bytes and padded to 8-byte
+// alignment. Records are in the order their space was claimed, which can
+// differ slightly from timestamp order across threads. A record whose kind
+// is still zero hasn't been written, and marks the end of the log.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "ECHOCAP1"
+
+typedef struct {
+    char magic[8];
+    uint64_t start_unix_ns; // Wall clock time of time_ns 0.
+} capture_header_t;
+
+typedef enum {
+    CAPTURE_OPEN = 1, // The connection was accepted.
+    CAPTURE_DATA,     // The payload arrived on it.
+    CAPTURE_CLOSE,    // It was closed.
+} capture_kind_t;
+
+typedef struct {
+    uint64_t time_ns; // Since the capture started.
+    uint32_t conn;    // Numbered from 1 in order of acceptance.
+    // kind << 24 | payload length. Stored last, so that a nonzero kind means
+    // the rest of the record is there.
+    uint32_t kind_len;
+} capture_record_t;
+
+#define CAPTURE_KIND(kind_len) ((kind_len) >> 24)
+#define CAPTURE_LEN(kind_len) ((kind_len) & 0xffffff)
+#define CAPTURE_RECORD_SIZE(len) ((sizeof(capture_record_t) + (len) + 7) & ~(size_t)7)
+
+// Records a new connection and returns its id, or 0 when not capturing.
+uint32_t capture_open_conn(void);
+
+// Record traffic on the connection opened as conn; no-ops for conn 0.
+void capture_data(uint32_t conn, const void *buf, size_t len);
+void capture_close_conn(uint32_t conn);
+
+#endif
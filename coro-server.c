@@ -0,0 +1,181 @@
+// Coroutine server on the shared reactor.
+//
+// serve_connection below is the same straight-line code as in
+// threaded-server, but every connection runs as a stackless coroutine (see
+// coro.h) that suspends on EAGAIN, and yields after each reply so that no
+// connection holds its loop, so a few event loops serve any number of
+// connections at roughly the memory cost of their frames. Clients may opt
+// into the binary framing of framing.h after the ack.
+//
+// usage: coro-server [port] [num_event_loops]
+//
+// epoll by default; POLLER and the other knobs in reactor.h apply.
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "capture.h"
+#include "coro.h"
+#include "framing.h"
+#include "logger.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "utils.h"
+
+#define MAXFDS 16384
+
+typedef enum { WAIT_FOR_FRAMING, WAIT_FOR_MSG, IN_MSG, FRAMED } ProcessingState;
+
+// serve_connection's frame: everything it keeps across awaits.
+typedef struct {
+    coro_t co;
+    int sockfd;
+    uint32_t capture_conn;
+    ProcessingState state;
+    frame_decoder_t frame;
+    ssize_t len;
+    int outlen;
+    bool ok;
+    uint8_t buf[1024];
+} connection_t;
+
+static connection_t *connections[MAXFDS];
+
+// Each event loop allocates and frees the frames of its own connections.
+static __thread frame_pool_t frame_pool;
+
+static fd_status_t serve_connection(connection_t *c)
+{
+    CO_BEGIN(&c->co);
+
+    CO_AWAIT_SEND(&c->co, c->sockfd, "*", 1, c->ok);
+    if (!c->ok) {
+        CO_EXIT(&c->co);
+    }
+    c->state = WAIT_FOR_FRAMING;
+
+    while (1) {
+        CO_AWAIT_RECV(&c->co, c->sockfd, c->buf, sizeof(c->buf), c->len);
+        if (c->len <= 0) {
+            break;
+        }
+        metrics_add(METRIC_BYTES_RECEIVED, c->len);
+        capture_data(c->capture_conn, c->buf, c->len);
+
+        // Replies are built in place; a reply byte never overtakes its input.
+        c->outlen = 0;
+        for (int i = 0; i < c->len; ++i) {
+            switch (c->state) {
+            case WAIT_FOR_FRAMING:
+                if (c->buf[i] == FRAMING_BINARY_MAGIC) {
+                    c->state = FRAMED;
+                    frame_decoder_init(&c->frame);
+                    break;
+                }
+                c->state = WAIT_FOR_MSG;
+                __attribute__((fallthrough));
+            case WAIT_FOR_MSG:
+                if (c->buf[i] == '^') {
+                    c->state = IN_MSG;
+                }
+                break;
+            case IN_MSG:
+                if (c->buf[i] == '$') {
+                    c->state = WAIT_FOR_MSG;
+                    metrics_add(METRIC_MESSAGES, 1);
+                } else {
+                    c->buf[c->outlen++] = c->buf[i] + 1;
+                }
+                break;
+            case FRAMED:
+                // The rest is frames, replied to byte for byte.
+                metrics_add(METRIC_MESSAGES, frame_transform(&c->frame, &c->buf[i], c->len - i,
+                                                             &c->buf[c->outlen]));
+                c->outlen += c->len - i;
+                i = c->len;
+                break;
+            }
+        }
+
+        if (c->outlen > 0) {
+            CO_AWAIT_SEND(&c->co, c->sockfd, c->buf, c->outlen, c->ok);
+            if (!c->ok) {
+                break;
+            }
+            metrics_add(METRIC_BYTES_SENT, c->outlen);
+        }
+        // One buffer per call, so that a client that keeps the socket
+        // readable can't hold the event loop.
+        CO_YIELD(&c->co, fd_status_R);
+    }
+
+    CO_END(&c->co);
+}
+
+static fd_status_t on_peer_connected(int sockfd, const struct sockaddr *peer_addr,
+                                     socklen_t peer_addr_len)
+{
+    assert(sockfd < MAXFDS);
+    report_peer_connected(sockfd, peer_addr, peer_addr_len);
+
+    if (frame_pool.frame_size == 0) {
+        frame_pool_init(&frame_pool, sizeof(connection_t), 256);
+    }
+    connection_t *c = frame_pool_alloc(&frame_pool);
+    coro_init(&c->co);
+    c->sockfd = sockfd;
+    c->capture_conn = capture_open_conn();
+    connections[sockfd] = c;
+
+    // Run up to the first await right away; usually the ack goes out here.
+    return serve_connection(c);
+}
+
+// The coroutine knows what it is waiting for, so both readiness handlers
+// just resume it.
+static fd_status_t on_peer_ready(int sockfd)
+{
+    return serve_connection(connections[sockfd]);
+}
+
+static void on_peer_closed(int sockfd)
+{
+    capture_close_conn(connections[sockfd]->capture_conn);
+    frame_pool_free(&frame_pool, connections[sockfd]);
+    connections[sockfd] = NULL;
+}
+
+int main(int argc, const char **argv)
+{
+    logger_init(LOG_LEVEL_INFO);
+
+    int portnum = 9090;
+    if (argc >= 2) {
+        portnum = atoi(argv[1]);
+    }
+    int num_threads = 1;
+    if (argc >= 3) {
+        num_threads = atoi(argv[2]);
+        if (num_threads < 1) {
+            num_threads = 1;
+        }
+    }
+
+    reactor_config_t config;
+    reactor_config_init(&config, "epoll");
+    config.handlers = (reactor_handlers_t){
+        .on_peer_connected = on_peer_connected,
+        .on_peer_ready_recv = on_peer_ready,
+        .on_peer_ready_send = on_peer_ready,
+        .on_peer_closed = on_peer_closed,
+    };
+    config.maxfds = MAXFDS;
+    log_info("listening on port %d, backlog %d", portnum, listen_backlog());
+    config.listen_fd = listen_inet_socket(portnum);
+    make_socket_non_blocking(config.listen_fd);
+
+    reactor_run(&config, num_threads);
+    return 0;
+}
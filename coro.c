@@ -0,0 +1,33 @@
+#include "coro.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Frames are rounded up to a cache line so that neighbours in a slab never
+// share one.
+#define FRAME_ALIGN 64
+
+void frame_pool_init(frame_pool_t *pool, size_t frame_size, size_t slab_frames)
+{
+    if (frame_size < sizeof(void *)) {
+        frame_size = sizeof(void *);
+    }
+    pool->frame_size = (frame_size + FRAME_ALIGN - 1) & ~(size_t)(FRAME_ALIGN - 1);
+    pool->slab_frames = slab_frames;
+    pool->free_list = NULL;
+}
+
+void frame_pool_refill(frame_pool_t *pool)
+{
+    // Slabs are never returned: the pool only grows to the peak number of
+    // live coroutines.
+    uint8_t *slab = aligned_alloc(FRAME_ALIGN, pool->frame_size * pool->slab_frames);
+    if (slab == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    for (size_t i = pool->slab_frames; i > 0; i--) {
+        frame_pool_free(pool, slab + (i - 1) * pool->frame_size);
+    }
+}
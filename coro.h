@@ -0,0 +1,124 @@
+#ifndef CORO_H
+#define CORO_H
+
+// Stackless coroutines for reactor handlers.
+//
+// A coroutine is a function taking its frame, with its body between CO_BEGIN
+// and CO_END. CO_AWAIT_RECV and CO_AWAIT_SEND do the I/O and, when the socket
+// isn't ready, suspend by returning the matching blocked fd_status_t to the
+// reactor; CO_YIELD suspends with the socket still ready. Calling the
+// function again resumes at the await. This is the switch-on-line-number
+// technique from protothreads, so a suspended coroutine costs only its
+// frame and a resume is a single jump.
+//
+// Locals don't survive a suspension: whatever is needed across an await has
+// to live in the frame. Awaits can't appear inside a switch statement of the
+// body, and at most one can appear per source line.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "reactor.h"
+
+typedef struct {
+    int resume_line; // 0 before the first run, -1 once finished.
+    size_t sent;     // Progress of the CO_AWAIT_SEND in flight.
+} coro_t;
+
+static inline void coro_init(coro_t *co)
+{
+    co->resume_line = 0;
+    co->sent = 0;
+}
+
+#define CO_BEGIN(co) switch ((co)->resume_line) { case 0:
+
+#define CO_END(co) } (co)->resume_line = -1; return fd_status_NORW
+
+// Finishes the coroutine early; the reactor then closes the connection.
+#define CO_EXIT(co) do { (co)->resume_line = -1; return fd_status_NORW; } while (0)
+
+// Receives up to len bytes from fd into buf, suspending until there is input.
+// Sets n as recv() returns it, except that it's never an EAGAIN failure.
+#define CO_AWAIT_RECV(co, fd, buf, len, n)                              \
+    do {                                                                \
+        (co)->resume_line = __LINE__;                                   \
+        __attribute__((fallthrough));                                   \
+        case __LINE__:                                                  \
+        (n) = recv((fd), (buf), (len), 0);                              \
+        if ((n) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {     \
+            return fd_status_R_BLOCKED;                                 \
+        }                                                               \
+    } while (0)
+
+// Suspends, returning status (not a blocked one) to the reactor, which
+// resumes the coroutine past the yield the next time the connection is
+// ready. Lets a handler do one buffer's worth of work per call, as the
+// reactor's fairness (FAIR_BUDGET in reactor.h) expects, however much input
+// keeps arriving.
+#define CO_YIELD(co, status)                                            \
+    do {                                                                \
+        (co)->resume_line = __LINE__;                                   \
+        return (status);                                                \
+        case __LINE__:;                                                 \
+    } while (0)
+
+// Sends all len bytes of buf, suspending whenever the socket buffer is full;
+// buf must therefore live in the frame (or be static). Sets ok to false if
+// the connection failed.
+#define CO_AWAIT_SEND(co, fd, buf, len, ok)                             \
+    do {                                                                \
+        (co)->sent = 0;                                                 \
+        (co)->resume_line = __LINE__;                                   \
+        __attribute__((fallthrough));                                   \
+        case __LINE__:                                                  \
+        (ok) = true;                                                    \
+        while ((co)->sent < (size_t)(len)) {                            \
+            ssize_t n_ = send((fd), (const char *)(buf) + (co)->sent,   \
+                              (size_t)(len) - (co)->sent, MSG_NOSIGNAL);\
+            if (n_ < 0) {                                               \
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {          \
+                    return fd_status_W_BLOCKED;                         \
+                }                                                       \
+                (ok) = false;                                           \
+                break;                                                  \
+            }                                                           \
+            (co)->sent += n_;                                           \
+        }                                                               \
+    } while (0)
+
+// Allocator for fixed-size coroutine frames: a free list refilled one slab
+// at a time, so starting and finishing a coroutine is a pointer pop and push
+// rather than a trip through malloc. Not thread-safe; give each event loop
+// its own pool.
+typedef struct {
+    size_t frame_size;
+    size_t slab_frames;
+    void *free_list;
+} frame_pool_t;
+
+void frame_pool_init(frame_pool_t *pool, size_t frame_size, size_t slab_frames);
+
+// Adds a slab of frames to the free list. Exits if out of memory.
+void frame_pool_refill(frame_pool_t *pool);
+
+static inline void *frame_pool_alloc(frame_pool_t *pool)
+{
+    if (pool->free_list == NULL) {
+        frame_pool_refill(pool);
+    }
+    void *frame = pool->free_list;
+    pool->free_list = *(void **)frame;
+    return frame;
+}
+
+static inline void frame_pool_free(frame_pool_t *pool, void *frame)
+{
+    *(void **)frame = pool->free_list;
+    pool->free_list = frame;
+}
+
+#endif
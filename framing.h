@@ -0,0 +1,78 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+// Length-prefixed binary framing, the alternative to ^...$.
+//
+// A client opts in by making NUL the first byte it sends after the '*' ack.
+// From then on, both ways, the stream is a sequence of frames: a 4-byte
+// little-endian payload length, then that many payload bytes. The server
+// answers every frame with a frame of the same length, each payload byte
+// incremented by one. Payloads may hold any byte, '$' included, and the
+// server never scans them for a delimiter: a header says where the next
+// one is, and everything up to it is transformed in bulk.
+//
+// Legacy clients start with '^' (a NUL outside ^...$ would be ignored
+// anyway), so both framings share a port. The servers on protocol.c and
+// coro-server speak it; the blocking servers don't.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAMING_BINARY_MAGIC 0
+#define FRAME_HEADER_SIZE 4
+
+typedef struct {
+    uint32_t len;  // Payload length, as much of it as the header gave yet.
+    uint32_t left; // Header or payload bytes still to come.
+    bool in_header;
+} frame_decoder_t;
+
+static inline void frame_decoder_init(frame_decoder_t *d)
+{
+    d->len = 0;
+    d->left = FRAME_HEADER_SIZE;
+    d->in_header = true;
+}
+
+static inline void frame_put_header(uint8_t *out, uint32_t len)
+{
+    for (int i = 0; i < FRAME_HEADER_SIZE; i++) {
+        out[i] = len >> (8 * i);
+    }
+}
+
+// Writes the reply to n bytes of framed input to out, which may be in: a
+// reply is exactly as long as its input, headers included, so it can be
+// built over it. Frames may be split anywhere across calls. Returns the
+// number of frames completed.
+static inline int frame_transform(frame_decoder_t *d, const uint8_t *in, size_t n, uint8_t *out)
+{
+    int frames = 0;
+    size_t i = 0;
+    while (i < n) {
+        if (d->in_header) {
+            d->len |= (uint32_t)in[i] << (8 * (FRAME_HEADER_SIZE - d->left));
+            out[i] = in[i];
+            i++;
+            if (--d->left == 0) {
+                d->in_header = false;
+                d->left = d->len;
+            }
+        } else {
+            size_t span = n - i < d->left ? n - i : d->left;
+            for (size_t j = i; j < i + span; j++) {
+                out[j] = in[j] + 1;
+            }
+            i += span;
+            d->left -= span;
+        }
+        if (!d->in_header && d->left == 0) {
+            frames++;
+            frame_decoder_init(d);
+        }
+    }
+    return frames;
+}
+
+#endif
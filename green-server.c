@@ -0,0 +1,107 @@
+// Green-thread server: threaded-server's serve_connection (serve.c),
+// unchanged, with a green thread per connection instead of an OS thread. The
+// blocking recv and send calls park the green thread rather than the OS
+// thread (see green.h), so a few OS threads serve any number of connections,
+// each costing a small stack.
+//
+// usage: green-server [port] [num_os_threads]
+//
+// With UNIX_SOCKET set, each scheduler also accepts on that Unix socket; see
+// listen_unix_socket.
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "green.h"
+#include "logger.h"
+#include "serve.h"
+#include "utils.h"
+
+// How long an acceptor waits when out of descriptors before trying again.
+#define ACCEPT_BACKOFF_MS 100
+
+static int listen_fd;
+static int unix_fd = -1;
+
+static void connection_thread(void *arg)
+{
+    int sockfd = (int)(intptr_t)arg;
+    serve_connection(sockfd);
+}
+
+// Each scheduler runs one of these per listener; whichever is woken for a
+// connection serves it on its own OS thread.
+static void acceptor_thread(void *arg)
+{
+    int sockfd = (int)(intptr_t)arg;
+    bool out_of_fds = false;
+
+    while (1) {
+        struct sockaddr_storage peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+
+        int newfd = accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+        if (newfd < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                // The connection stays queued, so retrying at once would
+                // spin; warn once per shortage.
+                if (!out_of_fds) {
+                    log_warn("accept: %s; retrying every %d ms", strerror(errno),
+                             ACCEPT_BACKOFF_MS);
+                    out_of_fds = true;
+                }
+                green_sleep_ms(ACCEPT_BACKOFF_MS);
+            } else {
+                log_warn("accept: %s", strerror(errno));
+                green_yield();
+            }
+            continue;
+        }
+        out_of_fds = false;
+
+        tune_accepted_socket(newfd);
+        report_peer_connected(newfd, (struct sockaddr*)&peer_addr, peer_addr_len);
+        green_spawn(connection_thread, (void *)(intptr_t)newfd);
+    }
+}
+
+static void scheduler_main(void *arg)
+{
+    if (unix_fd >= 0) {
+        green_spawn(acceptor_thread, (void *)(intptr_t)unix_fd);
+    }
+    acceptor_thread((void *)(intptr_t)listen_fd);
+}
+
+int main(int argc, char **argv)
+{
+    logger_init(LOG_LEVEL_INFO);
+
+    int portnum = 9090;
+    if (argc >= 2) {
+        portnum = atoi(argv[1]);
+    }
+    int num_threads = 1;
+    if (argc >= 3) {
+        num_threads = atoi(argv[2]);
+        if (num_threads < 1) {
+            num_threads = 1;
+        }
+    }
+    log_info("Serving on port %d with %d scheduler thread(s)", portnum, num_threads);
+
+    listen_fd = listen_inet_socket(portnum);
+    const char *unix_path = getenv("UNIX_SOCKET");
+    if (unix_path != NULL) {
+        unix_fd = listen_unix_socket(unix_path);
+        log_info("Serving on Unix socket %s", unix_path);
+    }
+    green_run(num_threads, scheduler_main, NULL);
+    return 0;
+}
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include "green.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+#define DEFAULT_STACK_KB 64
+#define MAX_EVENTS 256
+
+// Fds below this have their epoll registration state tracked per scheduler;
+// others fall back to trial and error on epoll_ctl.
+#define MAX_TRACKED_FDS 65536
+
+// Per-fd flags in scheduler_t.fd_flags.
+#define FD_REGISTERED 0x1 // In this scheduler's epoll set.
+#define FD_NONBLOCKING 0x2 // Listener we made O_NONBLOCK for accept.
+
+typedef struct {
+#if defined(__x86_64__)
+    void *sp;
+#else
+    ucontext_t uc;
+#endif
+} green_context_t;
+
+typedef struct green_thread {
+    green_context_t context;
+    struct green_thread *next; // Run queue, sleep list or free list.
+    uint64_t wake_ns;          // When to wake, while on the sleep list.
+    void (*fn)(void *arg);
+    void *arg;
+    uint8_t *mapping; // Guard page and stack; this struct sits at the top.
+    bool done;
+} green_thread_t;
+
+typedef struct {
+    green_context_t context; // The scheduler's own, on the OS thread's stack.
+    int epollfd;
+    green_thread_t *ready_head;
+    green_thread_t *ready_tail;
+    green_thread_t *free_threads; // Finished, keeping their stacks for reuse.
+    green_thread_t *sleeping;     // In green_sleep_ms, earliest wake first.
+    uint8_t *fd_flags;
+} scheduler_t;
+
+static size_t page_size;
+static size_t stack_size;
+
+static __thread scheduler_t *sched;
+static __thread green_thread_t *current;
+
+#if defined(__x86_64__)
+// Saves the callee-saved registers on the current stack, stores the stack
+// pointer in from->sp, and resumes the context saved in to->sp. Everything
+// else is caller-saved under the SysV ABI, so the compiler already spilled it.
+void green_switch(green_context_t *from, green_context_t *to);
+__asm__(
+    ".text\n"
+    ".globl green_switch\n"
+    ".hidden green_switch\n"
+    ".type green_switch, @function\n"
+    "green_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size green_switch, .-green_switch\n");
+#else
+static void green_switch(green_context_t *from, green_context_t *to)
+{
+    swapcontext(&from->uc, &to->uc);
+}
+#endif
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void make_ready(green_thread_t *t)
+{
+    t->next = NULL;
+    if (sched->ready_tail != NULL) {
+        sched->ready_tail->next = t;
+    } else {
+        sched->ready_head = t;
+    }
+    sched->ready_tail = t;
+}
+
+// First frame of every green thread; never returns.
+static void green_thread_main(void)
+{
+    green_thread_t *t = current;
+    t->fn(t->arg);
+    t->done = true;
+    green_switch(&t->context, &sched->context);
+    abort();
+}
+
+static green_thread_t *new_thread(void)
+{
+    green_thread_t *t = sched->free_threads;
+    if (t != NULL) {
+        sched->free_threads = t->next;
+        return t;
+    }
+
+    size_t mapping_size = page_size + stack_size;
+    uint8_t *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (mapping == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (mprotect(mapping, page_size, PROT_NONE) < 0) {
+        perror("mprotect");
+        exit(1);
+    }
+    uintptr_t top = (uintptr_t)(mapping + mapping_size) - sizeof(green_thread_t);
+    t = (green_thread_t *)(top & ~(uintptr_t)63);
+    t->mapping = mapping;
+    return t;
+}
+
+void green_spawn(void (*fn)(void *arg), void *arg)
+{
+    green_thread_t *t = new_thread();
+    t->fn = fn;
+    t->arg = arg;
+    t->done = false;
+
+#if defined(__x86_64__)
+    // A frame for green_switch to pop: six zeroed registers and a return
+    // address. Entering green_thread_main by "ret" leaves rsp 8 off a
+    // 16-byte boundary, as after a call.
+    uintptr_t top = (uintptr_t)t & ~(uintptr_t)15;
+    void **frame = (void **)(top - 64);
+    memset(frame, 0, 6 * sizeof(void *));
+    frame[6] = (void *)green_thread_main;
+    t->context.sp = frame;
+#else
+    getcontext(&t->context.uc);
+    t->context.uc.uc_stack.ss_sp = t->mapping + page_size;
+    t->context.uc.uc_stack.ss_size = (uint8_t *)t - (t->mapping + page_size);
+    t->context.uc.uc_link = NULL;
+    makecontext(&t->context.uc, green_thread_main, 0);
+#endif
+    make_ready(t);
+}
+
+// Switches from the current green thread back to the scheduler.
+static void suspend(void)
+{
+    green_switch(&current->context, &sched->context);
+}
+
+void green_yield(void)
+{
+    make_ready(current);
+    suspend();
+}
+
+void green_wait_fd(int fd, uint32_t events)
+{
+    // One-shot, so that a registration never outlives the wait: the fd is
+    // re-armed (MOD) by the next wait rather than re-added.
+    struct epoll_event ev = {.events = events | EPOLLONESHOT, .data.ptr = current};
+    bool tracked = fd < MAX_TRACKED_FDS;
+    int op = tracked && (sched->fd_flags[fd] & FD_REGISTERED) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(sched->epollfd, op, fd, &ev) < 0) {
+        // Our notion is stale: the fd was closed (dropping it from the set)
+        // and its number reused, or it's untracked.
+        op = errno == ENOENT ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(sched->epollfd, op, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+    if (tracked) {
+        sched->fd_flags[fd] |= FD_REGISTERED;
+    }
+    suspend();
+}
+
+void green_sleep_ms(int ms)
+{
+    current->wake_ns = now_ns() + (uint64_t)ms * 1000000;
+    green_thread_t **p = &sched->sleeping;
+    while (*p != NULL && (*p)->wake_ns <= current->wake_ns) {
+        p = &(*p)->next;
+    }
+    current->next = *p;
+    *p = current;
+    suspend();
+}
+
+// How long epoll_wait may block: until the first sleeper is due, if any.
+static int poll_timeout(void)
+{
+    if (sched->ready_head != NULL) {
+        return 0;
+    }
+    if (sched->sleeping == NULL) {
+        return -1;
+    }
+    uint64_t now = now_ns();
+    uint64_t wake = sched->sleeping->wake_ns;
+    return wake <= now ? 0 : (int)((wake - now + 999999) / 1000000);
+}
+
+static void wake_sleepers(void)
+{
+    uint64_t now = now_ns();
+    while (sched->sleeping != NULL && sched->sleeping->wake_ns <= now) {
+        green_thread_t *t = sched->sleeping;
+        sched->sleeping = t->next;
+        make_ready(t);
+    }
+}
+
+static void run_scheduler(void)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // Run what is runnable now; threads made ready meanwhile go in the
+        // next round, after polling, so I/O isn't starved by yielders.
+        green_thread_t *t = sched->ready_head;
+        sched->ready_head = sched->ready_tail = NULL;
+        while (t != NULL) {
+            green_thread_t *next = t->next;
+            current = t;
+            green_switch(&sched->context, &t->context);
+            current = NULL;
+            if (t->done) {
+                t->next = sched->free_threads;
+                sched->free_threads = t;
+            }
+            t = next;
+        }
+
+        int nready = epoll_wait(sched->epollfd, events, MAX_EVENTS, poll_timeout());
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < nready; i++) {
+            make_ready(events[i].data.ptr);
+        }
+        wake_sleepers();
+    }
+}
+
+typedef struct {
+    void (*main_fn)(void *arg);
+    void *arg;
+} run_args_t;
+
+static void *scheduler_thread(void *arg)
+{
+    const run_args_t *args = arg;
+
+    sched = calloc(1, sizeof(*sched));
+    if (sched == NULL || (sched->fd_flags = calloc(MAX_TRACKED_FDS, 1)) == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    sched->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (sched->epollfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    green_spawn(args->main_fn, args->arg);
+    run_scheduler();
+    return NULL;
+}
+
+void green_run(int num_threads, void (*main_fn)(void *arg), void *arg)
+{
+    page_size = sysconf(_SC_PAGESIZE);
+    long stack_kb = DEFAULT_STACK_KB;
+    if (getenv("GREEN_STACK_KB") != NULL) {
+        stack_kb = atol(getenv("GREEN_STACK_KB"));
+    }
+    stack_size = ((stack_kb > 0 ? stack_kb : 0) * 1024 + page_size - 1) & ~(page_size - 1);
+    // The green_thread_t and the first frame sit at the top of the stack;
+    // keep at least a page below them, clear of the guard page.
+    size_t min_size = ((sizeof(green_thread_t) + 128 + page_size - 1) & ~(page_size - 1)) +
+                      page_size;
+    if (stack_size < min_size) {
+        stack_size = min_size;
+    }
+
+    static run_args_t args;
+    args.main_fn = main_fn;
+    args.arg = arg;
+    for (int i = 1; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, scheduler_thread, &args) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    scheduler_thread(&args);
+}
+
+// The interposed socket calls. They go to the kernel through syscall()
+// directly, since the libc versions are the ones being replaced.
+
+ssize_t recv(int sockfd, void *buf, size_t len, int flags)
+{
+    if (current == NULL || (flags & MSG_DONTWAIT)) {
+        return syscall(SYS_recvfrom, sockfd, buf, len, flags, NULL, NULL);
+    }
+    while (1) {
+        ssize_t n = syscall(SYS_recvfrom, sockfd, buf, len, flags | MSG_DONTWAIT, NULL, NULL);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return n;
+        }
+        green_wait_fd(sockfd, EPOLLIN);
+    }
+}
+
+ssize_t send(int sockfd, const void *buf, size_t len, int flags)
+{
+    if (current == NULL || (flags & MSG_DONTWAIT)) {
+        return syscall(SYS_sendto, sockfd, buf, len, flags, NULL, 0);
+    }
+    // A blocking send only returns once everything is queued.
+    size_t sent = 0;
+    while (1) {
+        ssize_t n = syscall(SYS_sendto, sockfd, (const uint8_t *)buf + sent, len - sent,
+                            flags | MSG_DONTWAIT, NULL, 0);
+        if (n >= 0) {
+            sent += n;
+            if (sent == len) {
+                return sent;
+            }
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            green_wait_fd(sockfd, EPOLLOUT);
+        } else {
+            return sent > 0 ? (ssize_t)sent : -1;
+        }
+    }
+}
+
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags)
+{
+    if (current == NULL) {
+        return syscall(SYS_accept4, sockfd, addr, addrlen, flags);
+    }
+    // accept has no per-call MSG_DONTWAIT, so the listener itself has to be
+    // non-blocking.
+    if (sockfd >= MAX_TRACKED_FDS || !(sched->fd_flags[sockfd] & FD_NONBLOCKING)) {
+        int fl = fcntl(sockfd, F_GETFL, 0);
+        if (fl >= 0 && !(fl & O_NONBLOCK)) {
+            fcntl(sockfd, F_SETFL, fl | O_NONBLOCK);
+        }
+        if (sockfd < MAX_TRACKED_FDS) {
+            sched->fd_flags[sockfd] |= FD_NONBLOCKING;
+        }
+    }
+    while (1) {
+        int fd = syscall(SYS_accept4, sockfd, addr, addrlen, flags);
+        if (fd >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return fd;
+        }
+        green_wait_fd(sockfd, EPOLLIN);
+    }
+}
+
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    return accept4(sockfd, addr, addrlen, 0);
+}
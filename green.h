@@ -0,0 +1,46 @@
+#ifndef GREEN_H
+#define GREEN_H
+
+// M:N green threads: many user-space threads multiplexed over a few OS
+// threads, each of which runs a scheduler around its own epoll set.
+//
+// Green threads run on small mmap'd stacks (GREEN_STACK_KB, 64 by default,
+// at least two pages) with a PROT_NONE guard page below, so an overflow
+// faults instead of corrupting a neighbour. Only touched stack pages cost
+// memory. Switching saves the callee-saved registers and swaps stack
+// pointers in a few instructions of hand-written assembly on x86-64, and
+// uses ucontext elsewhere. Each stack is two mappings, so more than ~32k live green
+// threads need vm.max_map_count raised.
+//
+// recv, send, accept and accept4 are interposed. Called on a green thread,
+// they try the operation without blocking and, on EAGAIN, park the green
+// thread until epoll reports the fd ready, letting the scheduler run the
+// others; sockets used this way behave as blocking sockets whatever their
+// O_NONBLOCK flag says (pass MSG_DONTWAIT to get EAGAIN). That lets
+// blocking-style code like threaded-server's serve_connection run
+// unmodified. Called from an ordinary thread, they behave as usual.
+//
+// Scheduling is cooperative: a green thread runs until it parks, yields or
+// returns, and stays on the OS thread that spawned it.
+
+#include <stdint.h>
+
+// Starts num_threads schedulers, the calling thread becoming the first, and
+// spawns main_fn(arg) as the first green thread of each. Never returns.
+void green_run(int num_threads, void (*main_fn)(void *arg), void *arg);
+
+// Spawns fn(arg) on the calling green thread's scheduler.
+void green_spawn(void (*fn)(void *arg), void *arg);
+
+// Lets the other runnable green threads of this scheduler go first.
+void green_yield(void);
+
+// Parks the calling green thread for at least ms milliseconds, letting the
+// scheduler run the others meanwhile.
+void green_sleep_ms(int ms);
+
+// Parks the calling green thread until fd is ready for events (EPOLLIN
+// and/or EPOLLOUT).
+void green_wait_fd(int fd, uint32_t events);
+
+#endif
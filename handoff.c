@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+#include "handoff.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Every message starts with one of these. A batch is followed by entries of
+// [kind:1][state length:2, little-endian][state], one per attached fd.
+#define FRAME_BATCH 'B'
+#define FRAME_END 'E'
+
+#define ENTRY_HEADER 3
+
+static void fill_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "handoff path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr->sun_path, path);
+}
+
+int handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    fill_addr(&addr, path);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("ERROR opening handoff socket");
+        exit(1);
+    }
+    // Whoever bound it before has either handed off to us or is gone.
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("ERROR on binding handoff socket");
+        exit(1);
+    }
+    if (listen(sock, 1) < 0) {
+        perror("ERROR on listen");
+        exit(1);
+    }
+    return sock;
+}
+
+int handoff_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    fill_addr(&addr, path);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        perror("ERROR opening handoff socket");
+        exit(1);
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (errno == ENOENT || errno == ECONNREFUSED) {
+            close(sock);
+            return -1;
+        }
+        perror("ERROR connecting to handoff socket");
+        exit(1);
+    }
+    return sock;
+}
+
+static bool send_message(int sock, const uint8_t *data, size_t len, const int *fds, int nfds)
+{
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = len};
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (nfds > 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        perror("handoff sendmsg");
+        return false;
+    }
+    return true;
+}
+
+void handoff_writer_init(handoff_writer_t *w, int sock)
+{
+    w->sock = sock;
+    w->data[0] = FRAME_BATCH;
+    w->len = 1;
+    w->nfds = 0;
+}
+
+static bool flush_batch(handoff_writer_t *w)
+{
+    if (w->nfds == 0) {
+        return true;
+    }
+    bool ok = send_message(w->sock, w->data, w->len, w->fds, w->nfds);
+    w->len = 1;
+    w->nfds = 0;
+    return ok;
+}
+
+bool handoff_put(handoff_writer_t *w, uint8_t kind, int fd, const void *state, size_t len)
+{
+    if (1 + ENTRY_HEADER + len > HANDOFF_MAX_MSG) {
+        fprintf(stderr, "handoff state for fd %d too large (%zu bytes)\n", fd, len);
+        return false;
+    }
+    if (w->nfds == HANDOFF_MAX_FDS || w->len + ENTRY_HEADER + len > HANDOFF_MAX_MSG) {
+        if (!flush_batch(w)) {
+            return false;
+        }
+    }
+
+    uint8_t *p = &w->data[w->len];
+    p[0] = kind;
+    p[1] = len & 0xff;
+    p[2] = len >> 8;
+    if (len > 0) {
+        memcpy(p + ENTRY_HEADER, state, len);
+    }
+    w->len += ENTRY_HEADER + len;
+    w->fds[w->nfds++] = fd;
+    return true;
+}
+
+bool handoff_finish(handoff_writer_t *w)
+{
+    uint8_t end = FRAME_END;
+    return flush_batch(w) && send_message(w->sock, &end, 1, NULL, 0);
+}
+
+void handoff_reader_init(handoff_reader_t *r, int sock)
+{
+    memset(r, 0, sizeof(*r));
+    r->sock = sock;
+}
+
+static void close_unread(handoff_reader_t *r)
+{
+    for (; r->fdpos < r->nfds; r->fdpos++) {
+        close(r->fds[r->fdpos]);
+    }
+}
+
+// Receives the next message. Returns 1 for a batch, 0 for the end marker and
+// -1 on errors, including a batch whose entries and fds don't line up.
+static int recv_message(handoff_reader_t *r)
+{
+    struct iovec iov = {.iov_base = r->data, .iov_len = sizeof(r->data)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t n;
+    do {
+        n = recvmsg(r->sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        if (n < 0) {
+            perror("handoff recvmsg");
+        }
+        return -1;
+    }
+
+    r->len = n;
+    r->pos = 1;
+    r->nfds = 0;
+    r->fdpos = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            r->nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(r->fds, CMSG_DATA(cmsg), sizeof(int) * r->nfds);
+        }
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+        close_unread(r);
+        return -1;
+    }
+    return r->data[0] == FRAME_BATCH ? 1 : r->data[0] == FRAME_END ? 0 : -1;
+}
+
+int handoff_next(handoff_reader_t *r, uint8_t *kind, int *fd, const uint8_t **state,
+                 size_t *len)
+{
+    while (r->pos >= r->len) {
+        if (r->fdpos < r->nfds) {
+            close_unread(r);
+            return -1;
+        }
+        int rc = recv_message(r);
+        if (rc <= 0) {
+            return rc;
+        }
+    }
+
+    if (r->pos + ENTRY_HEADER > r->len || r->fdpos >= r->nfds) {
+        close_unread(r);
+        return -1;
+    }
+    const uint8_t *p = &r->data[r->pos];
+    size_t state_len = p[1] | (size_t)p[2] << 8;
+    if (r->pos + ENTRY_HEADER + state_len > r->len) {
+        close_unread(r);
+        return -1;
+    }
+
+    *kind = p[0];
+    *fd = r->fds[r->fdpos++];
+    *state = p + ENTRY_HEADER;
+    *len = state_len;
+    r->pos += ENTRY_HEADER + state_len;
+    return 1;
+}
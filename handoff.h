@@ -0,0 +1,67 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// Hot restart: passing a server's sockets and state to its replacement.
+//
+// The running server listens on a Unix socket. A new process started with
+// the same path connects to it and receives a stream of entries, each one an
+// fd passed with SCM_RIGHTS plus a small opaque blob of state, followed by an
+// end marker; it then acks with a single byte, and the old process exits.
+// The kernel keeps queued input and the accept backlog with the sockets
+// themselves, so nothing is lost while they change hands.
+//
+// Entries travel over SOCK_SEQPACKET in batches, so every message arrives
+// whole together with its fds.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fds per message; the kernel caps SCM_RIGHTS at 253.
+#define HANDOFF_MAX_FDS 128
+// Bytes per message, which also bounds a single entry's state.
+#define HANDOFF_MAX_MSG 65536
+
+// Binds and listens on path, replacing any stale socket file there. The
+// returned socket is non-blocking.
+int handoff_listen(const char *path);
+
+// Connects to a running server at path. Returns -1 if there is none.
+int handoff_connect(const char *path);
+
+typedef struct {
+    int sock;
+    size_t len;
+    int nfds;
+    int fds[HANDOFF_MAX_FDS];
+    uint8_t data[HANDOFF_MAX_MSG];
+} handoff_writer_t;
+
+void handoff_writer_init(handoff_writer_t *w, int sock);
+
+// Queues fd with len bytes of state under a caller-defined kind, sending the
+// current batch first if it is full. Returns false if sending failed.
+bool handoff_put(handoff_writer_t *w, uint8_t kind, int fd, const void *state, size_t len);
+
+// Sends the last batch and the end marker.
+bool handoff_finish(handoff_writer_t *w);
+
+typedef struct {
+    int sock;
+    size_t len;
+    size_t pos;
+    int nfds;
+    int fdpos;
+    int fds[HANDOFF_MAX_FDS];
+    uint8_t data[HANDOFF_MAX_MSG];
+} handoff_reader_t;
+
+void handoff_reader_init(handoff_reader_t *r, int sock);
+
+// Fetches the next entry. Returns 1 with the entry filled in (state points
+// into the reader and is valid until the next call), 0 at the end marker,
+// or -1 if the stream is broken.
+int handoff_next(handoff_reader_t *r, uint8_t *kind, int *fd, const uint8_t **state,
+                 size_t *len);
+
+#endif
@@ -0,0 +1,382 @@
+#include "ktls.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static __thread char last_error[160];
+
+static void set_error(const char *fmt, const char *detail)
+{
+    snprintf(last_error, sizeof(last_error), fmt, detail);
+}
+
+const char *ktls_error(void)
+{
+    return last_error;
+}
+
+#ifdef WITH_KTLS
+
+#include <arpa/inet.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+#define CIPHERSUITES "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256"
+
+// Which end's traffic secret.
+enum { CLIENT, SERVER };
+
+struct ktls_handshake {
+    SSL *ssl;
+    int fd;
+    bool is_server;
+    size_t secret_len[2];
+    uint8_t secret[2][EVP_MAX_MD_SIZE];
+};
+
+static SSL_CTX *server_ctx;
+static SSL_CTX *client_ctx;
+static pthread_once_t client_once = PTHREAD_ONCE_INIT;
+
+static void set_ssl_error(const char *what)
+{
+    unsigned long err = ERR_get_error();
+    if (err != 0) {
+        char buf[120];
+        ERR_error_string_n(err, buf, sizeof(buf));
+        set_error("%s", buf);
+    } else if (errno != 0) {
+        set_error("%s", strerror(errno));
+    } else {
+        set_error("%s", what);
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// OpenSSL has no other way of handing out the TLS 1.3 traffic secrets than
+// the key log, one line per secret: "LABEL <client random> <secret>", in hex.
+static void keylog(const SSL *ssl, const char *line)
+{
+    ktls_handshake_t *hs = SSL_get_app_data(ssl);
+    int which;
+    if (strncmp(line, "CLIENT_TRAFFIC_SECRET_0 ", 24) == 0) {
+        which = CLIENT;
+    } else if (strncmp(line, "SERVER_TRAFFIC_SECRET_0 ", 24) == 0) {
+        which = SERVER;
+    } else {
+        return;
+    }
+    const char *hex = strrchr(line, ' ') + 1;
+    size_t len = strlen(hex) / 2;
+    if (len > sizeof(hs->secret[which])) {
+        return;
+    }
+    for (size_t i = 0; i < len; i++) {
+        int hi = hex_value(hex[2 * i]);
+        int lo = hex_value(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            return;
+        }
+        hs->secret[which][i] = hi << 4 | lo;
+    }
+    hs->secret_len[which] = len;
+}
+
+static SSL_CTX *new_ctx(const SSL_METHOD *method)
+{
+    SSL_CTX *ctx = SSL_CTX_new(method);
+    if (ctx == NULL || !SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION) ||
+        !SSL_CTX_set_ciphersuites(ctx, CIPHERSUITES)) {
+        return NULL;
+    }
+    SSL_CTX_set_keylog_callback(ctx, keylog);
+    return ctx;
+}
+
+void ktls_server_init(const char *cert_path, const char *key_path)
+{
+    server_ctx = new_ctx(TLS_server_method());
+    if (server_ctx == NULL || !SSL_CTX_set_num_tickets(server_ctx, 0)) {
+        fprintf(stderr, "TLS setup failed\n");
+        exit(1);
+    }
+    if (SSL_CTX_use_certificate_chain_file(server_ctx, cert_path) != 1) {
+        fprintf(stderr, "can't load certificate %s\n", cert_path);
+        exit(1);
+    }
+    if (SSL_CTX_use_PrivateKey_file(server_ctx, key_path, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(server_ctx) != 1) {
+        fprintf(stderr, "can't use private key %s\n", key_path);
+        exit(1);
+    }
+}
+
+bool ktls_kernel_supported(void)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int server = -1;
+    bool ok = false;
+    if (listener >= 0 && client >= 0 && bind(listener, (struct sockaddr *)&addr, len) == 0 &&
+        listen(listener, 1) == 0 && getsockname(listener, (struct sockaddr *)&addr, &len) == 0 &&
+        connect(client, (struct sockaddr *)&addr, len) == 0) {
+        server = accept(listener, NULL, NULL);
+        ok = server >= 0 && setsockopt(server, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+    }
+    if (!ok) {
+        set_error("%s", strerror(errno));
+    }
+    close(server);
+    close(client);
+    close(listener);
+    return ok;
+}
+
+static ktls_handshake_t *handshake_new(SSL_CTX *ctx, int fd, bool is_server)
+{
+    ktls_handshake_t *hs = calloc(1, sizeof(*hs));
+    if (hs == NULL || (hs->ssl = SSL_new(ctx)) == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    hs->fd = fd;
+    hs->is_server = is_server;
+    SSL_set_app_data(hs->ssl, hs);
+    SSL_set_fd(hs->ssl, fd);
+    if (is_server) {
+        SSL_set_accept_state(hs->ssl);
+    } else {
+        SSL_set_connect_state(hs->ssl);
+    }
+    return hs;
+}
+
+ktls_handshake_t *ktls_accept_start(int fd)
+{
+    return handshake_new(server_ctx, fd, true);
+}
+
+void ktls_handshake_free(ktls_handshake_t *hs)
+{
+    // No close_notify: the session lives on in the kernel.
+    SSL_free(hs->ssl);
+    OPENSSL_cleanse(hs->secret, sizeof(hs->secret));
+    free(hs);
+}
+
+// HKDF-Expand-Label from RFC 8446, with an empty context.
+static bool expand_label(const EVP_MD *md, const uint8_t *secret, size_t secret_len,
+                         const char *label, uint8_t *out, size_t out_len)
+{
+    uint8_t info[4 + 6 + 16];
+    size_t label_len = 6 + strlen(label);
+    info[0] = out_len >> 8;
+    info[1] = out_len & 0xff;
+    info[2] = label_len;
+    memcpy(&info[3], "tls13 ", 6);
+    memcpy(&info[9], label, strlen(label));
+    info[3 + label_len] = 0;
+
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    bool ok = pctx != NULL && EVP_PKEY_derive_init(pctx) > 0 &&
+              EVP_PKEY_CTX_set_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+              EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+              EVP_PKEY_CTX_set1_hkdf_key(pctx, secret, secret_len) > 0 &&
+              EVP_PKEY_CTX_add1_hkdf_info(pctx, info, 4 + label_len) > 0 &&
+              EVP_PKEY_derive(pctx, out, &out_len) > 0;
+    EVP_PKEY_CTX_free(pctx);
+    return ok;
+}
+
+// Derives one direction's key and IV from its traffic secret and gives them
+// to the kernel, records numbered from 0: no record was sent with them yet.
+static bool install_keys(ktls_handshake_t *hs, int direction, int which)
+{
+    const SSL_CIPHER *cipher = SSL_get_current_cipher(hs->ssl);
+    const EVP_MD *md = SSL_CIPHER_get_handshake_digest(cipher);
+    uint8_t key[32];
+    uint8_t iv[12];
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes128;
+        struct tls12_crypto_info_aes_gcm_256 aes256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    memset(&info, 0, sizeof(info));
+    size_t key_len;
+    size_t info_len;
+
+    switch (SSL_CIPHER_get_protocol_id(cipher)) {
+    case 0x1301: // TLS_AES_128_GCM_SHA256
+        key_len = sizeof(info.aes128.key);
+        info_len = sizeof(info.aes128);
+        info.aes128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        break;
+    case 0x1302: // TLS_AES_256_GCM_SHA384
+        key_len = sizeof(info.aes256.key);
+        info_len = sizeof(info.aes256);
+        info.aes256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        break;
+    case 0x1303: // TLS_CHACHA20_POLY1305_SHA256
+        key_len = sizeof(info.chacha.key);
+        info_len = sizeof(info.chacha);
+        info.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+        break;
+    default:
+        set_error("cipher %s has no kernel implementation", SSL_CIPHER_get_name(cipher));
+        return false;
+    }
+    info.aes128.info.version = TLS_1_3_VERSION;
+
+    if (hs->secret_len[which] == 0 ||
+        !expand_label(md, hs->secret[which], hs->secret_len[which], "key", key, key_len) ||
+        !expand_label(md, hs->secret[which], hs->secret_len[which], "iv", iv, sizeof(iv))) {
+        set_error("%s", "no traffic secret");
+        return false;
+    }
+    // The 12-byte IV is the kernel's salt followed by its iv, as for TLS 1.2.
+    switch (info.aes128.info.cipher_type) {
+    case TLS_CIPHER_AES_GCM_128:
+        memcpy(info.aes128.key, key, key_len);
+        memcpy(info.aes128.salt, iv, 4);
+        memcpy(info.aes128.iv, iv + 4, 8);
+        break;
+    case TLS_CIPHER_AES_GCM_256:
+        memcpy(info.aes256.key, key, key_len);
+        memcpy(info.aes256.salt, iv, 4);
+        memcpy(info.aes256.iv, iv + 4, 8);
+        break;
+    default:
+        memcpy(info.chacha.key, key, key_len);
+        memcpy(info.chacha.iv, iv, 12);
+        break;
+    }
+    bool ok = setsockopt(hs->fd, SOL_TLS, direction, &info, info_len) == 0;
+    if (!ok) {
+        set_error("setsockopt SOL_TLS: %s", strerror(errno));
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_cleanse(iv, sizeof(iv));
+    OPENSSL_cleanse(&info, sizeof(info));
+    return ok;
+}
+
+// The handshake is done: the kernel takes over the record layer.
+static bool switch_to_kernel(ktls_handshake_t *hs)
+{
+    // OpenSSL reads one record at a time, so there should be nothing
+    // buffered; anything that is would be lost to the kernel.
+    if (SSL_has_pending(hs->ssl)) {
+        set_error("%s", "data buffered past the handshake");
+        return false;
+    }
+    if (setsockopt(hs->fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        set_error("TCP_ULP tls: %s (modprobe tls?)", strerror(errno));
+        return false;
+    }
+    int own = hs->is_server ? SERVER : CLIENT;
+    return install_keys(hs, TLS_TX, own) && install_keys(hs, TLS_RX, !own);
+}
+
+ktls_status_t ktls_handshake_step(ktls_handshake_t *hs)
+{
+    ERR_clear_error();
+    errno = 0;
+    int rc = SSL_do_handshake(hs->ssl);
+    if (rc != 1) {
+        int err = SSL_get_error(hs->ssl, rc);
+        if (err == SSL_ERROR_WANT_READ) {
+            return KTLS_WANT_READ;
+        } else if (err == SSL_ERROR_WANT_WRITE) {
+            return KTLS_WANT_WRITE;
+        }
+        set_ssl_error("connection closed during handshake");
+        return KTLS_FAILED;
+    }
+    return switch_to_kernel(hs) ? KTLS_DONE : KTLS_FAILED;
+}
+
+static void client_init(void)
+{
+    client_ctx = new_ctx(TLS_client_method());
+}
+
+bool ktls_connect(int fd)
+{
+    pthread_once(&client_once, client_init);
+    if (client_ctx == NULL) {
+        set_error("%s", "TLS setup failed");
+        return false;
+    }
+    ktls_handshake_t *hs = handshake_new(client_ctx, fd, false);
+    bool ok = ktls_handshake_step(hs) == KTLS_DONE;
+    ktls_handshake_free(hs);
+    return ok;
+}
+
+#else
+
+void ktls_server_init(const char *cert_path, const char *key_path)
+{
+    fprintf(stderr, "TLS isn't compiled in; build with -DWITH_KTLS -lssl -lcrypto\n");
+    exit(1);
+}
+
+bool ktls_kernel_supported(void)
+{
+    set_error("%s", "TLS isn't compiled in");
+    return false;
+}
+
+ktls_handshake_t *ktls_accept_start(int fd)
+{
+    return NULL;
+}
+
+ktls_status_t ktls_handshake_step(ktls_handshake_t *hs)
+{
+    set_error("%s", "TLS isn't compiled in");
+    return KTLS_FAILED;
+}
+
+void ktls_handshake_free(ktls_handshake_t *hs)
+{
+}
+
+bool ktls_connect(int fd)
+{
+    set_error("%s", "TLS isn't compiled in");
+    return false;
+}
+
+#endif
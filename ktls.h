@@ -0,0 +1,60 @@
+#ifndef KTLS_H
+#define KTLS_H
+
+// TLS with the record layer in the kernel (kTLS).
+//
+// The handshake runs in userspace with OpenSSL; once it is done, the session
+// keys go to the kernel with setsockopt(SOL_TLS), and from then on plain
+// send and recv on the socket carry plaintext while the kernel encrypts and
+// decrypts records, with no proxy in between and no copies beyond what
+// plaintext TCP makes. The existing handlers work unchanged.
+//
+// Built in with -DWITH_KTLS, linking -lssl -lcrypto; otherwise every
+// function here fails. The kernel needs CONFIG_TLS (`modprobe tls`).
+//
+// Sessions are TLS 1.3 only, with the ciphers the kernel implements:
+// AES-128-GCM, AES-256-GCM and ChaCha20-Poly1305. The server issues no
+// session tickets, so that no records follow the handshake before the
+// switch. After it, recv fails with EIO on a record that isn't application
+// data, such as the peer's close_notify alert or a KeyUpdate, and with
+// EBADMSG on one that doesn't authenticate; either way the connection is
+// done for. MSG_ZEROCOPY isn't supported on these sockets.
+
+#include <stdbool.h>
+
+typedef struct ktls_handshake ktls_handshake_t;
+
+typedef enum {
+    KTLS_DONE,       // The kernel has the keys.
+    KTLS_WANT_READ,  // Call again once the socket is readable.
+    KTLS_WANT_WRITE, // ... or writable.
+    KTLS_FAILED,     // See ktls_error().
+} ktls_status_t;
+
+// Loads the server's certificate chain and private key, both PEM files;
+// exits if either can't be used, or if TLS isn't compiled in.
+void ktls_server_init(const char *cert_path, const char *key_path);
+
+// Whether this kernel takes TLS keys, tried on a loopback connection.
+bool ktls_kernel_supported(void);
+
+// Starts the server side of a handshake on the accepted socket fd, which
+// may be non-blocking. Nothing is read or written until the first step.
+ktls_handshake_t *ktls_accept_start(int fd);
+
+// Advances the handshake as far as the socket allows. On KTLS_DONE the
+// socket is ready for plain send and recv; on KTLS_FAILED it should be
+// closed. Either way, free the handshake then; it never closes the socket.
+ktls_status_t ktls_handshake_step(ktls_handshake_t *hs);
+
+void ktls_handshake_free(ktls_handshake_t *hs);
+
+// Client side, for the load generator: runs the handshake on the connected,
+// blocking socket fd and hands the keys to the kernel. The server's
+// certificate isn't verified, so that self-signed ones do.
+bool ktls_connect(int fd);
+
+// Why the calling thread's last failed call failed.
+const char *ktls_error(void);
+
+#endif
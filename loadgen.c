@@ -0,0 +1,662 @@
+// Load generator for the concurrent servers.
+//
+// Unlike simple_client.py, which replays a fixed script to check behavior,
+// this drives a server as hard as it can from several threads for a fixed
+// duration and reports throughput and latency percentiles.
+//
+// usage: loadgen [-t threads] [-d seconds] [-s size] [-i interval_us]
+//                [-c idle_conns] [-r rate] [-b] [-T] <mode> <host> <port>
+//        loadgen [options] -u <unix_socket> <mode>
+//
+// -c opens that many extra connections before the run and holds them open,
+// idle, until it ends, to measure how servers cope with many quiet peers.
+//
+// -b makes echo and flood opt into the length-prefixed binary framing (see
+// framing.h), sending <size> byte frames instead of ^...$ messages.
+//
+// -u connects to a server's UNIX_SOCKET listener instead of a TCP port: a
+// path, or @name for the abstract namespace. Comparing a run against the
+// same server's TCP port shows what the loopback TCP stack costs.
+//
+// -T speaks TLS to a server started with TLS_CERT, for every mode but open.
+// Each connection does its handshake in userspace, then hands the keys to
+// the kernel (see ktls.h), so the run itself costs what it would against a
+// plaintext server, plus the kernel's crypto on both ends. Needs loadgen
+// built with -DWITH_KTLS. The server's certificate isn't checked.
+//
+// modes:
+//   accept   connect, wait for the '*' ack, reset the connection; repeat.
+//            Reports connections accepted per second and connect-to-ack
+//            latency. A '!' (busy) reply instead of the ack counts as busy.
+//   open     like accept, but open-loop: connections start on a fixed
+//            schedule of rate per second in total, however slowly the server
+//            answers, so overload shows up as queueing. Latency runs from
+//            each connection's scheduled start, so stalls can't hide.
+//   echo     one connection per thread sending ^<size bytes>$ and waiting
+//            for the transformed reply before sending the next message,
+//            pausing interval_us in between. Reports messages per second and
+//            round-trip latency.
+//   flood    one connection per thread sending ^<size bytes>$ back to back
+//            without waiting for replies, which are read and discarded as
+//            they come. Reports replies per second; for loading a server with
+//            a sender that never lets up.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "framing.h"
+#include "ktls.h"
+
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *unix_path;
+    int num_threads;
+    int duration_sec;
+    int msg_size;
+    int interval_us;
+    int idle_conns;
+    int rate;
+    bool framed;
+    bool tls;
+} loadgen_options_t;
+
+typedef struct {
+    uint64_t *samples;
+    size_t num_samples;
+    size_t cap_samples;
+    uint64_t ops;
+    uint64_t busy;
+    uint64_t errors;
+} thread_result_t;
+
+typedef struct {
+    const loadgen_options_t *opts;
+    thread_result_t result;
+    uint64_t deadline_ns;
+    int id;
+} thread_ctx_t;
+
+static struct addrinfo *server_addr;
+static bool use_tls;
+static struct addrinfo unix_server;
+static struct sockaddr_un unix_server_addr;
+
+// As in utils.c: '@' stands for the abstract namespace's leading NUL.
+static bool resolve_unix(const char *path)
+{
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(unix_server_addr.sun_path)) {
+        return false;
+    }
+    unix_server_addr.sun_family = AF_UNIX;
+    memcpy(unix_server_addr.sun_path, path, len);
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+    if (path[0] == '@') {
+        unix_server_addr.sun_path[0] = '\0';
+        addrlen--;
+    }
+    unix_server = (struct addrinfo){.ai_family = AF_UNIX,
+                                    .ai_socktype = SOCK_STREAM,
+                                    .ai_addr = (struct sockaddr *)&unix_server_addr,
+                                    .ai_addrlen = addrlen};
+    server_addr = &unix_server;
+    return true;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record_sample(thread_result_t *r, uint64_t ns)
+{
+    if (r->num_samples == r->cap_samples) {
+        r->cap_samples = r->cap_samples ? r->cap_samples * 2 : 4096;
+        r->samples = realloc(r->samples, r->cap_samples * sizeof(*r->samples));
+        if (r->samples == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+    }
+    r->samples[r->num_samples++] = ns;
+}
+
+// Opens a blocking connection to the server. Returns -1 on failure.
+static int connect_server(void)
+{
+    int fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (use_tls && !ktls_connect(fd)) {
+        static atomic_bool reported;
+        if (!atomic_exchange(&reported, true)) {
+            fprintf(stderr, "TLS: %s\n", ktls_error());
+        }
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Closes with a RST instead of a FIN so that the client side doesn't pile up
+// TIME_WAIT sockets and run out of ephemeral ports during long runs.
+static void close_reset(int fd)
+{
+    struct linger lg = {.l_onoff = 1, .l_linger = 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
+
+static bool wait_ack(int fd)
+{
+    char c;
+    return recv(fd, &c, 1, MSG_WAITALL) == 1 && c == '*';
+}
+
+// Counts the server's first byte on a new connection: the '*' ack, with its
+// latency since start_ns, or '!' for busy.
+static void record_ack(thread_result_t *r, int fd, uint64_t start_ns)
+{
+    char c;
+    if (recv(fd, &c, 1, MSG_WAITALL) != 1) {
+        r->errors++;
+    } else if (c == '*') {
+        record_sample(r, now_ns() - start_ns);
+        r->ops++;
+    } else if (c == '!') {
+        r->busy++;
+    } else {
+        r->errors++;
+    }
+}
+
+static void *accept_worker(void *arg)
+{
+    thread_ctx_t *ctx = arg;
+    thread_result_t *r = &ctx->result;
+
+    while (now_ns() < ctx->deadline_ns) {
+        uint64_t start = now_ns();
+        int fd = connect_server();
+        if (fd < 0) {
+            r->errors++;
+            continue;
+        }
+        record_ack(r, fd, start);
+        close_reset(fd);
+    }
+    return NULL;
+}
+
+// How long the open mode waits for answers after the last scheduled start.
+#define OPEN_DRAIN_NS 5000000000ull
+
+typedef struct {
+    int fd;
+    uint64_t scheduled_ns;
+} open_conn_t;
+
+static void start_open_conn(thread_result_t *r, int epfd, uint64_t scheduled_ns)
+{
+    int fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        // Out of fds: too many connections are waiting on the server.
+        if (errno == EMFILE || errno == ENFILE) {
+            r->errors++;
+            return;
+        }
+        perror("socket");
+        exit(1);
+    }
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        r->errors++;
+        close(fd);
+        return;
+    }
+    open_conn_t *c = malloc(sizeof(*c));
+    if (c == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    c->fd = fd;
+    c->scheduled_ns = scheduled_ns;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+static void *open_worker(void *arg)
+{
+    thread_ctx_t *ctx = arg;
+    thread_result_t *r = &ctx->result;
+    uint64_t gap_ns = 1000000000ull * ctx->opts->num_threads / ctx->opts->rate;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    // Stagger the threads so their starts interleave.
+    uint64_t next_ns = now_ns() + gap_ns * ctx->id / ctx->opts->num_threads;
+    uint64_t in_flight = 0;
+    uint64_t started = 0;
+    struct epoll_event events[64];
+
+    while (1) {
+        uint64_t now = now_ns();
+        while (next_ns <= now && next_ns < ctx->deadline_ns) {
+            start_open_conn(r, epfd, next_ns);
+            next_ns += gap_ns;
+            started++;
+        }
+        in_flight = started - r->ops - r->busy - r->errors;
+        if (next_ns >= ctx->deadline_ns &&
+            (in_flight == 0 || now >= ctx->deadline_ns + OPEN_DRAIN_NS)) {
+            break;
+        }
+
+        uint64_t wake_ns = next_ns < ctx->deadline_ns ? next_ns : ctx->deadline_ns + OPEN_DRAIN_NS;
+        struct timespec timeout = {0};
+        if (wake_ns > now) {
+            timeout.tv_sec = (wake_ns - now) / 1000000000ull;
+            timeout.tv_nsec = (wake_ns - now) % 1000000000ull;
+        }
+        int n = epoll_pwait2(epfd, events, 64, &timeout, NULL);
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_pwait2");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            open_conn_t *c = events[i].data.ptr;
+            record_ack(r, c->fd, c->scheduled_ns);
+            close_reset(c->fd);
+            free(c);
+        }
+    }
+
+    // Whatever is still unanswered timed out.
+    r->errors += in_flight;
+    close(epfd);
+    return NULL;
+}
+
+static bool send_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Connects for echo or flood: waits for the ack and, with -b, opts into
+// binary framing. Returns -1 on failure.
+static int connect_session(const loadgen_options_t *opts)
+{
+    int fd = connect_server();
+    if (fd < 0) {
+        return -1;
+    }
+    uint8_t magic = FRAMING_BINARY_MAGIC;
+    if (!wait_ack(fd) || (opts->framed && !send_all(fd, &magic, 1))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Length on the wire of a message with size bytes of payload, and of its
+// reply.
+static size_t message_len(const loadgen_options_t *opts)
+{
+    return opts->msg_size + (opts->framed ? FRAME_HEADER_SIZE : 2);
+}
+
+static size_t reply_len(const loadgen_options_t *opts)
+{
+    return opts->msg_size + (opts->framed ? FRAME_HEADER_SIZE : 0);
+}
+
+static void build_message(const loadgen_options_t *opts, uint8_t *msg)
+{
+    int size = opts->msg_size;
+    uint8_t *payload = msg + 1;
+    if (opts->framed) {
+        frame_put_header(msg, size);
+        payload = msg + FRAME_HEADER_SIZE;
+    } else {
+        msg[0] = '^';
+        msg[size + 1] = '$';
+    }
+    for (int i = 0; i < size; i++) {
+        payload[i] = 'a' + i % 25;
+    }
+}
+
+static void *echo_worker(void *arg)
+{
+    thread_ctx_t *ctx = arg;
+    thread_result_t *r = &ctx->result;
+    size_t msg_len = message_len(ctx->opts);
+    size_t reply_size = reply_len(ctx->opts);
+    // The first payload byte of the reply: 'a' incremented.
+    size_t check = reply_size - ctx->opts->msg_size;
+
+    int fd = connect_session(ctx->opts);
+    if (fd < 0) {
+        fprintf(stderr, "thread %d: unable to connect\n", ctx->id);
+        r->errors++;
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uint8_t *msg = malloc(msg_len);
+    uint8_t *reply = malloc(reply_size);
+    if (msg == NULL || reply == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    build_message(ctx->opts, msg);
+
+    while (now_ns() < ctx->deadline_ns) {
+        uint64_t start = now_ns();
+        if (!send_all(fd, msg, msg_len) ||
+            recv(fd, reply, reply_size, MSG_WAITALL) != (ssize_t)reply_size ||
+            reply[check] != 'b') {
+            r->errors++;
+            break;
+        }
+        record_sample(r, now_ns() - start);
+        r->ops++;
+        if (ctx->opts->interval_us > 0) {
+            usleep(ctx->opts->interval_us);
+        }
+    }
+
+    free(msg);
+    free(reply);
+    close(fd);
+    return NULL;
+}
+
+static void *flood_worker(void *arg)
+{
+    thread_ctx_t *ctx = arg;
+    thread_result_t *r = &ctx->result;
+    size_t msg_len = message_len(ctx->opts);
+
+    int fd = connect_session(ctx->opts);
+    if (fd < 0) {
+        fprintf(stderr, "thread %d: unable to connect\n", ctx->id);
+        r->errors++;
+        return NULL;
+    }
+
+    // A batch of messages per send, so the sender is never the bottleneck.
+    size_t batch = 64 * 1024 / msg_len + 1;
+    size_t msgs_len = batch * msg_len;
+    uint8_t *msgs = malloc(msgs_len);
+    uint8_t buf[64 * 1024];
+    if (msgs == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    for (size_t m = 0; m < batch; m++) {
+        build_message(ctx->opts, msgs + m * msg_len);
+    }
+
+    size_t sent = 0;
+    uint64_t received = 0;
+    struct pollfd pfd = {.fd = fd, .events = POLLIN | POLLOUT};
+    while (now_ns() < ctx->deadline_ns) {
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+        if (pfd.revents & POLLIN) {
+            ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                r->errors++;
+                break;
+            }
+            received += n > 0 ? n : 0;
+        }
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(fd, msgs + sent, msgs_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (n < 0 && errno != EAGAIN) {
+                r->errors++;
+                break;
+            }
+            sent = n > 0 ? (sent + n) % msgs_len : sent;
+        }
+    }
+    r->ops = received / reply_len(ctx->opts);
+
+    free(msgs);
+    close_reset(fd);
+    return NULL;
+}
+
+typedef struct {
+    const char *name;
+    void *(*worker)(void *);
+    const char *unit;
+} loadgen_mode_t;
+
+static const loadgen_mode_t modes[] = {
+    {"accept", accept_worker, "conn"},
+    {"echo", echo_worker, "msg"},
+    {"flood", flood_worker, "msg"},
+    {"open", open_worker, "conn"},
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const loadgen_mode_t *mode, thread_ctx_t *ctxs, int n, double elapsed)
+{
+    thread_result_t all = {0};
+    for (int i = 0; i < n; i++) {
+        thread_result_t *r = &ctxs[i].result;
+        all.ops += r->ops;
+        all.busy += r->busy;
+        all.errors += r->errors;
+        for (size_t j = 0; j < r->num_samples; j++) {
+            record_sample(&all, r->samples[j]);
+        }
+        free(r->samples);
+    }
+
+    printf("mode=%s%s%s%s threads=%d elapsed=%.2fs\n", mode->name,
+           ctxs[0].opts->framed ? " (binary framing)" : "",
+           ctxs[0].opts->unix_path != NULL ? " (unix socket)" : "",
+           ctxs[0].opts->tls ? " (TLS)" : "", n, elapsed);
+    printf("  %s/s: %.0f (total %lu, errors %lu)\n", mode->unit,
+           all.ops / elapsed, (unsigned long)all.ops, (unsigned long)all.errors);
+    if (all.busy > 0) {
+        printf("  busy: %lu (%.1f%% of answered)\n", (unsigned long)all.busy,
+               100.0 * all.busy / (all.busy + all.ops));
+    }
+    if (all.num_samples > 0) {
+        qsort(all.samples, all.num_samples, sizeof(*all.samples), cmp_u64);
+        const double pcts[] = {50, 90, 99, 99.9};
+        printf("  latency us:");
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+            size_t idx = (size_t)(pcts[i] / 100.0 * (all.num_samples - 1));
+            printf(" p%g=%.1f", pcts[i], all.samples[idx] / 1000.0);
+        }
+        printf(" max=%.1f\n", all.samples[all.num_samples - 1] / 1000.0);
+    }
+    free(all.samples);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: loadgen [-t threads] [-d seconds] [-s size] [-i interval_us]\n"
+                    "               [-c idle_conns] [-r rate] [-b] [-T] <mode> <host> <port>\n"
+                    "       loadgen [options] -u <unix_socket> <mode>\n");
+    fprintf(stderr, "modes:");
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        fprintf(stderr, " %s", modes[i].name);
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    loadgen_options_t opts = {.num_threads = 4, .duration_sec = 5, .msg_size = 32};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:s:i:c:r:bu:T")) != -1) {
+        switch (opt) {
+        case 't':
+            opts.num_threads = atoi(optarg);
+            break;
+        case 'd':
+            opts.duration_sec = atoi(optarg);
+            break;
+        case 's':
+            opts.msg_size = atoi(optarg);
+            break;
+        case 'i':
+            opts.interval_us = atoi(optarg);
+            break;
+        case 'c':
+            opts.idle_conns = atoi(optarg);
+            break;
+        case 'r':
+            opts.rate = atoi(optarg);
+            break;
+        case 'b':
+            opts.framed = true;
+            break;
+        case 'u':
+            opts.unix_path = optarg;
+            break;
+        case 'T':
+            opts.tls = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != (opts.unix_path != NULL ? 1 : 3) || opts.num_threads < 1 || opts.duration_sec < 1 ||
+        opts.msg_size < 1) {
+        usage();
+    }
+
+    const loadgen_mode_t *mode = NULL;
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        if (strcmp(argv[optind], modes[i].name) == 0) {
+            mode = &modes[i];
+        }
+    }
+    if (mode == NULL || (mode->worker == open_worker && opts.rate < 1)) {
+        usage();
+    }
+    if (opts.tls && (mode->worker == open_worker || opts.unix_path != NULL)) {
+        fprintf(stderr, "-T is for TCP and every mode but open\n");
+        exit(1);
+    }
+    use_tls = opts.tls;
+    if (opts.unix_path != NULL) {
+        if (!resolve_unix(opts.unix_path)) {
+            fprintf(stderr, "bad Unix socket path '%s'\n", opts.unix_path);
+            exit(1);
+        }
+    } else {
+        opts.host = argv[optind + 1];
+        opts.port = argv[optind + 2];
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+        int rc = getaddrinfo(opts.host, opts.port, &hints, &server_addr);
+        if (rc != 0) {
+            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+            exit(1);
+        }
+    }
+
+    int *idle_fds = calloc(opts.idle_conns + 1, sizeof(*idle_fds));
+    if (idle_fds == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    for (int i = 0; i < opts.idle_conns; i++) {
+        idle_fds[i] = connect_server();
+        if (idle_fds[i] < 0 || !wait_ack(idle_fds[i])) {
+            fprintf(stderr, "idle connection %d failed\n", i);
+            exit(1);
+        }
+    }
+
+    thread_ctx_t *ctxs = calloc(opts.num_threads, sizeof(*ctxs));
+    pthread_t *threads = calloc(opts.num_threads, sizeof(*threads));
+    if (ctxs == NULL || threads == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < opts.num_threads; i++) {
+        ctxs[i].opts = &opts;
+        ctxs[i].id = i;
+        ctxs[i].deadline_ns = start + (uint64_t)opts.duration_sec * 1000000000ull;
+        pthread_create(&threads[i], NULL, mode->worker, &ctxs[i]);
+    }
+    for (int i = 0; i < opts.num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    report(mode, ctxs, opts.num_threads, elapsed);
+
+    for (int i = 0; i < opts.idle_conns; i++) {
+        close(idle_fds[i]);
+    }
+    free(idle_fds);
+
+    free(ctxs);
+    free(threads);
+    if (server_addr != &unix_server) {
+        freeaddrinfo(server_addr);
+    }
+    return 0;
+}
@@ -0,0 +1,209 @@
+#include "logger.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define LOG_RING_SLOTS 256
+#define LOG_MSG_MAX 116
+#define LOG_DRAIN_INTERVAL_NS (1000 * 1000)
+
+typedef struct {
+    struct timespec ts;
+    log_level_t level;
+    int len;
+    char text[LOG_MSG_MAX];
+} log_slot_t;
+
+typedef struct log_ring {
+    // Written by the producer only.
+    _Atomic size_t head;
+    char pad0[64 - sizeof(size_t)];
+    // Written by the drain side only.
+    _Atomic size_t tail;
+    char pad1[64 - sizeof(size_t)];
+    _Atomic unsigned long dropped;
+    _Atomic bool orphaned;
+    struct log_ring *next;
+    log_slot_t slots[LOG_RING_SLOTS];
+} log_ring_t;
+
+static _Atomic(log_ring_t *) ring_list = NULL;
+static __thread log_ring_t *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static log_level_t min_level = LOG_LEVEL_INFO;
+static bool started = false;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static void ring_release(void *arg)
+{
+    log_ring_t *ring = arg;
+    atomic_store_explicit(&ring->orphaned, true, memory_order_release);
+}
+
+static log_ring_t *ring_get(void)
+{
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+
+    log_ring_t *ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->next = atomic_load(&ring_list);
+    while (!atomic_compare_exchange_weak(&ring_list, &ring->next, ring))
+        ;
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+void log_msg(log_level_t level, const char *fmt, ...)
+{
+    if (level < min_level) {
+        return;
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+
+    if (!started) {
+        vprintf(fmt, ap);
+        putchar('\n');
+        va_end(ap);
+        return;
+    }
+
+    log_ring_t *ring = ring_get();
+    if (ring == NULL) {
+        va_end(ap);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        va_end(ap);
+        return;
+    }
+
+    log_slot_t *slot = &ring->slots[head % LOG_RING_SLOTS];
+    clock_gettime(CLOCK_REALTIME_COARSE, &slot->ts);
+    slot->level = level;
+    int len = vsnprintf(slot->text, LOG_MSG_MAX, fmt, ap);
+    slot->len = len < LOG_MSG_MAX ? len : LOG_MSG_MAX - 1;
+    va_end(ap);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static void write_slot(const log_slot_t *slot)
+{
+    struct tm tm;
+    localtime_r(&slot->ts.tv_sec, &tm);
+    fprintf(stdout, "%02d:%02d:%02d.%03ld %-5s %.*s\n",
+            tm.tm_hour, tm.tm_min, tm.tm_sec, slot->ts.tv_nsec / 1000000,
+            level_names[slot->level], slot->len, slot->text);
+}
+
+// Drains every ring once. Returns the number of messages written.
+static size_t drain_rings(void)
+{
+    size_t total = 0;
+
+    pthread_mutex_lock(&drain_mutex);
+    log_ring_t *prev = NULL;
+    log_ring_t *ring = atomic_load(&ring_list);
+    while (ring != NULL) {
+        log_ring_t *next = ring->next;
+        bool orphaned = atomic_load_explicit(&ring->orphaned, memory_order_acquire);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        for (; tail != head; ++tail) {
+            write_slot(&ring->slots[tail % LOG_RING_SLOTS]);
+            total++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        unsigned long dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            fprintf(stdout, "logger: dropped %lu messages\n", dropped);
+        }
+
+        // Producers only ever touch the list head, so any other node whose
+        // thread has exited can be unlinked here without racing them.
+        if (orphaned && prev != NULL) {
+            prev->next = next;
+            free(ring);
+        } else {
+            prev = ring;
+        }
+        ring = next;
+    }
+    if (total > 0) {
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&drain_mutex);
+
+    return total;
+}
+
+void logger_flush(void)
+{
+    drain_rings();
+    fflush(stdout);
+}
+
+static void *drain_thread(void *arg)
+{
+    (void)arg;
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = LOG_DRAIN_INTERVAL_NS};
+    while (1) {
+        drain_rings();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+void logger_init(log_level_t level)
+{
+    if (started) {
+        return;
+    }
+
+    min_level = level;
+    const char *env = getenv("LOG_LEVEL");
+    if (env != NULL) {
+        for (int i = 0; i <= LOG_LEVEL_ERROR; ++i) {
+            if (strcasecmp(env, level_names[i]) == 0) {
+                min_level = i;
+            }
+        }
+    }
+
+    if (pthread_key_create(&ring_key, ring_release) != 0) {
+        perror("pthread_key_create");
+        exit(1);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, drain_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+
+    started = true;
+    atexit(logger_flush);
+}
@@ -0,0 +1,36 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+// Asynchronous logger for the servers' hot paths.
+//
+// Every thread that logs gets its own single-producer/single-consumer ring
+// buffer; log_msg() formats into the next free slot and returns without a
+// syscall or lock. A background thread drains all rings to stdout in batches.
+// If a ring is full the message is dropped and counted rather than blocking
+// the caller.
+
+typedef enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR,
+} log_level_t;
+
+// Starts the drain thread. min_level is the default threshold; the LOG_LEVEL
+// environment variable (debug, info, warn, error) overrides it. Pending
+// messages are flushed at exit.
+void logger_init(log_level_t min_level);
+
+// Synchronously writes out everything currently queued.
+void logger_flush(void);
+
+// Queues a printf-style message if level passes the threshold.
+void log_msg(log_level_t level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define log_debug(...) log_msg(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_msg(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_warn(...) log_msg(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_error(...) log_msg(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,248 @@
+// Microbenchmark for mailbox.h.
+//
+// usage: mailbox-bench [-n messages] [-p producers] [-u] <mode>
+//
+// modes:
+//   pingpong  two threads, each waiting in epoll on its own mailbox, bounce
+//             one message back and forth. Reports the round-trip latency.
+//   stream    producers post n messages in total, as fast as they can, to
+//             one consumer draining its mailbox from epoll. Reports
+//             messages per second and how many eventfd writes and wakeups
+//             they took.
+//
+// -u writes the eventfd on every post as well, i.e. without coalescing, for
+// comparison.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mailbox.h"
+
+typedef struct {
+    mailbox_node_t node;
+    uint64_t seq;
+} message_t;
+
+static long num_messages = 1000000;
+static int num_producers = 1;
+static bool uncoalesced;
+
+static _Atomic uint64_t eventfd_writes;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void post(mailbox_t *mb, message_t *msg)
+{
+    bool woke = mailbox_post(mb, &msg->node);
+    if (uncoalesced) {
+        uint64_t one = 1;
+        if (write(mailbox_fd(mb), &one, sizeof(one)) < 0) {
+            perror("eventfd write");
+            exit(1);
+        }
+        woke = true;
+    }
+    if (woke) {
+        atomic_fetch_add_explicit(&eventfd_writes, 1, memory_order_relaxed);
+    }
+}
+
+// A mailbox and the epoll set its consumer waits in.
+typedef struct {
+    mailbox_t mailbox;
+    int epfd;
+    uint64_t wakeups;
+    uint64_t received;
+    message_t *last;
+} endpoint_t;
+
+static void endpoint_init(endpoint_t *e)
+{
+    memset(e, 0, sizeof(*e));
+    mailbox_init(&e->mailbox);
+    e->epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN};
+    if (e->epfd < 0 || epoll_ctl(e->epfd, EPOLL_CTL_ADD, mailbox_fd(&e->mailbox), &ev) < 0) {
+        perror("epoll");
+        exit(1);
+    }
+}
+
+static void on_message(mailbox_node_t *node, void *arg)
+{
+    endpoint_t *e = arg;
+    e->last = (message_t *)node;
+    e->received++;
+}
+
+// Waits for mail and drains it, as a reactor would.
+static void endpoint_wait(endpoint_t *e)
+{
+    struct epoll_event ev;
+    int n = epoll_wait(e->epfd, &ev, 1, -1);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        exit(1);
+    }
+    if (n > 0) {
+        e->wakeups++;
+        mailbox_drain(&e->mailbox, on_message, e, 256);
+    }
+}
+
+static endpoint_t ends[2];
+
+static void *pong_thread(void *arg)
+{
+    (void)arg;
+    while (1) {
+        endpoint_wait(&ends[1]);
+        if (ends[1].last != NULL) {
+            message_t *msg = ends[1].last;
+            ends[1].last = NULL;
+            // Once posted, msg belongs to the other side again.
+            bool last = msg->seq == 0;
+            post(&ends[0].mailbox, msg);
+            if (last) {
+                return NULL;
+            }
+        }
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_pingpong(void)
+{
+    endpoint_init(&ends[0]);
+    endpoint_init(&ends[1]);
+    pthread_t thread;
+    pthread_create(&thread, NULL, pong_thread, NULL);
+
+    uint64_t *rtt = malloc(num_messages * sizeof(*rtt));
+    if (rtt == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    message_t msg;
+    uint64_t start = now_ns();
+    for (long i = num_messages; i > 0; i--) {
+        uint64_t t0 = now_ns();
+        msg.seq = i - 1; // 0 tells the other side to stop.
+        post(&ends[1].mailbox, &msg);
+        while (ends[0].last == NULL) {
+            endpoint_wait(&ends[0]);
+        }
+        ends[0].last = NULL;
+        rtt[num_messages - i] = now_ns() - t0;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    pthread_join(thread, NULL);
+
+    qsort(rtt, num_messages, sizeof(*rtt), cmp_u64);
+    printf("pingpong: %ld round trips in %.2fs, %.0f/s\n", num_messages, elapsed,
+           num_messages / elapsed);
+    printf("  round trip us: p50=%.1f p90=%.1f p99=%.1f max=%.1f\n",
+           rtt[num_messages / 2] / 1000.0, rtt[num_messages * 9 / 10] / 1000.0,
+           rtt[num_messages * 99 / 100] / 1000.0, rtt[num_messages - 1] / 1000.0);
+    free(rtt);
+}
+
+static void *producer_thread(void *arg)
+{
+    message_t *msgs = arg;
+    long n = num_messages / num_producers;
+    for (long i = 0; i < n; i++) {
+        msgs[i].seq = i;
+        post(&ends[0].mailbox, &msgs[i]);
+    }
+    return NULL;
+}
+
+static void run_stream(void)
+{
+    endpoint_init(&ends[0]);
+    long per_producer = num_messages / num_producers;
+    long total = per_producer * num_producers;
+    message_t *msgs = calloc(total, sizeof(*msgs));
+    pthread_t *threads = calloc(num_producers, sizeof(*threads));
+    if (msgs == NULL || threads == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_producers; i++) {
+        pthread_create(&threads[i], NULL, producer_thread, &msgs[i * per_producer]);
+    }
+    while (ends[0].received < (uint64_t)total) {
+        endpoint_wait(&ends[0]);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+    for (int i = 0; i < num_producers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("stream: %ld messages from %d producer(s) in %.2fs, %.0f/s\n", total, num_producers,
+           elapsed, total / elapsed);
+    printf("  eventfd writes: %lu (%.4f per message), consumer wakeups: %lu (%.1f messages each)\n",
+           (unsigned long)eventfd_writes, (double)eventfd_writes / total,
+           (unsigned long)ends[0].wakeups, (double)total / ends[0].wakeups);
+    free(msgs);
+    free(threads);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mailbox-bench [-n messages] [-p producers] [-u] pingpong|stream\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:u")) != -1) {
+        switch (opt) {
+        case 'n':
+            num_messages = atol(optarg);
+            break;
+        case 'p':
+            num_producers = atoi(optarg);
+            break;
+        case 'u':
+            uncoalesced = true;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 1 || num_messages < 1 || num_producers < 1) {
+        usage();
+    }
+    if (strcmp(argv[optind], "pingpong") == 0) {
+        run_pingpong();
+    } else if (strcmp(argv[optind], "stream") == 0) {
+        run_stream();
+    } else {
+        usage();
+    }
+    return 0;
+}
@@ -0,0 +1,106 @@
+#include "mailbox.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+void mailbox_init(mailbox_t *mb)
+{
+    atomic_store_explicit(&mb->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&mb->head, &mb->stub, memory_order_relaxed);
+    mb->tail = &mb->stub;
+    atomic_store_explicit(&mb->signaled, false, memory_order_relaxed);
+    mb->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mb->event_fd < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+}
+
+static void push(mailbox_t *mb, mailbox_node_t *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mailbox_node_t *prev = atomic_exchange_explicit(&mb->head, node, memory_order_acq_rel);
+    // Until this store, the consumer sees the queue end at prev.
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+// Returns the oldest message, or NULL if there's none, or if the next one is
+// still being linked in by its producer (which will signal afterwards).
+static mailbox_node_t *pop(mailbox_t *mb)
+{
+    mailbox_node_t *tail = mb->tail;
+    mailbox_node_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &mb->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        mb->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        mb->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&mb->head, memory_order_acquire)) {
+        return NULL;
+    }
+    // tail is the last node; it can only be popped with something after it,
+    // so put the stub back behind it.
+    push(mb, &mb->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        mb->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static void signal_consumer(mailbox_t *mb)
+{
+    uint64_t one = 1;
+    if (write(mb->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("eventfd write");
+        exit(1);
+    }
+}
+
+bool mailbox_post(mailbox_t *mb, mailbox_node_t *node)
+{
+    push(mb, node);
+    // The consumer clears the flag before it drains, so either it will see
+    // this node or we see the flag clear and signal again.
+    if (atomic_exchange_explicit(&mb->signaled, true, memory_order_seq_cst)) {
+        return false;
+    }
+    signal_consumer(mb);
+    return true;
+}
+
+size_t mailbox_drain(mailbox_t *mb, void (*fn)(mailbox_node_t *node, void *arg), void *arg,
+                     size_t max)
+{
+    uint64_t count;
+    if (read(mb->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+        exit(1);
+    }
+    // An exchange rather than a store, so that it synchronizes with the
+    // post that set the flag and its node is seen below.
+    atomic_exchange_explicit(&mb->signaled, false, memory_order_seq_cst);
+
+    size_t n = 0;
+    mailbox_node_t *node;
+    while (n < max && (node = pop(mb)) != NULL) {
+        fn(node, arg);
+        n++;
+    }
+    if (n == max && !atomic_exchange_explicit(&mb->signaled, true, memory_order_seq_cst)) {
+        signal_consumer(mb);
+    }
+    return n;
+}
@@ -0,0 +1,50 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+// Multi-producer, single-consumer mailbox that an event loop can wait on.
+//
+// Messages are intrusive: embed a mailbox_node_t in whatever is being sent
+// and recover the container on the other side. Posting is lock-free, an
+// atomic exchange to link the node in (Vyukov's MPSC queue), and never
+// blocks. The consumer watches mailbox_fd(), an eventfd, with its poller.
+//
+// Wakeups are coalesced: a post only writes to the eventfd if the consumer
+// hasn't already been signalled since it last started draining, so a burst
+// of N posts costs one write and one wakeup rather than N.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct mailbox_node {
+    struct mailbox_node *_Atomic next;
+} mailbox_node_t;
+
+typedef struct {
+    // Producers push at the head; the consumer pops at the tail.
+    mailbox_node_t *_Atomic head __attribute__((aligned(64)));
+    mailbox_node_t *tail __attribute__((aligned(64)));
+    mailbox_node_t stub;
+    _Atomic bool signaled __attribute__((aligned(64)));
+    int event_fd;
+} mailbox_t;
+
+// Exits if the eventfd can't be created.
+void mailbox_init(mailbox_t *mb);
+
+static inline int mailbox_fd(const mailbox_t *mb)
+{
+    return mb->event_fd;
+}
+
+// Any thread. Returns true if this post had to wake the consumer.
+bool mailbox_post(mailbox_t *mb, mailbox_node_t *node);
+
+// Consumer thread only, when mailbox_fd() is readable: hands up to max
+// queued messages to fn, oldest first, and returns how many. If more are
+// left, the eventfd is signalled again so that the consumer comes back for
+// them after seeing to its other fds.
+size_t mailbox_drain(mailbox_t *mb, void (*fn)(mailbox_node_t *node, void *arg), void *arg,
+                     size_t max);
+
+#endif
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Makes a self-signed certificate and key for trying out TLS_CERT/TLS_KEY.
+#
+# usage: ./make-cert.sh [dir] [name]
+#
+# Writes <dir>/cert.pem and <dir>/key.pem (dir defaults to .), an ECDSA P-256
+# pair for CN=<name> (default localhost), valid for 30 days. Only for local
+# tests and benchmarks: nothing trusts it, and loadgen doesn't check.
+DIR=${1:-.}
+NAME=${2:-localhost}
+openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 -nodes -days 30 \
+    -subj "/CN=$NAME" -addext "subjectAltName=DNS:$NAME" \
+    -keyout "$DIR/key.pem" -out "$DIR/cert.pem" 2>/dev/null || exit 1
+chmod 600 "$DIR/key.pem"
+echo "wrote $DIR/cert.pem and $DIR/key.pem" >&2
@@ -0,0 +1,208 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "utils.h"
+
+#define MAX_GAUGES 8
+#define RENDER_BUF_SIZE (32 * 1024)
+
+bool metrics_enabled = false;
+__thread metrics_block_t *metrics_tls_block = NULL;
+
+static _Atomic(metrics_block_t *) block_list = NULL;
+
+typedef struct {
+    const char *name;
+    uint64_t (*fn)(void *arg);
+    void *arg;
+} gauge_t;
+
+static gauge_t gauges[MAX_GAUGES];
+static _Atomic int num_gauges = 0;
+
+static const char *counter_names[METRIC_COUNT] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = "server_connections_accepted_total",
+    [METRIC_CONNECTIONS_CLOSED] = "server_connections_closed_total",
+    [METRIC_CONNECTIONS_REJECTED] = "server_connections_rejected_total",
+    [METRIC_BYTES_RECEIVED] = "server_bytes_received_total",
+    [METRIC_BYTES_SENT] = "server_bytes_sent_total",
+    [METRIC_MESSAGES] = "server_messages_total",
+    [METRIC_LOOP_ITERATIONS] = "server_loop_iterations_total",
+    [METRIC_LOOP_DEFERRALS] = "server_loop_deferrals_total",
+    [METRIC_ZEROCOPY_SENDS] = "server_zerocopy_sends_total",
+    [METRIC_ZEROCOPY_COPIED] = "server_zerocopy_copied_total",
+    [METRIC_FANOUT_DELIVERIES] = "server_fanout_deliveries_total",
+    [METRIC_FANOUT_SKIPPED] = "server_fanout_skipped_total",
+    [METRIC_SUBSCRIBERS_DROPPED] = "server_subscribers_dropped_total",
+    [METRIC_CONNECTIONS_MIGRATED] = "server_connections_migrated_total",
+};
+
+static const char *hist_names[HIST_COUNT] = {
+    [HIST_MESSAGE_PROCESSING_NS] = "server_message_processing_ns",
+    [HIST_LOOP_ITERATION_NS] = "server_loop_iteration_ns",
+    [HIST_POLL_BATCH] = "server_poll_batch_size",
+};
+
+metrics_block_t *metrics_block_create(void)
+{
+    metrics_block_t *b = aligned_alloc(64, sizeof(*b));
+    if (b == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    memset(b, 0, sizeof(*b));
+
+    b->next = atomic_load(&block_list);
+    while (!atomic_compare_exchange_weak(&block_list, &b->next, b))
+        ;
+    metrics_tls_block = b;
+    return b;
+}
+
+void metrics_enable(void)
+{
+    metrics_enabled = true;
+}
+
+void metrics_register_gauge(const char *name, uint64_t (*fn)(void *arg), void *arg)
+{
+    int i = atomic_load(&num_gauges);
+    if (i >= MAX_GAUGES) {
+        log_warn("too many gauges, dropping %s", name);
+        return;
+    }
+    gauges[i] = (gauge_t){.name = name, .fn = fn, .arg = arg};
+    atomic_store(&num_gauges, i + 1);
+}
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t pos;
+} render_ctx_t;
+
+static void emit(render_ctx_t *ctx, const char *fmt, ...)
+{
+    if (ctx->pos >= ctx->len) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(ctx->buf + ctx->pos, ctx->len - ctx->pos, fmt, ap);
+    va_end(ap);
+    if (n > 0) {
+        ctx->pos += n;
+    }
+    if (ctx->pos > ctx->len) {
+        ctx->pos = ctx->len;
+    }
+}
+
+size_t metrics_render(char *buf, size_t len)
+{
+    render_ctx_t ctx = {.buf = buf, .len = len, .pos = 0};
+
+    uint64_t counters[METRIC_COUNT] = {0};
+    uint64_t buckets[HIST_COUNT][METRICS_HIST_BUCKETS] = {{0}};
+    uint64_t sums[HIST_COUNT] = {0};
+
+    for (metrics_block_t *b = atomic_load(&block_list); b != NULL; b = b->next) {
+        for (int i = 0; i < METRIC_COUNT; i++) {
+            counters[i] += atomic_load_explicit(&b->counters[i], memory_order_relaxed);
+        }
+        for (int h = 0; h < HIST_COUNT; h++) {
+            for (int i = 0; i < METRICS_HIST_BUCKETS; i++) {
+                buckets[h][i] += atomic_load_explicit(&b->hists[h].buckets[i], memory_order_relaxed);
+            }
+            sums[h] += atomic_load_explicit(&b->hists[h].sum, memory_order_relaxed);
+        }
+    }
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        emit(&ctx, "# TYPE %s counter\n%s %lu\n", counter_names[i], counter_names[i],
+             (unsigned long)counters[i]);
+    }
+
+    int n = atomic_load(&num_gauges);
+    for (int i = 0; i < n; i++) {
+        emit(&ctx, "# TYPE %s gauge\n%s %lu\n", gauges[i].name, gauges[i].name,
+             (unsigned long)gauges[i].fn(gauges[i].arg));
+    }
+
+    for (int h = 0; h < HIST_COUNT; h++) {
+        const char *name = hist_names[h];
+        emit(&ctx, "# TYPE %s histogram\n", name);
+        uint64_t cumulative = 0;
+        int last = METRICS_HIST_BUCKETS - 1;
+        while (last > 0 && buckets[h][last] == 0) {
+            last--;
+        }
+        for (int i = 0; i <= last; i++) {
+            cumulative += buckets[h][i];
+            // Upper bound of bucket i is 2^i - 1 (integers only).
+            emit(&ctx, "%s_bucket{le=\"%lu\"} %lu\n", name,
+                 (unsigned long)((1ull << i) - 1), (unsigned long)cumulative);
+        }
+        emit(&ctx, "%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)cumulative);
+        emit(&ctx, "%s_sum %lu\n%s_count %lu\n", name, (unsigned long)sums[h], name,
+             (unsigned long)cumulative);
+    }
+
+    return ctx.pos;
+}
+
+int metrics_listen(int portnum)
+{
+    int fd = listen_inet_socket(portnum);
+    int timeout_sec = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout_sec, sizeof(timeout_sec)) < 0) {
+        perror("setsockopt TCP_DEFER_ACCEPT");
+    }
+    make_socket_non_blocking(fd);
+    return fd;
+}
+
+void metrics_serve_pending(int listen_fd)
+{
+    static char body[RENDER_BUF_SIZE];
+    static char response[RENDER_BUF_SIZE + 256];
+
+    while (1) {
+        int fd = accept_nonblocking(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_warn("stats accept: %s", strerror(errno));
+            }
+            return;
+        }
+
+        // Consume the request so the close below doesn't turn into a RST
+        // that could discard the response before the client reads it.
+        char request[4096];
+        while (recv(fd, request, sizeof(request), MSG_DONTWAIT) > 0)
+            ;
+
+        size_t body_len = metrics_render(body, sizeof(body));
+        int header_len = snprintf(response, sizeof(response),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\n"
+                                  "Connection: close\r\n\r\n",
+                                  body_len);
+        memcpy(response + header_len, body, body_len);
+        if (send(fd, response, header_len + body_len, MSG_NOSIGNAL) < 0) {
+            log_warn("stats send: %s", strerror(errno));
+        }
+        close(fd);
+    }
+}
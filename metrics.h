@@ -0,0 +1,130 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Low-overhead counters and histograms for the servers.
+//
+// Each thread updates its own cache-line-aligned block with plain stores, so
+// the hot path never shares a cache line or takes a lock. Readers sum the
+// blocks of all threads when rendering. Everything is a no-op until
+// metrics_enable() is called.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef enum {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_CONNECTIONS_REJECTED, // Turned away with a busy reply.
+    METRIC_BYTES_RECEIVED,
+    METRIC_BYTES_SENT,
+    METRIC_MESSAGES,
+    METRIC_LOOP_ITERATIONS,
+    METRIC_LOOP_DEFERRALS, // Connections put off to a later iteration.
+    METRIC_ZEROCOPY_SENDS,
+    METRIC_ZEROCOPY_COPIED, // Zero-copy sends the kernel copied anyway.
+    METRIC_FANOUT_DELIVERIES, // Published messages queued for subscribers.
+    METRIC_FANOUT_SKIPPED,    // Not queued, the subscriber lagging behind.
+    METRIC_SUBSCRIBERS_DROPPED,
+    METRIC_CONNECTIONS_MIGRATED, // Moved to another event loop.
+    METRIC_COUNT
+} metric_id_t;
+
+typedef enum {
+    HIST_MESSAGE_PROCESSING_NS, // Time spent in a recv handler.
+    HIST_LOOP_ITERATION_NS,     // Event loop time from wakeup to next wait.
+    HIST_POLL_BATCH,            // Number of events returned per wait.
+    HIST_COUNT
+} histogram_id_t;
+
+// Bucket i counts values in [2^(i-1), 2^i); bucket 0 counts zeros.
+#define METRICS_HIST_BUCKETS 48
+
+typedef struct {
+    _Atomic uint64_t buckets[METRICS_HIST_BUCKETS];
+    _Atomic uint64_t sum;
+} metrics_hist_t;
+
+typedef struct metrics_block {
+    _Atomic uint64_t counters[METRIC_COUNT];
+    metrics_hist_t hists[HIST_COUNT];
+    struct metrics_block *next;
+} __attribute__((aligned(64))) metrics_block_t;
+
+extern bool metrics_enabled;
+extern __thread metrics_block_t *metrics_tls_block;
+
+// Allocates and registers the calling thread's block.
+metrics_block_t *metrics_block_create(void);
+
+// Turns on collection for the whole process.
+void metrics_enable(void);
+
+static inline metrics_block_t *metrics_block(void)
+{
+    metrics_block_t *b = metrics_tls_block;
+    return b != NULL ? b : metrics_block_create();
+}
+
+// Only the owning thread writes to a block, so a relaxed load and store is
+// enough; it compiles to a plain add with no lock prefix.
+static inline void metrics_bump(_Atomic uint64_t *c, uint64_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline void metrics_add(metric_id_t id, uint64_t n)
+{
+    if (!metrics_enabled) {
+        return;
+    }
+    metrics_bump(&metrics_block()->counters[id], n);
+}
+
+static inline void metrics_observe(histogram_id_t id, uint64_t value)
+{
+    if (!metrics_enabled) {
+        return;
+    }
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= METRICS_HIST_BUCKETS) {
+        bucket = METRICS_HIST_BUCKETS - 1;
+    }
+    metrics_hist_t *h = &metrics_block()->hists[id];
+    metrics_bump(&h->buckets[bucket], 1);
+    metrics_bump(&h->sum, value);
+}
+
+// Monotonic timestamp for latency histograms; 0 while metrics are disabled
+// so callers don't pay for the clock read.
+static inline uint64_t metrics_now_ns(void)
+{
+    if (!metrics_enabled) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Registers a gauge sampled at render time, e.g. a queue length.
+void metrics_register_gauge(const char *name, uint64_t (*fn)(void *arg), void *arg);
+
+// Renders all metrics in Prometheus text exposition format. Returns the
+// number of bytes written, truncating to len.
+size_t metrics_render(char *buf, size_t len);
+
+// Creates the listener for the stats endpoint on portnum. TCP_DEFER_ACCEPT is
+// set on it so that connections are only reported once the HTTP request has
+// arrived, letting metrics_serve_pending answer without waiting for data.
+int metrics_listen(int portnum);
+
+// Accepts every pending stats connection on listen_fd, writes the rendered
+// metrics as an HTTP response and closes it. Never blocks. Uses static
+// buffers, so only one thread may serve a given process's stats.
+void metrics_serve_pending(int listen_fd);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -5,64 +6,89 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <errno.h>
 
+#include "busypoll.h"
+#include "logger.h"
 #include "utils.h"
 
+// usage: nonblocking-demo [port] [block|spin|adaptive] [max_spin_us]
+//
+// Serves a single client with the usual '*' ack and ^...$ protocol, waiting
+// for input on its non-blocking socket with the given poll mode (see
+// busypoll.h). Defaults to adaptive with a 50us spin cap.
 int main(int argc, const char** argv)
 {
-    setvbuf(stdout, NULL, _IONBF, 0);
+    logger_init(LOG_LEVEL_INFO);
 
     int portnum = 9988;
     if (argc >= 2) {
         portnum = atoi(argv[1]);
     }
-    printf("Listening on port %d\n", portnum);
+    int mode = POLL_MODE_ADAPTIVE;
+    if (argc >= 3 && (mode = poll_mode_parse(argv[2])) < 0) {
+        fprintf(stderr, "unknown poll mode '%s'\n", argv[2]);
+        exit(1);
+    }
+    int max_spin_us = 50;
+    if (argc >= 4) {
+        max_spin_us = atoi(argv[3]);
+    }
+    log_info("Listening on port %d (%s, max spin %dus)", portnum,
+             argc >= 3 ? argv[2] : "adaptive", max_spin_us);
 
     int sockfd = listen_inet_socket(portnum);
-    struct sockaddr_in peer_addr;
+    struct sockaddr_storage peer_addr;
     socklen_t peer_addr_len = sizeof(peer_addr);
 
-    int newfd = accept(sockfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
+    int newfd = accept_nonblocking(sockfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
     if (newfd < 0) {
         perror("ERROR on accept");
         exit(1);
     }
-    report_peer_connected(&peer_addr, peer_addr_len);
-
-    // Set non blocking mode of socket
-    int flags = fcntl(newfd, F_GETFL, 0);
-    if (flags == -1) {
-        perror("fcntl F_GETFL");
-        exit(1);
-    }
+    tune_accepted_socket(newfd);
+    report_peer_connected(newfd, (struct sockaddr*)&peer_addr, peer_addr_len);
 
-    if (fcntl(newfd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        perror("fcntl F_SETFL O_NONBLOCK");
+    if (send(newfd, "*", 1, MSG_NOSIGNAL) < 1) {
+        perror("send");
         exit(1);
     }
 
+    adaptive_poller_t poller;
+    adaptive_poller_init(&poller, mode, max_spin_us);
 
+    bool in_msg = false;
     while (1) {
         uint8_t buf[1024];
-        printf("Calling recv...\n");
-        int len = recv(newfd, buf, sizeof(buf), 0);
+        int len = adaptive_recv(&poller, newfd, buf, sizeof(buf));
         if (len < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                usleep(200 * 1000);
-                continue;
-            }
             perror("ERROR on recv");
             exit(1);
         } else if (len == 0) {
-            printf("Peer disconnected; I'm done.\n");
+            log_info("Peer disconnected; I'm done.");
             break;
         }
-        printf("recv returned %d bytes\n", len);
+        log_debug("recv returned %d bytes", len);
+
+        int reply_len = 0;
+        for (int i = 0; i < len; i++) {
+            if (!in_msg) {
+                in_msg = buf[i] == '^';
+            } else if (buf[i] == '$') {
+                in_msg = false;
+            } else {
+                buf[reply_len++] = buf[i] + 1;
+            }
+        }
+        if (reply_len > 0 && send(newfd, buf, reply_len, MSG_NOSIGNAL) < reply_len) {
+            perror("send");
+            exit(1);
+        }
     }
+    log_info("spin budget at exit: %luns (average gap %luns)",
+             (unsigned long)poller.spin_budget_ns, (unsigned long)poller.avg_gap_ns);
     close(newfd);
     close(sockfd);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+
+#include "poller.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// select -------------------------------------------------------------------
+
+typedef struct {
+    fd_set readfds;
+    fd_set writefds;
+    int maxfd;
+} select_poller_t;
+
+static poller_t *select_create(int maxfds)
+{
+    select_poller_t *sp = calloc(1, sizeof(*sp));
+    if (sp == NULL) {
+        return NULL;
+    }
+    FD_ZERO(&sp->readfds);
+    FD_ZERO(&sp->writefds);
+    sp->maxfd = -1;
+    return (poller_t *)sp;
+}
+
+static void select_modify(poller_t *p, int fd, bool want_read, bool want_write)
+{
+    select_poller_t *sp = (select_poller_t *)p;
+    if (want_read) {
+        FD_SET(fd, &sp->readfds);
+    } else {
+        FD_CLR(fd, &sp->readfds);
+    }
+    if (want_write) {
+        FD_SET(fd, &sp->writefds);
+    } else {
+        FD_CLR(fd, &sp->writefds);
+    }
+}
+
+static bool select_add(poller_t *p, int fd, bool want_read, bool want_write, int flags)
+{
+    select_poller_t *sp = (select_poller_t *)p;
+    if (fd >= FD_SETSIZE) {
+        return false;
+    }
+    select_modify(p, fd, want_read, want_write);
+    if (fd > sp->maxfd) {
+        sp->maxfd = fd;
+    }
+    return true;
+}
+
+static void select_remove(poller_t *p, int fd)
+{
+    select_poller_t *sp = (select_poller_t *)p;
+    select_modify(p, fd, false, false);
+    while (sp->maxfd >= 0 && !FD_ISSET(sp->maxfd, &sp->readfds) &&
+           !FD_ISSET(sp->maxfd, &sp->writefds)) {
+        sp->maxfd--;
+    }
+}
+
+static int select_wait(poller_t *p, poller_event_t *events, int maxevents, int timeout_ms)
+{
+    select_poller_t *sp = (select_poller_t *)p;
+    fd_set readfds = sp->readfds;
+    fd_set writefds = sp->writefds;
+    struct timeval tv = {.tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000};
+
+    int nready = select(sp->maxfd + 1, &readfds, &writefds, NULL, timeout_ms < 0 ? NULL : &tv);
+    if (nready <= 0) {
+        return nready;
+    }
+
+    // nready counts bits, not fds; stop once every set bit has been seen.
+    int n = 0;
+    for (int fd = 0; fd <= sp->maxfd && nready > 0 && n < maxevents; fd++) {
+        bool r = FD_ISSET(fd, &readfds);
+        bool w = FD_ISSET(fd, &writefds);
+        if (r || w) {
+            nready -= r + w;
+            events[n++] = (poller_event_t){.fd = fd, .readable = r, .writable = w};
+        }
+    }
+    return n;
+}
+
+const poller_ops_t poller_select = {
+    .name = "select",
+    .edge_triggered = false,
+    .create = select_create,
+    .add = select_add,
+    .modify = select_modify,
+    .remove = select_remove,
+    .wait = select_wait,
+};
+
+// poll ---------------------------------------------------------------------
+
+typedef struct {
+    struct pollfd *pfds;
+    int *slot; // fd -> index into pfds, -1 if not registered
+    int npfds;
+    int maxfds;
+} poll_poller_t;
+
+static poller_t *poll_create(int maxfds)
+{
+    poll_poller_t *pp = calloc(1, sizeof(*pp));
+    if (pp == NULL) {
+        return NULL;
+    }
+    pp->pfds = calloc(maxfds, sizeof(*pp->pfds));
+    pp->slot = malloc(maxfds * sizeof(*pp->slot));
+    if (pp->pfds == NULL || pp->slot == NULL) {
+        return NULL;
+    }
+    memset(pp->slot, -1, maxfds * sizeof(*pp->slot));
+    pp->maxfds = maxfds;
+    return (poller_t *)pp;
+}
+
+static short poll_mask(bool want_read, bool want_write)
+{
+    return (want_read ? POLLIN : 0) | (want_write ? POLLOUT : 0);
+}
+
+static bool poll_add(poller_t *p, int fd, bool want_read, bool want_write, int flags)
+{
+    poll_poller_t *pp = (poll_poller_t *)p;
+    if (fd >= pp->maxfds) {
+        return false;
+    }
+    pp->slot[fd] = pp->npfds;
+    pp->pfds[pp->npfds++] = (struct pollfd){.fd = fd, .events = poll_mask(want_read, want_write)};
+    return true;
+}
+
+static void poll_modify(poller_t *p, int fd, bool want_read, bool want_write)
+{
+    poll_poller_t *pp = (poll_poller_t *)p;
+    pp->pfds[pp->slot[fd]].events = poll_mask(want_read, want_write);
+}
+
+// Keeps pfds dense by moving the last entry into the freed slot.
+static void poll_remove(poller_t *p, int fd)
+{
+    poll_poller_t *pp = (poll_poller_t *)p;
+    int i = pp->slot[fd];
+    if (i < 0) {
+        return;
+    }
+    struct pollfd last = pp->pfds[--pp->npfds];
+    pp->pfds[i] = last;
+    pp->slot[last.fd] = i;
+    pp->slot[fd] = -1;
+}
+
+static int poll_wait(poller_t *p, poller_event_t *events, int maxevents, int timeout_ms)
+{
+    poll_poller_t *pp = (poll_poller_t *)p;
+    int nready = poll(pp->pfds, pp->npfds, timeout_ms);
+    if (nready <= 0) {
+        return nready;
+    }
+
+    int n = 0;
+    for (int i = 0; i < pp->npfds && n < nready && n < maxevents; i++) {
+        short re = pp->pfds[i].revents;
+        if (re != 0) {
+            events[n++] = (poller_event_t){
+                .fd = pp->pfds[i].fd,
+                .readable = re & (POLLIN | POLLHUP),
+                .writable = re & (POLLOUT | POLLHUP),
+                .error = re & (POLLERR | POLLNVAL),
+            };
+        }
+    }
+    return n;
+}
+
+const poller_ops_t poller_poll = {
+    .name = "poll",
+    .edge_triggered = false,
+    .create = poll_create,
+    .add = poll_add,
+    .modify = poll_modify,
+    .remove = poll_remove,
+    .wait = poll_wait,
+};
+
+// epoll --------------------------------------------------------------------
+
+typedef struct {
+    int epollfd;
+    bool edge;
+    struct epoll_event *evs;
+    int maxevs;
+} epoll_poller_t;
+
+static poller_t *epoll_create_common(int maxfds, bool edge)
+{
+    epoll_poller_t *ep = calloc(1, sizeof(*ep));
+    if (ep == NULL) {
+        return NULL;
+    }
+    ep->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ep->epollfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    ep->edge = edge;
+    ep->maxevs = maxfds;
+    ep->evs = calloc(maxfds, sizeof(*ep->evs));
+    if (ep->evs == NULL) {
+        return NULL;
+    }
+    return (poller_t *)ep;
+}
+
+static poller_t *epoll_lt_create(int maxfds)
+{
+    return epoll_create_common(maxfds, false);
+}
+
+static poller_t *epoll_et_create(int maxfds)
+{
+    return epoll_create_common(maxfds, true);
+}
+
+static uint32_t epoll_mask(bool want_read, bool want_write)
+{
+    return (want_read ? EPOLLIN : 0) | (want_write ? EPOLLOUT : 0);
+}
+
+static bool epoll_add(poller_t *p, int fd, bool want_read, bool want_write, int flags)
+{
+    epoll_poller_t *ep = (epoll_poller_t *)p;
+    struct epoll_event event = {.data.fd = fd};
+    if (ep->edge && !(flags & POLLER_LEVEL)) {
+        // Registered once for everything; readiness changes arrive as edges.
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    } else {
+        event.events = epoll_mask(want_read, want_write);
+    }
+    if (flags & POLLER_EXCLUSIVE) {
+        event.events |= EPOLLEXCLUSIVE;
+    }
+    if (epoll_ctl(ep->epollfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("epoll_ctl EPOLL_CTL_ADD");
+        exit(1);
+    }
+    return true;
+}
+
+static void epoll_modify(poller_t *p, int fd, bool want_read, bool want_write)
+{
+    epoll_poller_t *ep = (epoll_poller_t *)p;
+    struct epoll_event event = {.data.fd = fd, .events = epoll_mask(want_read, want_write)};
+    if (epoll_ctl(ep->epollfd, EPOLL_CTL_MOD, fd, &event) < 0) {
+        perror("epoll_ctl EPOLL_CTL_MOD");
+        exit(1);
+    }
+}
+
+static void epoll_et_modify(poller_t *p, int fd, bool want_read, bool want_write)
+{
+}
+
+static void epoll_remove(poller_t *p, int fd)
+{
+    epoll_poller_t *ep = (epoll_poller_t *)p;
+    if (epoll_ctl(ep->epollfd, EPOLL_CTL_DEL, fd, NULL) < 0) {
+        perror("epoll_ctl EPOLL_CTL_DEL");
+        exit(1);
+    }
+}
+
+static int epoll_wait_events(poller_t *p, poller_event_t *events, int maxevents, int timeout_ms)
+{
+    epoll_poller_t *ep = (epoll_poller_t *)p;
+    int nready = epoll_wait(ep->epollfd, ep->evs, maxevents < ep->maxevs ? maxevents : ep->maxevs,
+                            timeout_ms);
+    for (int i = 0; i < nready; i++) {
+        uint32_t e = ep->evs[i].events;
+        events[i] = (poller_event_t){
+            .fd = ep->evs[i].data.fd,
+            .readable = e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP),
+            .writable = e & (EPOLLOUT | EPOLLHUP),
+            .error = e & EPOLLERR,
+        };
+    }
+    return nready;
+}
+
+const poller_ops_t poller_epoll = {
+    .name = "epoll",
+    .edge_triggered = false,
+    .create = epoll_lt_create,
+    .add = epoll_add,
+    .modify = epoll_modify,
+    .remove = epoll_remove,
+    .wait = epoll_wait_events,
+};
+
+const poller_ops_t poller_epoll_et = {
+    .name = "epoll-et",
+    .edge_triggered = true,
+    .create = epoll_et_create,
+    .add = epoll_add,
+    .modify = epoll_et_modify,
+    .remove = epoll_remove,
+    .wait = epoll_wait_events,
+};
+
+// io_uring -----------------------------------------------------------------
+//
+// Talks to the kernel through the raw syscalls so there's no liburing
+// dependency. Peers get one multishot IORING_OP_POLL_ADD each, which posts a
+// completion on every wakeup, i.e. edge-triggered. Level-triggered fds (the
+// listener) use one-shot polls that are re-armed after every completion.
+// Waiting with a positive timeout isn't supported; -1 and 0 are.
+
+#define URING_ENTRIES 4096
+#define URING_IGNORE UINT64_MAX
+
+typedef struct {
+    int ring_fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned to_submit;
+    uint32_t next_gen;
+    uint32_t *gen;   // fd -> generation of its live poll, 0 if none
+    bool *level;     // fd -> uses one-shot polls
+    int maxfds;
+} uring_poller_t;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static poller_t *uring_create(int maxfds)
+{
+    uring_poller_t *up = calloc(1, sizeof(*up));
+    if (up == NULL) {
+        return NULL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    up->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (up->ring_fd < 0) {
+        perror("io_uring_setup");
+        free(up);
+        return NULL;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    up->ring_fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  up->ring_fd, IORING_OFF_CQ_RING);
+    }
+    up->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, up->ring_fd,
+                    IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || up->sqes == MAP_FAILED) {
+        perror("mmap io_uring");
+        exit(1);
+    }
+
+    up->sq_head = (unsigned *)(sq + params.sq_off.head);
+    up->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    up->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    up->sq_array = (unsigned *)(sq + params.sq_off.array);
+    up->sq_entries = params.sq_entries;
+    up->cq_head = (unsigned *)(cq + params.cq_off.head);
+    up->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    up->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    up->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    up->gen = calloc(maxfds, sizeof(*up->gen));
+    up->level = calloc(maxfds, sizeof(*up->level));
+    if (up->gen == NULL || up->level == NULL) {
+        return NULL;
+    }
+    up->maxfds = maxfds;
+    return (poller_t *)up;
+}
+
+static void uring_submit(uring_poller_t *up)
+{
+    while (up->to_submit > 0) {
+        int n = sys_io_uring_enter(up->ring_fd, up->to_submit, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("io_uring_enter");
+            exit(1);
+        }
+        up->to_submit -= n;
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring_poller_t *up)
+{
+    unsigned tail = *up->sq_tail;
+    if (tail - __atomic_load_n(up->sq_head, __ATOMIC_ACQUIRE) >= up->sq_entries) {
+        uring_submit(up);
+    }
+    unsigned index = tail & up->sq_mask;
+    struct io_uring_sqe *sqe = &up->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    up->sq_array[index] = index;
+    __atomic_store_n(up->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    up->to_submit++;
+    return sqe;
+}
+
+static void uring_arm(uring_poller_t *up, int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(up);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN | POLLOUT | POLLRDHUP;
+    if (up->level[fd]) {
+        sqe->poll32_events = POLLIN;
+    } else {
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+    sqe->user_data = ((uint64_t)up->gen[fd] << 32) | (uint32_t)fd;
+}
+
+static bool uring_add(poller_t *p, int fd, bool want_read, bool want_write, int flags)
+{
+    uring_poller_t *up = (uring_poller_t *)p;
+    if (fd >= up->maxfds) {
+        return false;
+    }
+    if (++up->next_gen == 0) {
+        up->next_gen = 1;
+    }
+    up->gen[fd] = up->next_gen;
+    up->level[fd] = flags & POLLER_LEVEL;
+    uring_arm(up, fd);
+    return true;
+}
+
+static void uring_modify(poller_t *p, int fd, bool want_read, bool want_write)
+{
+}
+
+static void uring_remove(poller_t *p, int fd)
+{
+    uring_poller_t *up = (uring_poller_t *)p;
+    struct io_uring_sqe *sqe = uring_get_sqe(up);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = ((uint64_t)up->gen[fd] << 32) | (uint32_t)fd;
+    sqe->user_data = URING_IGNORE;
+    up->gen[fd] = 0;
+    // Submit now: the pending poll holds a reference to the socket, which
+    // would otherwise stay open after the caller closes the fd.
+    uring_submit(up);
+}
+
+static int uring_wait(poller_t *p, poller_event_t *events, int maxevents, int timeout_ms)
+{
+    uring_poller_t *up = (uring_poller_t *)p;
+
+    unsigned head = *up->cq_head;
+    bool have_cqes = head != __atomic_load_n(up->cq_tail, __ATOMIC_ACQUIRE);
+    if (up->to_submit > 0 || (timeout_ms != 0 && !have_cqes)) {
+        bool block = timeout_ms != 0 && !have_cqes;
+        int n = sys_io_uring_enter(up->ring_fd, up->to_submit, block ? 1 : 0,
+                                   block ? IORING_ENTER_GETEVENTS : 0);
+        if (n < 0) {
+            return -1;
+        }
+        up->to_submit -= n;
+    }
+
+    int nevents = 0;
+    unsigned tail = __atomic_load_n(up->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail && nevents < maxevents; head++) {
+        struct io_uring_cqe *cqe = &up->cqes[head & up->cq_mask];
+        if (cqe->user_data == URING_IGNORE) {
+            continue;
+        }
+        int fd = (int)(uint32_t)cqe->user_data;
+        uint32_t gen = cqe->user_data >> 32;
+        if (fd >= up->maxfds || up->gen[fd] != gen) {
+            continue; // completion for a poll that was already removed
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            uring_arm(up, fd);
+        }
+        if (cqe->res < 0) {
+            if (cqe->res == -ECANCELED) {
+                continue;
+            }
+            events[nevents++] = (poller_event_t){.fd = fd, .error = true};
+            continue;
+        }
+        unsigned re = cqe->res;
+        events[nevents++] = (poller_event_t){
+            .fd = fd,
+            .readable = re & (POLLIN | POLLRDHUP | POLLHUP),
+            .writable = re & (POLLOUT | POLLHUP),
+            .error = re & POLLERR,
+        };
+    }
+    __atomic_store_n(up->cq_head, head, __ATOMIC_RELEASE);
+    return nevents;
+}
+
+const poller_ops_t poller_uring = {
+    .name = "uring",
+    .edge_triggered = true,
+    .create = uring_create,
+    .add = uring_add,
+    .modify = uring_modify,
+    .remove = uring_remove,
+    .wait = uring_wait,
+};
+
+const poller_ops_t *poller_by_name(const char *name)
+{
+    static const poller_ops_t *all[] = {
+        &poller_select, &poller_poll, &poller_epoll, &poller_epoll_et, &poller_uring,
+    };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(all[i]->name, name) == 0) {
+            return all[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+// Readiness notification backends for the reactor (see reactor.h).
+//
+// Every backend hands back a compact list of ready fds, so the reactor's
+// dispatch is O(ready) regardless of backend. What the backend itself pays
+// to build that list differs: select scans every fd up to the highest one
+// registered, poll scans every registered fd, and epoll and io_uring only
+// touch the fds that are actually ready.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+    int fd;
+    bool readable;
+    bool writable;
+    bool error;
+} poller_event_t;
+
+// Flags for add().
+#define POLLER_EXCLUSIVE 0x1 // Wake only one of several pollers sharing fd.
+#define POLLER_LEVEL 0x2     // Level-triggered even on an edge backend.
+
+typedef struct poller poller_t;
+
+typedef struct {
+    const char *name;
+    // Edge-triggered backends report readiness once per change. The caller
+    // must keep reading or writing until it gets EAGAIN, and modify() is a
+    // no-op because interest never changes after add().
+    bool edge_triggered;
+    poller_t *(*create)(int maxfds);
+    // Returns false if this backend can't watch fd (e.g. beyond FD_SETSIZE).
+    bool (*add)(poller_t *p, int fd, bool want_read, bool want_write, int flags);
+    void (*modify)(poller_t *p, int fd, bool want_read, bool want_write);
+    void (*remove)(poller_t *p, int fd);
+    // Waits up to timeout_ms (-1: forever, 0: don't block) and fills at most
+    // maxevents entries. Returns the count, or -1 with errno set.
+    int (*wait)(poller_t *p, poller_event_t *events, int maxevents, int timeout_ms);
+} poller_ops_t;
+
+extern const poller_ops_t poller_select;
+extern const poller_ops_t poller_poll;
+extern const poller_ops_t poller_epoll;
+extern const poller_ops_t poller_epoll_et;
+extern const poller_ops_t poller_uring;
+
+// Looks up a backend by name: select, poll, epoll, epoll-et or uring.
+// Returns NULL if unknown.
+const poller_ops_t *poller_by_name(const char *name);
+
+#endif
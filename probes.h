@@ -0,0 +1,47 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT (user-level statically defined tracing) probes on the hot paths,
+// under the provider name "echo".
+//
+// When <sys/sdt.h> (systemtap-sdt-dev / systemtap-sdt-devel) is found at
+// build time, each PROBE site compiles to a single nop plus an ELF note
+// saying where its arguments live; nothing runs until perf or bpftrace
+// attaches and turns the nop into a breakpoint. Otherwise, or with
+// -DNO_PROBES, the macros expand to nothing and the arguments are never
+// evaluated, so they must not have side effects.
+//
+// List them with `readelf -n <binary>`, `bpftrace -l 'usdt:<binary>:*'`, or
+// `perf buildid-cache --add <binary>; perf list sdt_echo:*`. profile.sh has
+// ready-made uses. Timestamps are CLOCK_MONOTONIC ns, bpftrace's nsecs.
+//
+//   task_enqueue(queued)       tpool: a task joined the queue, now this long
+//   task_start(enqueued_ns)    tpool: a worker took a task queued at that time
+//   task_finish()              tpool: ... and is done with it
+//   task_shed(enqueued_ns)     tpool: a worker shed it instead
+//   loop_wakeup(loop, nready)  reactor: a poller wait returned nready events
+//   accept(fd)                 a connection was accepted
+//   recv(fd, bytes)            protocol.c read bytes from a peer
+//   send(fd, bytes)            ... and wrote bytes to it
+//   state(fd, from, to)        a peer's ProcessingState changed
+
+#if defined(__has_include) && !defined(NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#define PROBE0(name) DTRACE_PROBE(echo, name)
+#define PROBE1(name, a) DTRACE_PROBE1(echo, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(echo, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(echo, name, a, b, c)
+#else
+#define PROBE0(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif
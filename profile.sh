@@ -0,0 +1,121 @@
+#!/bin/sh
+# Profiles a running server: on-CPU and off-CPU flame graphs, or the
+# probes.h USDT probes summarized as histograms.
+#
+# usage: ./profile.sh cpu|offcpu|probes <pid> [seconds] [command ...]
+#
+# If a command is given (typically a loadgen run), it's started alongside
+# the recording, so a benchmark can be profiled in one go:
+#
+#   ./profile.sh cpu $(pgrep -n epoll-server) 10 ./loadgen -d 10 echo 127.0.0.1 9090
+#
+#   cpu     perf samples at FREQ Hz (default 997) -> profile-cpu-<pid>.svg
+#   offcpu  bpftrace sums the time each thread spends blocked, by kernel and
+#           user stack -> profile-offcpu-<pid>.svg
+#   probes  bpftrace on the probes.h probes present in the binary: task
+#           queueing delay and run time, queue length, events per wakeup,
+#           recv/send sizes, accepts and state transitions -> stdout
+#
+# The flame graphs need Brendan Gregg's FlameGraph scripts in FLAMEGRAPH_DIR
+# (default ./FlameGraph). User stacks need frame pointers: build with
+# -fno-omit-frame-pointer, or set CALLGRAPH=dwarf for perf. The probes exist
+# only if the server was built with <sys/sdt.h> installed. perf and bpftrace
+# need root or relaxed perf_event_paranoid / kptr_restrict.
+MODE=$1
+PID=$2
+SECS=${3:-10}
+if [ -z "$MODE" ] || [ -z "$PID" ]; then
+    echo "usage: $0 cpu|offcpu|probes <pid> [seconds] [command ...]" >&2
+    exit 1
+fi
+shift 2
+[ $# -gt 0 ] && shift
+FG=${FLAMEGRAPH_DIR:-./FlameGraph}
+BIN=$(readlink /proc/"$PID"/exe) || exit 1
+
+need_flamegraph() {
+    if [ ! -x "$FG/flamegraph.pl" ]; then
+        echo "no flamegraph.pl in $FG; set FLAMEGRAPH_DIR" >&2
+        exit 1
+    fi
+}
+
+cpu() {
+    need_flamegraph
+    data=profile-cpu-$PID.data
+    perf record -F "${FREQ:-997}" --call-graph "${CALLGRAPH:-fp}" -p "$PID" -o "$data" \
+        -- sleep "$SECS" || exit 1
+    perf script -i "$data" | "$FG/stackcollapse-perf.pl" |
+        "$FG/flamegraph.pl" --title "on-CPU $(basename "$BIN") $PID" \
+        >profile-cpu-"$PID".svg
+    echo "wrote profile-cpu-$PID.svg" >&2
+}
+
+# The thread switching back in finds its blocked-at stacks still in place,
+# so they're taken in finish_task_switch, along with how long it was out.
+offcpu() {
+    need_flamegraph
+    bpftrace -e "
+tracepoint:sched:sched_switch /pid == $PID/ { @start[tid] = nsecs; }
+kprobe:finish_task_switch* /@start[tid]/ {
+    @us[kstack, ustack, comm] = sum((nsecs - @start[tid]) / 1000);
+    delete(@start[tid]);
+}
+interval:s:$SECS { exit(); }
+END { clear(@start); }
+" | "$FG/stackcollapse-bpftrace.pl" |
+        "$FG/flamegraph.pl" --title "off-CPU $(basename "$BIN") $PID" --countname us \
+        --color io >profile-offcpu-"$PID".svg
+    echo "wrote profile-offcpu-$PID.svg" >&2
+}
+
+# bpftrace refuses probes the binary doesn't have, so only the ones listed in
+# its notes go into the script.
+probes() {
+    notes=$(readelf -n "$BIN" 2>/dev/null | awk '/Provider: echo/ {p = 1; next} p && /Name:/ {print $2} {p = 0}')
+    if [ -z "$notes" ]; then
+        echo "$BIN has no echo probes; rebuild it with <sys/sdt.h> installed" >&2
+        exit 1
+    fi
+    prog=""
+    fini=""
+    for probe in $notes; do
+        case $probe in
+        task_enqueue) body='@queue_len = hist(arg0);' ;;
+        task_start)
+            body='@queueing_us = hist((nsecs - arg0) / 1000); @start[tid] = nsecs;'
+            fini='END { clear(@start); }'
+            ;;
+        task_finish) body='if (@start[tid]) { @run_us = hist((nsecs - @start[tid]) / 1000); delete(@start[tid]); }' ;;
+        task_shed) body='@shed_queueing_us = hist((nsecs - arg0) / 1000);' ;;
+        loop_wakeup) body='@events_per_wakeup[arg0] = hist(arg1);' ;;
+        accept) body='@accepts = count();' ;;
+        recv) body='@recv_bytes = hist(arg1);' ;;
+        send) body='@send_bytes = hist(arg1);' ;;
+        state) body='@transitions[arg1, arg2] = count();' ;;
+        *) continue ;;
+        esac
+        prog="$prog
+usdt:$BIN:echo:$probe { $body }"
+    done
+    bpftrace -p "$PID" -e "$prog
+interval:s:$SECS { exit(); }
+$fini"
+}
+
+case $MODE in
+cpu | offcpu | probes) ;;
+*)
+    echo "unknown mode $MODE" >&2
+    exit 1
+    ;;
+esac
+
+if [ $# -gt 0 ]; then
+    "$@" &
+    cmd=$!
+fi
+$MODE
+if [ -n "$cmd" ]; then
+    wait $cmd
+fi
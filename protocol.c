@@ -0,0 +1,481 @@
+#include "protocol.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "capture.h"
+#include "logger.h"
+#include "metrics.h"
+#include "probes.h"
+#include "utils.h"
+
+peer_state_t global_state[MAXFDS];
+
+// Smallest reply sent with MSG_ZEROCOPY, or -1 with the zero-copy mode off.
+static int zerocopy_min = -1;
+static pthread_once_t zerocopy_once = PTHREAD_ONCE_INIT;
+
+static void load_zerocopy_min(void) {
+    const char *env = getenv("ZEROCOPY_MIN_BYTES");
+    if (env != NULL) {
+        zerocopy_min = atoi(env);
+    }
+}
+
+static bool zerocopy_mode(void) {
+    pthread_once(&zerocopy_once, load_zerocopy_min);
+    return zerocopy_min >= 0;
+}
+
+// Free zero-copy mode buffers, linked through their first word. A connection
+// is served by one event loop at a time, so each keeps its own.
+static __thread uint8_t *free_bufs;
+
+static uint8_t *buf_get(void) {
+    uint8_t *buf = free_bufs;
+    if (buf != NULL) {
+        free_bufs = *(uint8_t **)buf;
+        return buf;
+    }
+    buf = mmap(NULL, ZC_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return buf;
+}
+
+static void buf_put(uint8_t *buf) {
+    *(uint8_t **)buf = free_bufs;
+    free_bufs = buf;
+}
+
+// Gets rid of a buffer the kernel may still be sending from: unmapped, its
+// pages stay with the kernel until it's done, whereas reusing it could change
+// data that hasn't gone out yet.
+static void buf_abandon(uint8_t *buf) {
+    munmap(buf, ZC_BUF_SIZE);
+}
+
+// Whether a recv error ends just this connection: a reset, or on a kernel
+// TLS socket (see ktls.h) a record that isn't data, such as the client's
+// close_notify, or one that doesn't authenticate.
+static bool recv_peer_gone(int err) {
+    return err == ECONNRESET || err == EIO || err == EBADMSG;
+}
+
+// What the connection waits for given its state: the socket to take pending
+// output, or more input.
+static fd_status_t next_status(const peer_state_t *peerstate) {
+    if (peerstate->state == INITIAL_ACK || peerstate->sendptr < peerstate->sendbuf_end) {
+        return fd_status_W;
+    }
+    return fd_status_R;
+}
+
+static void reset_output(peer_state_t *peerstate) {
+    peerstate->sendptr = 0;
+    peerstate->sendbuf_end = 0;
+    peerstate->outbuf = NULL;
+    peerstate->outbuf_zerocopy = false;
+    peerstate->zc_next_seq = 0;
+    peerstate->num_inflight = 0;
+}
+
+static inline void set_state(peer_state_t *peerstate, ProcessingState state) {
+    PROBE3(state, (int)(peerstate - global_state), peerstate->state, state);
+    peerstate->state = state;
+}
+
+// Runs the protocol state machine over n bytes of input and writes the reply
+// to out, returning its length. out may be in: no reply byte gets ahead of
+// the input byte it comes from.
+static int process_input(peer_state_t *peerstate, const uint8_t *in, int n, uint8_t *out) {
+    int outlen = 0;
+    for (int i=0; i<n; ++i) {
+        switch (peerstate->state) {
+        case INITIAL_ACK:
+            assert(0 && "can't reach here");
+            break;
+        case WAIT_FOR_FRAMING:
+            if (in[i] == FRAMING_BINARY_MAGIC) {
+                set_state(peerstate, FRAMED);
+                frame_decoder_init(&peerstate->frame);
+                break;
+            }
+            set_state(peerstate, WAIT_FOR_MSG);
+            __attribute__((fallthrough));
+        case WAIT_FOR_MSG:
+            if (in[i] == '^') {
+                set_state(peerstate, IN_MSG);
+            }
+            break;
+        case IN_MSG:
+            if (in[i] == '$') {
+                set_state(peerstate, WAIT_FOR_MSG);
+                metrics_add(METRIC_MESSAGES, 1);
+            } else {
+                out[outlen++] = in[i] + 1;
+            }
+            break;
+        case FRAMED: {
+            // The rest is frames, replied to byte for byte.
+            int frames = frame_transform(&peerstate->frame, &in[i], n - i, &out[outlen]);
+            metrics_add(METRIC_MESSAGES, frames);
+            return outlen + (n - i);
+        }
+        }
+    }
+    return outlen;
+}
+
+// Marks zero-copy sends lo through hi as done, returning the buffers whose
+// last send is among them to the pool. TCP frees its send buffers in order,
+// so by then the kernel is done with the earlier sends of a buffer too.
+static void complete_zerocopy(peer_state_t *peerstate, uint32_t lo, uint32_t hi, bool copied) {
+    for (int i = 0; i < peerstate->num_inflight;) {
+        // Sequence numbers wrap at 32 bits.
+        if ((uint32_t)(peerstate->inflight[i].last_seq - lo) <= (uint32_t)(hi - lo)) {
+            buf_put(peerstate->inflight[i].buf);
+            peerstate->inflight[i] = peerstate->inflight[--peerstate->num_inflight];
+        } else {
+            i++;
+        }
+    }
+    if (copied) {
+        // The kernel had to copy after all (e.g. over loopback), which costs
+        // more than a plain send.
+        peerstate->zerocopy_off = true;
+        metrics_add(METRIC_ZEROCOPY_COPIED, hi - lo + 1);
+    }
+}
+
+// Reads all zero-copy completions queued on the socket's error queue.
+static void drain_completions(int sockfd, peer_state_t *peerstate) {
+    while (1) {
+        uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr msg = {.msg_control = control, .msg_controllen = sizeof(control)};
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            return;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            const struct sock_extended_err *err = (const void *)CMSG_DATA(cm);
+            if (err->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                complete_zerocopy(peerstate, err->ee_info, err->ee_data,
+                                  err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            }
+        }
+    }
+}
+
+// Whether the next send of the pending output should be zero-copy.
+static bool use_zerocopy(int sockfd, peer_state_t *peerstate) {
+    if (peerstate->outbuf == NULL || peerstate->zerocopy_off ||
+        peerstate->sendbuf_end < zerocopy_min) {
+        return false;
+    }
+    if (peerstate->num_inflight == ZC_MAX_INFLIGHT) {
+        // Backends that don't report the error queue leave completions to
+        // be picked up here.
+        drain_completions(sockfd, peerstate);
+    }
+    return peerstate->num_inflight < ZC_MAX_INFLIGHT;
+}
+
+// The pending output has all been sent: the buffer can go, or wait for its
+// completion if the kernel may still be sending from it.
+static void finish_outbuf(peer_state_t *peerstate) {
+    if (peerstate->outbuf_zerocopy) {
+        peerstate->inflight[peerstate->num_inflight++] = (zc_inflight_t){
+            .buf = peerstate->outbuf, .last_seq = peerstate->zc_next_seq - 1};
+    } else {
+        buf_put(peerstate->outbuf);
+    }
+    peerstate->outbuf = NULL;
+    peerstate->outbuf_zerocopy = false;
+}
+
+fd_status_t on_peer_connected(int sockfd, const struct sockaddr *peer_addr, socklen_t peer_addr_len) {
+    assert (sockfd < MAXFDS);
+    report_peer_connected(sockfd, peer_addr, peer_addr_len);
+
+    peer_state_t *peerstate = &global_state[sockfd];
+    peerstate->state = INITIAL_ACK;
+    peerstate->capture_conn = capture_open_conn();
+    reset_output(peerstate);
+    peerstate->sendbuf[0] = '*';
+    peerstate->sendbuf_end = 1;
+
+    // Without SO_ZEROCOPY, MSG_ZEROCOPY is silently ignored.
+    int one = 1;
+    peerstate->zerocopy_off = !zerocopy_mode() ||
+        setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0;
+
+    return fd_status_W;
+}
+
+// The zero-copy mode's counterpart of the recv path below, also taken by
+// framed connections: reads into a pooled buffer and builds the reply over
+// the input. Framed replies are as long as their input, so they wouldn't
+// fit sendbuf from a larger read.
+static fd_status_t recv_in_place(int sockfd, peer_state_t *peerstate) {
+    uint8_t *buf = buf_get();
+    int nbytes = recv(sockfd, buf, ZC_BUF_SIZE, 0);
+    if (nbytes <= 0) {
+        buf_put(buf);
+        if (nbytes == 0) {
+            return fd_status_NORW;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return fd_status_R_BLOCKED;
+        } else if (recv_peer_gone(errno)) {
+            return fd_status_NORW;
+        } else {
+            perror("perror recv");
+            exit(1);
+        }
+    }
+    metrics_add(METRIC_BYTES_RECEIVED, nbytes);
+    PROBE2(recv, sockfd, nbytes);
+    capture_data(peerstate->capture_conn, buf, nbytes);
+
+    int outlen = process_input(peerstate, buf, nbytes, buf);
+    if (outlen == 0) {
+        buf_put(buf);
+        return fd_status_R;
+    }
+    peerstate->outbuf = buf;
+    peerstate->sendptr = 0;
+    peerstate->sendbuf_end = outlen;
+    return fd_status_W;
+}
+
+fd_status_t on_peer_ready_recv(int sockfd) {
+    assert(sockfd < MAXFDS);
+    peer_state_t *peerstate = &global_state[sockfd];
+
+    if (peerstate->state == INITIAL_ACK || peerstate->sendptr < peerstate->sendbuf_end) {
+        return fd_status_W;
+    }
+    if (zerocopy_mode() || peerstate->state == FRAMED) {
+        return recv_in_place(sockfd, peerstate);
+    }
+
+    uint8_t buf[1024];
+    int nbytes = recv(sockfd, buf, sizeof buf, 0);
+    if (nbytes == 0) {
+        return fd_status_NORW;
+    } else if (nbytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return fd_status_R_BLOCKED;
+        } else if (recv_peer_gone(errno)) {
+            return fd_status_NORW;
+        } else {
+            perror("perror recv");
+            exit(1);
+        }
+    }
+    metrics_add(METRIC_BYTES_RECEIVED, nbytes);
+    PROBE2(recv, sockfd, nbytes);
+    capture_data(peerstate->capture_conn, buf, nbytes);
+    // Nothing is pending here, so the reply starts at the front of sendbuf.
+    static_assert(sizeof(buf) <= SENDBUF_SIZE, "a reply must fit in sendbuf");
+    peerstate->sendbuf_end = process_input(peerstate, buf, nbytes, peerstate->sendbuf);
+    bool ready_to_send = peerstate->sendbuf_end > 0;
+    return (fd_status_t){.want_read = !ready_to_send, .want_write = ready_to_send};
+}
+
+
+fd_status_t on_peer_ready_send(int sockfd) {
+    assert(sockfd < MAXFDS);
+    peer_state_t * peerstate = &global_state[sockfd];
+
+    if (peerstate->sendptr >= peerstate->sendbuf_end) {
+        return fd_status_R;
+    }
+    const uint8_t *data = peerstate->outbuf != NULL ? peerstate->outbuf : peerstate->sendbuf;
+    int sendlen = peerstate->sendbuf_end - peerstate->sendptr;
+    int flags = MSG_NOSIGNAL;
+    if (use_zerocopy(sockfd, peerstate)) {
+        flags |= MSG_ZEROCOPY;
+    }
+    int nsent = send(sockfd, &data[peerstate->sendptr], sendlen, flags);
+    if (nsent == -1 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        // Out of socket memory to track the send with; copy this one.
+        flags &= ~MSG_ZEROCOPY;
+        nsent = send(sockfd, &data[peerstate->sendptr], sendlen, flags);
+    }
+    if (nsent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return fd_status_W_BLOCKED;
+        } else if (errno == ECONNRESET || errno == EPIPE) {
+            return fd_status_NORW;
+        } else {
+            perror("perror send");
+            exit(1);
+        }
+    }
+    metrics_add(METRIC_BYTES_SENT, nsent);
+    PROBE2(send, sockfd, nsent);
+    if (flags & MSG_ZEROCOPY) {
+        // Every zero-copy send that queued something gets the next number.
+        peerstate->zc_next_seq++;
+        peerstate->outbuf_zerocopy = true;
+        metrics_add(METRIC_ZEROCOPY_SENDS, 1);
+    }
+    if (nsent < sendlen) {
+        peerstate->sendptr += nsent;
+        return fd_status_W;
+    } else {
+        if (peerstate->outbuf != NULL) {
+            finish_outbuf(peerstate);
+        }
+        peerstate->sendptr = 0;
+        peerstate->sendbuf_end = 0;
+
+        if (peerstate->state == INITIAL_ACK) {
+            set_state(peerstate, WAIT_FOR_FRAMING);
+        }
+
+        return fd_status_R;
+    }
+}
+
+// Called when the poller flags an error on the socket: either zero-copy
+// completions waiting on the error queue, or a real error.
+fd_status_t on_peer_error(int sockfd) {
+    assert(sockfd < MAXFDS);
+    peer_state_t *peerstate = &global_state[sockfd];
+
+    drain_completions(sockfd, peerstate);
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err != 0) {
+        return fd_status_NORW;
+    }
+    return next_status(peerstate);
+}
+
+void on_peer_closed(int sockfd) {
+    assert(sockfd < MAXFDS);
+    peer_state_t *peerstate = &global_state[sockfd];
+
+    if (peerstate->outbuf != NULL) {
+        if (peerstate->outbuf_zerocopy) {
+            buf_abandon(peerstate->outbuf);
+        } else {
+            buf_put(peerstate->outbuf);
+        }
+    }
+    for (int i = 0; i < peerstate->num_inflight; i++) {
+        buf_abandon(peerstate->inflight[i].buf);
+    }
+    reset_output(peerstate);
+    capture_close_conn(peerstate->capture_conn);
+    peerstate->capture_conn = 0;
+}
+
+// Snapshot layout, little-endian: [state:1][frame length:4][frame left:4]
+// [in frame header:1][pending length:2][pending bytes].
+#define SNAPSHOT_HEADER 12
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+size_t save_peer_state(int sockfd, uint8_t *buf, size_t len) {
+    assert(sockfd < MAXFDS);
+    peer_state_t *peerstate = &global_state[sockfd];
+
+    const uint8_t *data = peerstate->outbuf != NULL ? peerstate->outbuf : peerstate->sendbuf;
+    size_t pending = peerstate->sendbuf_end - peerstate->sendptr;
+    assert(len >= SNAPSHOT_HEADER + pending);
+    buf[0] = peerstate->state;
+    put_u32(&buf[1], peerstate->frame.len);
+    put_u32(&buf[5], peerstate->frame.left);
+    buf[9] = peerstate->frame.in_header;
+    buf[10] = pending & 0xff;
+    buf[11] = pending >> 8;
+    memcpy(&buf[SNAPSHOT_HEADER], &data[peerstate->sendptr], pending);
+    return SNAPSHOT_HEADER + pending;
+}
+
+fd_status_t restore_peer_state(int sockfd, const uint8_t *buf, size_t len) {
+    assert(sockfd < MAXFDS);
+    peer_state_t *peerstate = &global_state[sockfd];
+
+    if (len < SNAPSHOT_HEADER || buf[0] > FRAMED) {
+        return fd_status_NORW;
+    }
+    bool pooled = zerocopy_mode() || buf[0] == FRAMED;
+    size_t pending = buf[10] | (size_t)buf[11] << 8;
+    size_t max_pending = pooled ? ZC_BUF_SIZE : SENDBUF_SIZE;
+    if (pending > max_pending || len != SNAPSHOT_HEADER + pending) {
+        return fd_status_NORW;
+    }
+    peerstate->state = buf[0];
+    peerstate->frame.len = get_u32(&buf[1]);
+    peerstate->frame.left = get_u32(&buf[5]);
+    peerstate->frame.in_header = buf[9];
+    peerstate->capture_conn = capture_open_conn();
+    reset_output(peerstate);
+    if (pooled && pending > 0) {
+        peerstate->outbuf = buf_get();
+    }
+    memcpy(peerstate->outbuf != NULL ? peerstate->outbuf : peerstate->sendbuf,
+           &buf[SNAPSHOT_HEADER], pending);
+    peerstate->sendbuf_end = pending;
+    // Zero-copy sends are numbered per socket, continuing from the previous
+    // process's, which we can't know; this connection sticks to copies.
+    peerstate->zerocopy_off = true;
+
+    return next_status(peerstate);
+}
+
+// Nothing here belongs to a loop: the state table is shared, and zero-copy
+// buffers the connection holds just join the new loop's free list when
+// they are done. (reactor.c logs where it went; calling back into it from
+// here would tie static-epoll-server to the dynamic reactor.)
+void on_peer_migrated(int sockfd, int from_loop) {
+    log_debug("socket %d moved from loop %d", sockfd, from_loop);
+}
+
+void protocol_session_init(peer_state_t *peerstate) {
+    memset(peerstate, 0, sizeof(*peerstate));
+    peerstate->state = WAIT_FOR_FRAMING;
+}
+
+int protocol_process(peer_state_t *peerstate, const uint8_t *in, int n, uint8_t *out) {
+    return process_input(peerstate, in, n, out);
+}
+
+const reactor_handlers_t protocol_handlers = {
+    .on_peer_connected = on_peer_connected,
+    .on_peer_ready_recv = on_peer_ready_recv,
+    .on_peer_ready_send = on_peer_ready_send,
+    .on_peer_error = on_peer_error,
+    .on_peer_closed = on_peer_closed,
+    .save_peer = save_peer_state,
+    .restore_peer = restore_peer_state,
+    .on_peer_migrated = on_peer_migrated,
+};
@@ -0,0 +1,96 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// The '*' ack and ^...$ echo protocol as non-blocking reactor handlers.
+//
+// After connecting, the server sends '*'. From then on, every byte the
+// client sends between a '^' and the following '$' is echoed back
+// incremented by one; bytes outside ^...$ are ignored. A client that sends
+// NUL first switches its connection to the length-prefixed framing of
+// framing.h instead. Framed connections read and reply through the pooled
+// ZC_BUF_SIZE buffers described below, zero-copy mode or not.
+//
+// With ZEROCOPY_MIN_BYTES set, input is read ZC_BUF_SIZE at a time straight
+// into a pooled buffer and the reply built in place there, saving the copy
+// into sendbuf. Replies of at least ZEROCOPY_MIN_BYTES are then sent with
+// MSG_ZEROCOPY, so the kernel transmits from the buffer itself instead of
+// copying it. The buffer only goes back to the pool once the completion for
+// its last send shows up on the socket's error queue (drained by
+// on_peer_error). A connection whose completions say the kernel copied after
+// all, as it always does on loopback, goes back to plain sends.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "framing.h"
+#include "reactor.h"
+
+// Per-connection state is kept in a table indexed by fd; connections with
+// fds at or above this are refused.
+#define MAXFDS 16384
+
+// WAIT_FOR_FRAMING is the first byte after the ack, which picks the framing;
+// FRAMED is for good.
+typedef enum { INITIAL_ACK, WAIT_FOR_MSG, IN_MSG, WAIT_FOR_FRAMING, FRAMED } ProcessingState;
+
+#define SENDBUF_SIZE 1024
+
+// Size of the pooled buffers of the zero-copy mode.
+#define ZC_BUF_SIZE 32768
+
+// Zero-copy sends one connection may have awaiting completion; beyond that
+// it sends with copies until some complete.
+#define ZC_MAX_INFLIGHT 8
+
+typedef struct {
+    uint8_t *buf;
+    uint32_t last_seq; // Completion number of the buffer's last send.
+} zc_inflight_t;
+
+typedef struct {
+    ProcessingState state;
+    frame_decoder_t frame;
+    uint8_t sendbuf[SENDBUF_SIZE];
+    int sendbuf_end;
+    int sendptr;
+    // Zero-copy mode: the pooled buffer holding the pending output in place
+    // of sendbuf, or NULL, and whether any of it went out with MSG_ZEROCOPY.
+    uint8_t *outbuf;
+    bool outbuf_zerocopy;
+    bool zerocopy_off;
+    uint32_t zc_next_seq; // The kernel numbers zero-copy sends from 0.
+    int num_inflight;
+    zc_inflight_t inflight[ZC_MAX_INFLIGHT];
+    uint32_t capture_conn; // See capture.h; 0 when not capturing.
+} peer_state_t;
+
+extern peer_state_t global_state[MAXFDS];
+
+fd_status_t on_peer_connected(int sockfd, const struct sockaddr *peer_addr,
+                              socklen_t peer_addr_len);
+fd_status_t on_peer_ready_recv(int sockfd);
+fd_status_t on_peer_ready_send(int sockfd);
+fd_status_t on_peer_error(int sockfd);
+void on_peer_closed(int sockfd);
+void on_peer_migrated(int sockfd, int from_loop);
+
+// Hot restart: serializes a connection's state and pending output, and
+// rebuilds it in the new process.
+size_t save_peer_state(int sockfd, uint8_t *buf, size_t len);
+fd_status_t restore_peer_state(int sockfd, const uint8_t *buf, size_t len);
+
+// The handlers above, for reactor_config_t.
+extern const reactor_handlers_t protocol_handlers;
+
+// The protocol engine alone, for transports other than sockets (see
+// shmring.h). protocol_session_init readies peerstate for input once the
+// transport has delivered the '*' ack itself; protocol_process then runs the
+// state machine over n bytes of input and writes the reply to out, which
+// may be in, returning its length. Replies are never longer than their
+// input.
+void protocol_session_init(peer_state_t *peerstate);
+int protocol_process(peer_state_t *peerstate, const uint8_t *in, int n, uint8_t *out);
+
+#endif
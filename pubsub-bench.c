@@ -0,0 +1,375 @@
+// Fan-out benchmark for pubsub-server.
+//
+// usage: pubsub-bench [-n subscribers] [-m messages] [-s size] [-w window]
+//                     <host> <port>
+//
+// Opens n subscriber connections to one topic and a publisher, then publishes
+// m messages of size bytes, keeping at most window of them in flight: a
+// message is in flight until every subscriber has it. Reports messages and
+// deliveries per second and the fan-out latency, from publishing a message
+// to its first and to its last subscriber. -w 0 publishes without waiting,
+// to overrun slow subscribers and see the server's LAG_POLICY at work.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "framing.h"
+
+#define TOPIC "b"
+
+// Payload bytes of a delivery the parser keeps: the op, topic and sequence
+// number of an 'M' frame, or an 'L' frame.
+#define HEAD_SIZE 16
+
+// Sequence number of the warm-up messages.
+#define WARMUP_SEQ UINT64_MAX
+
+// The run ends once nothing has arrived for this long.
+#define IDLE_TIMEOUT_NS 2000000000ull
+
+typedef struct {
+    int fd;
+    bool seen_warmup;
+    bool closed;
+    // Parser state: header bytes so far, then payload bytes still to come.
+    uint8_t header[FRAME_HEADER_SIZE];
+    int header_len;
+    uint32_t left;
+    uint8_t head[HEAD_SIZE];
+    int head_len;
+} subscriber_t;
+
+typedef struct {
+    uint64_t published_ns;
+    uint64_t first_ns;
+    int count;
+} message_t;
+
+static struct addrinfo *server_addr;
+static subscriber_t *subs;
+static int num_subs = 1000;
+static int active_subs;
+static message_t *msgs;
+static long num_messages = 1000;
+static long completed;
+static uint64_t deliveries;
+static uint64_t lag_notices;
+static uint64_t missed;
+static uint64_t *last_latency;
+static uint64_t *first_latency;
+static int num_warm;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool send_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Connects, waits for the ack and opts into binary framing.
+static int connect_framed(void)
+{
+    int fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    char c;
+    uint8_t magic = FRAMING_BINARY_MAGIC;
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 ||
+        recv(fd, &c, 1, MSG_WAITALL) != 1 || c != '*' || !send_all(fd, &magic, 1)) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+static void message_done(long seq)
+{
+    if (msgs[seq].count >= active_subs && msgs[seq].count >= 0) {
+        last_latency[completed++] = now_ns() - msgs[seq].published_ns;
+        msgs[seq].count = -1; // Done.
+    }
+}
+
+static void frame_done(subscriber_t *s)
+{
+    if (s->head[0] == 'L') {
+        lag_notices++;
+        missed += s->head[1] | (uint32_t)s->head[2] << 8 | (uint32_t)s->head[3] << 16 |
+                  (uint32_t)s->head[4] << 24;
+        return;
+    }
+    // 'M', topic length, topic, then the sequence number, every byte of
+    // which the server incremented.
+    const uint8_t *p = &s->head[2 + s->head[1]];
+    uint64_t seq = 0;
+    for (int i = 0; i < 8; i++) {
+        seq |= (uint64_t)(uint8_t)(p[i] - 1) << (8 * i);
+    }
+    if (seq == WARMUP_SEQ) {
+        if (!s->seen_warmup) {
+            s->seen_warmup = true;
+            num_warm++;
+        }
+        return;
+    }
+    if (seq >= (uint64_t)num_messages || msgs[seq].count < 0) {
+        return;
+    }
+    deliveries++;
+    if (msgs[seq].count++ == 0) {
+        first_latency[seq] = now_ns() - msgs[seq].published_ns;
+    }
+    message_done(seq);
+}
+
+static void parse(subscriber_t *s, const uint8_t *buf, size_t n)
+{
+    while (n > 0) {
+        if (s->header_len < FRAME_HEADER_SIZE) {
+            s->header[s->header_len++] = *buf++;
+            n--;
+            if (s->header_len == FRAME_HEADER_SIZE) {
+                s->left = s->header[0] | (uint32_t)s->header[1] << 8 |
+                          (uint32_t)s->header[2] << 16 | (uint32_t)s->header[3] << 24;
+                s->head_len = 0;
+            }
+        } else {
+            size_t take = n < s->left ? n : s->left;
+            for (size_t i = 0; i < take && s->head_len < HEAD_SIZE; i++) {
+                s->head[s->head_len++] = buf[i];
+            }
+            buf += take;
+            n -= take;
+            s->left -= take;
+        }
+        if (s->header_len == FRAME_HEADER_SIZE && s->left == 0) {
+            frame_done(s);
+            s->header_len = 0;
+        }
+    }
+}
+
+// Reads whatever the subscribers have; returns whether anything came.
+static bool poll_subscribers(int epfd, int timeout_ms)
+{
+    static uint8_t buf[65536];
+    struct epoll_event events[256];
+    int n = epoll_wait(epfd, events, 256, timeout_ms);
+    if (n < 0 && errno != EINTR) {
+        perror("epoll_wait");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        subscriber_t *s = events[i].data.ptr;
+        ssize_t len = recv(s->fd, buf, sizeof(buf), 0);
+        if (len > 0) {
+            parse(s, buf, len);
+        } else if (len == 0 || (errno != EAGAIN && errno != EINTR)) {
+            // Dropped by the server.
+            epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+            close(s->fd);
+            s->closed = true;
+            active_subs--;
+            for (long seq = 0; seq < num_messages; seq++) {
+                if (msgs[seq].published_ns != 0) {
+                    message_done(seq);
+                }
+            }
+        }
+    }
+    return n > 0;
+}
+
+static void publish(int fd, uint64_t seq, int size)
+{
+    static uint8_t *frame;
+    uint32_t payload = 3 + size;
+    if (frame == NULL) {
+        frame = calloc(1, FRAME_HEADER_SIZE + payload);
+        if (frame == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+        for (int i = 8; i < size; i++) {
+            frame[FRAME_HEADER_SIZE + 3 + i] = 'a' + i % 25;
+        }
+    }
+    uint8_t *p = frame + FRAME_HEADER_SIZE;
+    frame_put_header(frame, payload);
+    p[0] = 'P';
+    p[1] = 1;
+    p[2] = TOPIC[0];
+    for (int i = 0; i < 8; i++) {
+        p[3 + i] = seq >> (8 * i);
+    }
+    if (!send_all(fd, frame, FRAME_HEADER_SIZE + payload)) {
+        perror("publish");
+        exit(1);
+    }
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_latency(const char *what, uint64_t *samples, long n)
+{
+    if (n == 0) {
+        return;
+    }
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    printf("  %s us: p50=%.1f p90=%.1f p99=%.1f max=%.1f\n", what, samples[n / 2] / 1000.0,
+           samples[n * 9 / 10] / 1000.0, samples[n * 99 / 100] / 1000.0, samples[n - 1] / 1000.0);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: pubsub-bench [-n subscribers] [-m messages] [-s size] [-w window]\n"
+                    "                    <host> <port>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int size = 64;
+    long window = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:s:w:")) != -1) {
+        switch (opt) {
+        case 'n':
+            num_subs = atoi(optarg);
+            break;
+        case 'm':
+            num_messages = atol(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'w':
+            window = atol(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 2 || num_subs < 1 || num_messages < 1 || size < 8 || window < 0) {
+        usage();
+    }
+    if (window == 0) {
+        window = num_messages;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int rc = getaddrinfo(argv[optind], argv[optind + 1], &hints, &server_addr);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        exit(1);
+    }
+
+    subs = calloc(num_subs, sizeof(*subs));
+    msgs = calloc(num_messages, sizeof(*msgs));
+    last_latency = calloc(num_messages, sizeof(*last_latency));
+    first_latency = calloc(num_messages, sizeof(*first_latency));
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (subs == NULL || msgs == NULL || last_latency == NULL || first_latency == NULL ||
+        epfd < 0) {
+        perror("setup");
+        exit(1);
+    }
+
+    uint8_t subscribe[FRAME_HEADER_SIZE + 1 + sizeof(TOPIC) - 1];
+    frame_put_header(subscribe, 1 + sizeof(TOPIC) - 1);
+    subscribe[FRAME_HEADER_SIZE] = 'S';
+    memcpy(&subscribe[FRAME_HEADER_SIZE + 1], TOPIC, sizeof(TOPIC) - 1);
+    for (int i = 0; i < num_subs; i++) {
+        subscriber_t *s = &subs[i];
+        s->fd = connect_framed();
+        if (!send_all(s->fd, subscribe, sizeof(subscribe))) {
+            perror("subscribe");
+            exit(1);
+        }
+        fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL, 0) | O_NONBLOCK);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = s};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+    active_subs = num_subs;
+    int pub = connect_framed();
+
+    // Subscriptions are processed asynchronously: publish warm-up messages
+    // until every subscriber has seen one.
+    for (int tries = 0; num_warm < num_subs; tries++) {
+        if (tries == 100) {
+            fprintf(stderr, "only %d of %d subscribers are getting messages\n", num_warm,
+                    num_subs);
+            exit(1);
+        }
+        publish(pub, WARMUP_SEQ, size);
+        uint64_t until = now_ns() + 100000000ull;
+        while (num_warm < num_subs && now_ns() < until) {
+            poll_subscribers(epfd, 10);
+        }
+    }
+    while (poll_subscribers(epfd, 100)) {
+        // Let stray warm-up messages drain.
+    }
+
+    uint64_t start = now_ns();
+    uint64_t last_progress = start;
+    long published = 0;
+    while (completed < num_messages && active_subs > 0) {
+        while (published < num_messages && published - completed < window) {
+            msgs[published].published_ns = now_ns();
+            publish(pub, published++, size);
+        }
+        if (poll_subscribers(epfd, 100)) {
+            last_progress = now_ns();
+        } else if (now_ns() - last_progress > IDLE_TIMEOUT_NS) {
+            break;
+        }
+    }
+    double elapsed = (last_progress - start) / 1e9;
+
+    printf("pubsub: %d subscribers, %ld messages of %d bytes, window %ld\n", num_subs,
+           num_messages, size, window);
+    printf("  completed %ld in %.2fs: %.0f msg/s, %.0f deliveries/s\n", completed, elapsed,
+           completed / elapsed, deliveries / elapsed);
+    print_latency("to first subscriber", first_latency, published);
+    print_latency("to last subscriber", last_latency, completed);
+    if (completed < num_messages || lag_notices > 0 || active_subs < num_subs) {
+        printf("  incomplete %ld, lag notices %lu (%lu missed), disconnected %d\n",
+               num_messages - completed, (unsigned long)lag_notices, (unsigned long)missed,
+               num_subs - active_subs);
+    }
+    return 0;
+}
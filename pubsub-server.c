@@ -0,0 +1,564 @@
+// Publish/subscribe server on the shared reactor.
+//
+// usage: pubsub-server [port] [num_event_loops]
+//
+// Clients speak the binary framing of framing.h: NUL after the '*' ack, then
+// length-prefixed frames, whose first payload byte is an operation:
+//   'S' topic                     subscribe to topic (1 to 255 bytes)
+//   'U' topic                     unsubscribe
+//   'P' topic_len:1 topic data    publish data to topic
+// Every subscriber of the topic, the publisher too if subscribed, then gets
+//   'M' topic_len:1 topic data'
+// where data' is data with every byte incremented, as in the echo protocol.
+//
+// A published message is transformed once, into a single immutable,
+// refcounted buffer holding the frame as it goes out, which is queued by
+// reference on each subscriber's output queue; sends gather several queued
+// buffers per sendmsg. Each event loop keeps the subscriptions of its own
+// connections; messages reach the other loops through their mailboxes (see
+// reactor_post).
+//
+// A subscriber whose queue is full is lagging. Environment:
+//   PUBSUB_QUEUE  messages a subscriber may have queued; default 256
+//   LAG_POLICY    skip (default): the subscriber misses messages until its
+//                 queue is down to half, and then gets an 'L' count:4 frame
+//                 saying how many; drop: it is disconnected
+//   PUBSUB_COPY   1 gives every subscriber its own copy of each message, as
+//                 per-connection send buffers would, for comparison
+//
+// epoll by default; POLLER and the other knobs in reactor.h apply.
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "framing.h"
+#include "logger.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "utils.h"
+
+#define MAXFDS 16384
+
+// Largest frame payload accepted from a client.
+#define MAX_FRAME 65536
+
+#define RECV_SIZE 65536
+
+// Queued buffers gathered per sendmsg.
+#define MAX_IOV 64
+
+#define TOPIC_BUCKETS 4096
+
+typedef struct {
+    _Atomic uint32_t refs;
+    uint32_t len;         // Of the frame in data.
+    const uint8_t *topic; // Within data.
+    uint8_t topic_len;
+    uint8_t *data;
+    // One per event loop, for posting the buffer to it; data follows.
+    mailbox_node_t nodes[];
+} shared_buf_t;
+
+typedef struct topic {
+    struct topic *next; // Hash chain.
+    int *subs;          // Subscribed fds.
+    int num_subs;
+    int cap_subs;
+    uint8_t len;
+    uint8_t name[255];
+} topic_t;
+
+typedef struct {
+    int fd;
+    bool ack_pending;
+    bool framed;  // Past the NUL that opts into framing.
+    bool dropped; // Lagged under LAG_POLICY=drop; closes when next handled.
+    bool lagging;
+    uint32_t skipped; // Messages missed while lagging.
+    // A frame split across reads.
+    uint8_t *partial;
+    size_t partial_len;
+    topic_t **topics;
+    int num_topics;
+    // Output: a ring of queued buffers, the first one sent up to head_sent.
+    size_t head_sent;
+    int queue_head;
+    int queue_count;
+    shared_buf_t *queue[];
+} conn_t;
+
+static conn_t *conns[MAXFDS];
+
+static int num_loops = 1;
+static int queue_cap = 256;
+static bool drop_laggers;
+static bool copy_mode;
+
+// Each loop's topics, holding only its own connections.
+static __thread topic_t **topics;
+
+// Read buffer: a partial frame left from the last read, then the new input.
+static __thread uint8_t *scratch;
+
+// The connection whose handler is running, which needn't be told about
+// output queued for it.
+static __thread int handling_fd = -1;
+
+static void *zalloc(size_t size)
+{
+    void *p = calloc(1, size);
+    if (p == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    return p;
+}
+
+static shared_buf_t *buf_alloc(uint32_t len, int nodes)
+{
+    shared_buf_t *buf = malloc(sizeof(*buf) + nodes * sizeof(mailbox_node_t) + len);
+    if (buf == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    atomic_init(&buf->refs, 1);
+    buf->len = len;
+    buf->data = (uint8_t *)&buf->nodes[nodes];
+    return buf;
+}
+
+static void buf_unref(shared_buf_t *buf)
+{
+    if (atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_release) == 1) {
+        atomic_thread_fence(memory_order_acquire);
+        free(buf);
+    }
+}
+
+static void release_queue(conn_t *c)
+{
+    for (; c->queue_count > 0; c->queue_count--) {
+        buf_unref(c->queue[c->queue_head]);
+        c->queue_head = (c->queue_head + 1) % queue_cap;
+    }
+    c->head_sent = 0;
+}
+
+static fd_status_t next_status(const conn_t *c, bool blocked)
+{
+    return (fd_status_t){.want_read = true,
+                         .want_write = c->ack_pending || c->queue_count > 0,
+                         .blocked = blocked};
+}
+
+// Queues buf on c, returning false if c is lagging and doesn't get it.
+static bool enqueue(conn_t *c, shared_buf_t *buf)
+{
+    if (c->dropped) {
+        return false;
+    }
+    if (c->lagging || c->queue_count == queue_cap) {
+        if (drop_laggers) {
+            c->dropped = true;
+            release_queue(c);
+            metrics_add(METRIC_SUBSCRIBERS_DROPPED, 1);
+            // Its send handler does the closing.
+            if (c->fd != handling_fd) {
+                reactor_update(c->fd, fd_status_W);
+            }
+        } else {
+            c->lagging = true;
+            c->skipped++;
+            metrics_add(METRIC_FANOUT_SKIPPED, 1);
+        }
+        return false;
+    }
+    c->queue[(c->queue_head + c->queue_count) % queue_cap] = buf;
+    if (c->queue_count++ == 0 && c->fd != handling_fd) {
+        reactor_update(c->fd, fd_status_RW);
+    }
+    return true;
+}
+
+static uint32_t topic_hash(const uint8_t *name, int len)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ name[i]) * 16777619u;
+    }
+    return h % TOPIC_BUCKETS;
+}
+
+static topic_t **topic_slot(const uint8_t *name, int len)
+{
+    if (topics == NULL) {
+        topics = zalloc(TOPIC_BUCKETS * sizeof(*topics));
+    }
+    topic_t **slot = &topics[topic_hash(name, len)];
+    while (*slot != NULL && ((*slot)->len != len || memcmp((*slot)->name, name, len) != 0)) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+// Queues buf for this loop's subscribers of its topic and drops the loop's
+// reference to it.
+static void fan_out(shared_buf_t *buf)
+{
+    topic_t *t = *topic_slot(buf->topic, buf->topic_len);
+    uint32_t queued = 0;
+    for (int i = 0; t != NULL && i < t->num_subs; i++) {
+        conn_t *c = conns[t->subs[i]];
+        if (!copy_mode) {
+            queued += enqueue(c, buf);
+            continue;
+        }
+        shared_buf_t *copy = buf_alloc(buf->len, 0);
+        memcpy(copy->data, buf->data, buf->len);
+        if (enqueue(c, copy)) {
+            metrics_add(METRIC_FANOUT_DELIVERIES, 1);
+        } else {
+            free(copy);
+        }
+    }
+    metrics_add(METRIC_FANOUT_DELIVERIES, queued);
+    // Each queue holds a reference; this loop's keeps buf alive until here.
+    if (queued > 0) {
+        atomic_fetch_add_explicit(&buf->refs, queued, memory_order_relaxed);
+    }
+    buf_unref(buf);
+}
+
+static void on_message(mailbox_node_t *node)
+{
+    int loop = reactor_current_loop();
+    fan_out((shared_buf_t *)((uint8_t *)(node - loop) - offsetof(shared_buf_t, nodes)));
+}
+
+static void publish(const uint8_t *topic, int topic_len, const uint8_t *data, uint32_t len)
+{
+    uint32_t payload = 2 + topic_len + len;
+    shared_buf_t *buf = buf_alloc(FRAME_HEADER_SIZE + payload, num_loops);
+    atomic_init(&buf->refs, num_loops);
+    frame_put_header(buf->data, payload);
+    uint8_t *p = buf->data + FRAME_HEADER_SIZE;
+    p[0] = 'M';
+    p[1] = topic_len;
+    memcpy(&p[2], topic, topic_len);
+    buf->topic = &p[2];
+    buf->topic_len = topic_len;
+    uint8_t *out = &p[2 + topic_len];
+    for (uint32_t i = 0; i < len; i++) {
+        out[i] = data[i] + 1;
+    }
+    metrics_add(METRIC_MESSAGES, 1);
+
+    int self = reactor_current_loop();
+    for (int i = 0; i < num_loops; i++) {
+        if (i != self) {
+            reactor_post(i, &buf->nodes[i]);
+        }
+    }
+    fan_out(buf);
+}
+
+static void subscribe(conn_t *c, const uint8_t *name, int len)
+{
+    topic_t **slot = topic_slot(name, len);
+    topic_t *t = *slot;
+    if (t == NULL) {
+        t = zalloc(sizeof(*t));
+        t->len = len;
+        memcpy(t->name, name, len);
+        *slot = t;
+    }
+    for (int i = 0; i < c->num_topics; i++) {
+        if (c->topics[i] == t) {
+            return;
+        }
+    }
+    if (t->num_subs == t->cap_subs) {
+        t->cap_subs = t->cap_subs ? t->cap_subs * 2 : 16;
+        t->subs = realloc(t->subs, t->cap_subs * sizeof(*t->subs));
+    }
+    c->topics = realloc(c->topics, (c->num_topics + 1) * sizeof(*c->topics));
+    if (t->subs == NULL || c->topics == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    t->subs[t->num_subs++] = c->fd;
+    c->topics[c->num_topics++] = t;
+}
+
+static void unsubscribe(conn_t *c, const uint8_t *name, int len)
+{
+    topic_t **slot = topic_slot(name, len);
+    topic_t *t = *slot;
+    int i = 0;
+    while (i < c->num_topics && c->topics[i] != t) {
+        i++;
+    }
+    if (t == NULL || i == c->num_topics) {
+        return;
+    }
+    c->topics[i] = c->topics[--c->num_topics];
+
+    for (int j = 0; j < t->num_subs; j++) {
+        if (t->subs[j] == c->fd) {
+            t->subs[j] = t->subs[--t->num_subs];
+            break;
+        }
+    }
+    if (t->num_subs == 0) {
+        *slot = t->next;
+        free(t->subs);
+        free(t);
+    }
+}
+
+// Acts on one frame's payload; false if it's malformed.
+static bool handle_frame(conn_t *c, const uint8_t *p, uint32_t len)
+{
+    if (len == 0) {
+        return true;
+    }
+    switch (p[0]) {
+    case 'S':
+    case 'U':
+        if (len < 2 || len > 256) {
+            return false;
+        }
+        if (p[0] == 'S') {
+            subscribe(c, &p[1], len - 1);
+        } else {
+            unsubscribe(c, &p[1], len - 1);
+        }
+        return true;
+    case 'P':
+        if (len < 3 || p[1] == 0 || len < 2u + p[1]) {
+            return false;
+        }
+        publish(&p[2], p[1], &p[2 + p[1]], len - 2 - p[1]);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static fd_status_t on_peer_connected(int sockfd, const struct sockaddr *peer_addr,
+                                     socklen_t peer_addr_len)
+{
+    assert(sockfd < MAXFDS);
+    report_peer_connected(sockfd, peer_addr, peer_addr_len);
+
+    conn_t *c = zalloc(sizeof(*c) + queue_cap * sizeof(c->queue[0]));
+    c->fd = sockfd;
+    c->ack_pending = true;
+    conns[sockfd] = c;
+    return fd_status_W;
+}
+
+static fd_status_t on_peer_ready_recv(int sockfd)
+{
+    conn_t *c = conns[sockfd];
+    if (c->ack_pending) {
+        return fd_status_W;
+    }
+    if (c->dropped) {
+        return fd_status_NORW;
+    }
+    if (scratch == NULL) {
+        scratch = zalloc(FRAME_HEADER_SIZE + MAX_FRAME + RECV_SIZE);
+    }
+
+    if (c->partial_len > 0) {
+        memcpy(scratch, c->partial, c->partial_len);
+    }
+    int nbytes = recv(sockfd, scratch + c->partial_len, RECV_SIZE, 0);
+    if (nbytes == 0) {
+        return fd_status_NORW;
+    } else if (nbytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return next_status(c, true);
+        } else if (errno == ECONNRESET) {
+            return fd_status_NORW;
+        }
+        perror("perror recv");
+        exit(1);
+    }
+    metrics_add(METRIC_BYTES_RECEIVED, nbytes);
+
+    size_t end = c->partial_len + nbytes;
+    size_t pos = 0;
+    if (!c->framed) {
+        if (scratch[0] != FRAMING_BINARY_MAGIC) {
+            return fd_status_NORW;
+        }
+        c->framed = true;
+        pos = 1;
+    }
+    handling_fd = sockfd;
+    bool ok = true;
+    while (ok && end - pos >= FRAME_HEADER_SIZE) {
+        const uint8_t *h = &scratch[pos];
+        uint32_t len = h[0] | (uint32_t)h[1] << 8 | (uint32_t)h[2] << 16 | (uint32_t)h[3] << 24;
+        if (len > MAX_FRAME) {
+            ok = false;
+        } else if (end - pos < FRAME_HEADER_SIZE + len) {
+            break;
+        } else {
+            ok = handle_frame(c, h + FRAME_HEADER_SIZE, len);
+            pos += FRAME_HEADER_SIZE + len;
+        }
+    }
+    handling_fd = -1;
+    if (!ok || c->dropped) {
+        return fd_status_NORW;
+    }
+
+    // Keep the rest for the next read; it never grows beyond one frame.
+    c->partial_len = end - pos;
+    if (c->partial_len > 0) {
+        c->partial = realloc(c->partial, c->partial_len);
+        if (c->partial == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+        memcpy(c->partial, &scratch[pos], c->partial_len);
+    }
+    return next_status(c, false);
+}
+
+static fd_status_t on_peer_ready_send(int sockfd)
+{
+    conn_t *c = conns[sockfd];
+    if (c->dropped) {
+        return fd_status_NORW;
+    }
+
+    struct iovec iov[MAX_IOV];
+    int n = 0;
+    if (c->ack_pending) {
+        iov[n++] = (struct iovec){.iov_base = "*", .iov_len = 1};
+    }
+    for (int i = 0; i < c->queue_count && n < MAX_IOV; i++) {
+        shared_buf_t *buf = c->queue[(c->queue_head + i) % queue_cap];
+        size_t skip = i == 0 ? c->head_sent : 0;
+        iov[n++] = (struct iovec){.iov_base = buf->data + skip, .iov_len = buf->len - skip};
+    }
+    if (n == 0) {
+        return next_status(c, false);
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+    ssize_t nsent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+    if (nsent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return next_status(c, true);
+        } else if (errno == ECONNRESET || errno == EPIPE) {
+            return fd_status_NORW;
+        }
+        perror("perror sendmsg");
+        exit(1);
+    }
+    metrics_add(METRIC_BYTES_SENT, nsent);
+
+    if (c->ack_pending && nsent > 0) {
+        c->ack_pending = false;
+        nsent--;
+    }
+    while (nsent > 0) {
+        shared_buf_t *buf = c->queue[c->queue_head];
+        size_t left = buf->len - c->head_sent;
+        if ((size_t)nsent < left) {
+            c->head_sent += nsent;
+            break;
+        }
+        nsent -= left;
+        buf_unref(buf);
+        c->head_sent = 0;
+        c->queue_head = (c->queue_head + 1) % queue_cap;
+        c->queue_count--;
+    }
+
+    if (c->lagging && c->queue_count <= queue_cap / 2) {
+        // Caught up: say how much was missed.
+        c->lagging = false;
+        shared_buf_t *notice = buf_alloc(FRAME_HEADER_SIZE + 5, 0);
+        frame_put_header(notice->data, 5);
+        notice->data[FRAME_HEADER_SIZE] = 'L';
+        frame_put_header(&notice->data[FRAME_HEADER_SIZE + 1], c->skipped);
+        c->skipped = 0;
+        enqueue(c, notice);
+    }
+    return next_status(c, false);
+}
+
+static void on_peer_closed(int sockfd)
+{
+    conn_t *c = conns[sockfd];
+    while (c->num_topics > 0) {
+        unsubscribe(c, c->topics[0]->name, c->topics[0]->len);
+    }
+    release_queue(c);
+    free(c->topics);
+    free(c->partial);
+    free(c);
+    conns[sockfd] = NULL;
+}
+
+int main(int argc, const char **argv)
+{
+    logger_init(LOG_LEVEL_INFO);
+
+    int portnum = 9090;
+    if (argc >= 2) {
+        portnum = atoi(argv[1]);
+    }
+    if (argc >= 3) {
+        num_loops = atoi(argv[2]);
+        if (num_loops < 1) {
+            num_loops = 1;
+        }
+    }
+    if (getenv("PUBSUB_QUEUE") != NULL) {
+        queue_cap = atoi(getenv("PUBSUB_QUEUE"));
+        if (queue_cap < 2) {
+            queue_cap = 2;
+        }
+    }
+    const char *policy = getenv("LAG_POLICY");
+    if (policy != NULL && strcmp(policy, "drop") == 0) {
+        drop_laggers = true;
+    } else if (policy != NULL && strcmp(policy, "skip") != 0) {
+        fprintf(stderr, "unknown LAG_POLICY '%s'\n", policy);
+        exit(1);
+    }
+    copy_mode = getenv("PUBSUB_COPY") != NULL && atoi(getenv("PUBSUB_COPY")) != 0;
+
+    reactor_config_t config;
+    reactor_config_init(&config, "epoll");
+    config.handlers = (reactor_handlers_t){
+        .on_peer_connected = on_peer_connected,
+        .on_peer_ready_recv = on_peer_ready_recv,
+        .on_peer_ready_send = on_peer_ready_send,
+        .on_peer_closed = on_peer_closed,
+        .on_message = on_message,
+    };
+    config.maxfds = MAXFDS;
+    log_info("listening on port %d, backlog %d", portnum, listen_backlog());
+    config.listen_fd = listen_inet_socket(portnum);
+    make_socket_non_blocking(config.listen_fd);
+
+    reactor_run(&config, num_loops);
+    return 0;
+}
@@ -0,0 +1,280 @@
+// Compile-time specialized event loop: reactor.h without the indirection.
+//
+// Each inclusion of this header, with the parameters below defined,
+// instantiates NAME_run(listen_fd, unix_fd, num_threads), an epoll event
+// loop whose trigger mode and handlers are fixed at compile time. Every event
+// becomes a direct call where reactor.c goes through poller_ops_t and
+// reactor_handlers_t pointers, and the handlers can be inlined into the loop
+// when the compiler sees their bodies (same translation unit, or -flto).
+// The parameters are #undef'd again at the end, so a file can instantiate
+// several combinations and pick one at startup.
+//
+//   REACTOR_STATIC_NAME       prefix of the generated functions
+//   REACTOR_STATIC_EDGE       1 for edge-triggered epoll, 0 for level
+//   REACTOR_STATIC_MAXFDS     peers with fds at or above this are refused
+//   REACTOR_STATIC_CONNECTED  handlers, as in reactor_handlers_t
+//   REACTOR_STATIC_RECV
+//   REACTOR_STATIC_SEND
+//   REACTOR_STATIC_ERROR      optional
+//   REACTOR_STATIC_CLOSED     optional
+//
+// Only the core is specialized: accepting, readiness dispatch and interest
+// updates, with num_threads loops sharing the listener and, unless it's -1,
+// the Unix socket listener unix_fd. Hot restart, the stats endpoint,
+// mailboxes, busy polling and FAIR_BUDGET deferral are left to reactor.c; an
+// edge-triggered loop here drives a connection until it runs dry.
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "reactor.h"
+#include "utils.h"
+
+#if !defined(REACTOR_STATIC_NAME) || !defined(REACTOR_STATIC_EDGE) ||                        \
+    !defined(REACTOR_STATIC_MAXFDS) || !defined(REACTOR_STATIC_CONNECTED) ||                  \
+    !defined(REACTOR_STATIC_RECV) || !defined(REACTOR_STATIC_SEND)
+#error "reactor-static.h: missing parameters"
+#endif
+
+#ifndef REACTOR_STATIC_COMMON
+#define REACTOR_STATIC_COMMON
+
+#define REACTOR_STATIC_CAT_(a, b) a##_##b
+#define REACTOR_STATIC_CAT(a, b) REACTOR_STATIC_CAT_(a, b)
+
+// Events handled per wait call and connections accepted per listener
+// wakeup, as in reactor.c.
+#define REACTOR_STATIC_MAX_EVENTS 1024
+#define REACTOR_STATIC_ACCEPT_BUDGET 64
+
+typedef struct {
+    fd_status_t status;
+    bool readable; // Edge-triggered: input or output space possibly left.
+    bool writable;
+} reactor_static_fd_t;
+
+static inline uint32_t reactor_static_events(fd_status_t status)
+{
+    return (status.want_read ? EPOLLIN : 0) | (status.want_write ? EPOLLOUT : 0);
+}
+
+#endif
+
+#define RS_FN(name) REACTOR_STATIC_CAT(REACTOR_STATIC_NAME, name)
+
+typedef struct {
+    int listen_fd;
+    int unix_fd;
+    int epollfd;
+} RS_FN(loop_t);
+
+static reactor_static_fd_t RS_FN(fds)[REACTOR_STATIC_MAXFDS];
+
+static inline void RS_FN(close_peer)(int epollfd, int fd)
+{
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+#ifdef REACTOR_STATIC_CLOSED
+    REACTOR_STATIC_CLOSED(fd);
+#endif
+    close(fd);
+    RS_FN(fds)[fd].status = fd_status_NORW;
+}
+
+static inline void RS_FN(apply_status)(int epollfd, int fd, fd_status_t status)
+{
+    reactor_static_fd_t *f = &RS_FN(fds)[fd];
+    if (!status.want_read && !status.want_write) {
+        RS_FN(close_peer)(epollfd, fd);
+        return;
+    }
+#if !REACTOR_STATIC_EDGE
+    if (status.want_read != f->status.want_read || status.want_write != f->status.want_write) {
+        struct epoll_event ev = {.events = reactor_static_events(status), .data.fd = fd};
+        if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+            perror("epoll_ctl EPOLL_CTL_MOD");
+            exit(1);
+        }
+    }
+#endif
+    f->status = status;
+}
+
+static inline void RS_FN(service_peer)(int epollfd, const struct epoll_event *ev)
+{
+    int fd = ev->data.fd;
+    reactor_static_fd_t *f = &RS_FN(fds)[fd];
+    fd_status_t status = f->status;
+
+    if (ev->events & (EPOLLERR | EPOLLHUP)) {
+#ifdef REACTOR_STATIC_ERROR
+        RS_FN(apply_status)(epollfd, fd, REACTOR_STATIC_ERROR(fd));
+        if (!f->status.want_read && !f->status.want_write) {
+            return;
+        }
+        status = f->status;
+#else
+        RS_FN(close_peer)(epollfd, fd);
+        return;
+#endif
+    }
+
+#if REACTOR_STATIC_EDGE
+    f->readable |= (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) != 0;
+    f->writable |= (ev->events & EPOLLOUT) != 0;
+    while (1) {
+        if (status.want_write && f->writable) {
+            status = REACTOR_STATIC_SEND(fd);
+            if (status.blocked) {
+                f->writable = false;
+            }
+        } else if (status.want_read && f->readable) {
+            status = REACTOR_STATIC_RECV(fd);
+            if (status.blocked) {
+                f->readable = false;
+            }
+        } else {
+            break;
+        }
+    }
+#else
+    if ((ev->events & (EPOLLIN | EPOLLHUP)) && status.want_read) {
+        status = REACTOR_STATIC_RECV(fd);
+    } else if ((ev->events & EPOLLOUT) && status.want_write) {
+        status = REACTOR_STATIC_SEND(fd);
+    } else {
+        return;
+    }
+#endif
+    RS_FN(apply_status)(epollfd, fd, status);
+}
+
+static inline void RS_FN(accept_pending)(RS_FN(loop_t) *loop, int listen_fd)
+{
+    for (int n = 0; n < REACTOR_STATIC_ACCEPT_BUDGET; n++) {
+        struct sockaddr_storage peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+        int newfd = accept_nonblocking(listen_fd, (struct sockaddr *)&peer_addr,
+                                       &peer_addr_len);
+        if (newfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+                return;
+            }
+            if (errno == EMFILE || errno == ENFILE) {
+                if (accept_drop_pending(listen_fd)) {
+                    continue;
+                }
+                return;
+            }
+            perror("ERROR on accept");
+            exit(1);
+        }
+        if (newfd >= REACTOR_STATIC_MAXFDS) {
+            close(newfd);
+            continue;
+        }
+
+        tune_accepted_socket(newfd);
+        fd_status_t status = REACTOR_STATIC_CONNECTED(newfd, (struct sockaddr *)&peer_addr,
+                                                      peer_addr_len);
+        if (!status.want_read && !status.want_write) {
+#ifdef REACTOR_STATIC_CLOSED
+            REACTOR_STATIC_CLOSED(newfd);
+#endif
+            close(newfd);
+            continue;
+        }
+#if REACTOR_STATIC_EDGE
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+                                 .data.fd = newfd};
+#else
+        struct epoll_event ev = {.events = reactor_static_events(status), .data.fd = newfd};
+#endif
+        if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, newfd, &ev) < 0) {
+            perror("epoll_ctl EPOLL_CTL_ADD");
+            exit(1);
+        }
+        RS_FN(fds)[newfd] = (reactor_static_fd_t){.status = status};
+    }
+}
+
+static void *RS_FN(loop)(void *arg)
+{
+    RS_FN(loop_t) *loop = arg;
+    accept_reserve_init();
+    loop->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epollfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    // One loop per new connection when several share a listener.
+    int listeners[2] = {loop->listen_fd, loop->unix_fd};
+    for (int i = 0; i < 2 && listeners[i] >= 0; i++) {
+        struct epoll_event accept_event = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                                           .data.fd = listeners[i]};
+        if (epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, listeners[i], &accept_event) < 0) {
+            perror("epoll_ctl EPOLL_CTL_ADD");
+            exit(1);
+        }
+    }
+
+    struct epoll_event events[REACTOR_STATIC_MAX_EVENTS];
+    while (1) {
+        int nready = epoll_wait(loop->epollfd, events, REACTOR_STATIC_MAX_EVENTS, -1);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int i = 0; i < nready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == loop->listen_fd || fd == loop->unix_fd) {
+                RS_FN(accept_pending)(loop, fd);
+            } else {
+                RS_FN(service_peer)(loop->epollfd, &events[i]);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Runs num_threads loops on listen_fd and unix_fd (or -1), the calling thread
+// becoming one of them. Never returns.
+static void RS_FN(run)(int listen_fd, int unix_fd, int num_threads)
+{
+    RS_FN(loop_t) *loops = calloc(num_threads, sizeof(*loops));
+    if (loops == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        loops[i].listen_fd = listen_fd;
+        loops[i].unix_fd = unix_fd;
+    }
+    for (int i = 1; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, RS_FN(loop), &loops[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    RS_FN(loop)(&loops[0]);
+}
+
+#undef RS_FN
+#undef REACTOR_STATIC_NAME
+#undef REACTOR_STATIC_EDGE
+#undef REACTOR_STATIC_MAXFDS
+#undef REACTOR_STATIC_CONNECTED
+#undef REACTOR_STATIC_RECV
+#undef REACTOR_STATIC_SEND
+#undef REACTOR_STATIC_ERROR
+#undef REACTOR_STATIC_CLOSED
@@ -0,0 +1,1078 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handoff.h"
+#include "ktls.h"
+#include "logger.h"
+#include "metrics.h"
+#include "probes.h"
+#include "utils.h"
+
+// Upper bound on connections accepted per listener readiness event, so that a
+// connection storm can't starve peers that are already being served.
+#define ACCEPT_BUDGET 64
+
+// Events handled per wait call.
+#define MAX_EVENTS 1024
+
+// Messages handled per mailbox wakeup before the loop gets back to its fds.
+#define MAILBOX_BATCH 256
+
+// Largest per-connection state save_peer may produce: all a handoff entry
+// can carry.
+#define PEER_STATE_MAX (HANDOFF_MAX_MSG - 4)
+
+// How long a hot restart waits for the new process to confirm it has
+// everything before giving up and resuming service.
+#define HANDOFF_ACK_TIMEOUT_SEC 5
+
+// Rebalancing: a loop gives connections away when it spends at least
+// REBALANCE_MIN_LOAD per mille of its time handling events, and that is
+// REBALANCE_MIN_GAP more than the idlest loop; at most REBALANCE_MAX_MOVES
+// per interval.
+#define REBALANCE_MIN_LOAD 600
+#define REBALANCE_MIN_GAP 200
+#define REBALANCE_MAX_MOVES 64
+
+// Kinds of handoff entries.
+enum { HANDOFF_LISTENER, HANDOFF_STATS, HANDOFF_PEER, HANDOFF_UNIX_LISTENER };
+
+typedef struct {
+    fd_status_t status;
+    // Edge-triggered backends only: whether the socket may have input or
+    // output space left since the last edge.
+    bool readable;
+    bool writable;
+    // On the deferred list: out of budget with work left over. The links are
+    // fds, -1 at the ends.
+    bool deferred;
+    int prev_deferred;
+    int next_deferred;
+    // Times it was serviced this rebalancing interval.
+    uint32_t serviced;
+    // TLS handshake under way; the handlers don't know the connection yet.
+    ktls_handshake_t *tls;
+} reactor_fd_t;
+
+typedef struct {
+    const reactor_config_t *config;
+    int index;
+    const poller_ops_t *ops;
+    poller_t *poller;
+    reactor_fd_t *fds;
+    poller_event_t *events;
+    int listen_fd;
+    int unix_fd;
+    int listen_flags;
+    int stats_fd;
+    mailbox_t mailbox;
+    int deferred_head; // Oldest deferred connection, or -1.
+    int deferred_tail;
+    int num_deferred;
+    // Rebalancing: connections other loops hand to this one, and this
+    // interval's tally.
+    mailbox_t migrations;
+    uint64_t interval_start_ns;
+    uint64_t busy_ns;
+    uint64_t serviced;
+    // Published for the other loops at the end of each interval: the share
+    // of it spent busy, per mille, and when that was.
+    _Atomic uint32_t load;
+    _Atomic uint64_t load_at_ns;
+} reactor_t;
+
+// A connection on its way to another loop.
+typedef struct {
+    mailbox_node_t node;
+    int fd;
+    int from;
+    fd_status_t status;
+    bool readable;
+    bool writable;
+} migrant_t;
+
+// All loops of this process. During a hot restart the loop that accepted the
+// new process parks the others, ships every loop's connections and then
+// either exits or, if the handoff fails, releases them again.
+static struct {
+    reactor_t *loops;
+    int num_loops;
+    int wake_fd; // eventfd watched by the other loops; written to park them.
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int parked;
+    unsigned round; // Bumped when a failed handoff releases the loops.
+    bool rebalance;
+} group = {
+    .wake_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void adopt(reactor_config_t *config, int fd, const uint8_t *state, size_t len)
+{
+    if (config->num_adopted % 256 == 0) {
+        config->adopted = realloc(config->adopted,
+                                  (config->num_adopted + 256) * sizeof(*config->adopted));
+        if (config->adopted == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+    }
+    reactor_adopted_peer_t *peer = &config->adopted[config->num_adopted++];
+    peer->fd = fd;
+    peer->state_len = len;
+    peer->state = malloc(len > 0 ? len : 1);
+    if (peer->state == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    memcpy(peer->state, state, len);
+}
+
+// Receives the listeners and connections of the server handing off at path,
+// if one is running there, and acks so that it exits.
+static void take_over(reactor_config_t *config, const char *path)
+{
+    int sock = handoff_connect(path);
+    if (sock < 0) {
+        return;
+    }
+    handoff_reader_t *reader = malloc(sizeof(*reader));
+    if (reader == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    handoff_reader_init(reader, sock);
+
+    int rc;
+    uint8_t kind;
+    int fd;
+    const uint8_t *state;
+    size_t len;
+    while ((rc = handoff_next(reader, &kind, &fd, &state, &len)) > 0) {
+        if (kind == HANDOFF_LISTENER) {
+            config->listen_fd = fd;
+        } else if (kind == HANDOFF_UNIX_LISTENER) {
+            config->unix_fd = fd;
+        } else if (kind == HANDOFF_STATS) {
+            config->stats_fd = fd;
+        } else if (kind == HANDOFF_PEER) {
+            adopt(config, fd, state, len);
+        } else {
+            close(fd);
+        }
+    }
+    if (rc < 0) {
+        // Without our ack the old process resumes serving.
+        fprintf(stderr, "hot restart from %s failed\n", path);
+        exit(1);
+    }
+
+    uint8_t ack = 1;
+    if (send(sock, &ack, 1, MSG_NOSIGNAL) != 1) {
+        perror("handoff ack");
+        exit(1);
+    }
+    close(sock);
+    free(reader);
+    log_info("took over %d connection(s) from %s", config->num_adopted, path);
+}
+
+void reactor_config_init(reactor_config_t *config, const char *default_poller)
+{
+    memset(config, 0, sizeof(*config));
+    config->listen_fd = -1;
+    config->unix_fd = -1;
+    config->stats_fd = -1;
+    config->poll_mode = POLL_MODE_BLOCK;
+    config->max_spin_us = 50;
+    config->fair_budget = 16;
+    config->handoff_fd = -1;
+
+    const char *name = getenv("POLLER");
+    if (name == NULL) {
+        name = default_poller;
+    }
+    config->poller = poller_by_name(name);
+    if (config->poller == NULL) {
+        fprintf(stderr, "unknown POLLER '%s'\n", name);
+        exit(1);
+    }
+
+    // POLL_MODE=spin|adaptive makes each loop spin on a zero-timeout wait for
+    // up to MAX_SPIN_US before sleeping in the kernel.
+    const char *poll_mode = getenv("POLL_MODE");
+    if (poll_mode != NULL) {
+        int mode = poll_mode_parse(poll_mode);
+        if (mode < 0) {
+            fprintf(stderr, "unknown POLL_MODE '%s'\n", poll_mode);
+            exit(1);
+        }
+        config->poll_mode = mode;
+    }
+    if (getenv("MAX_SPIN_US") != NULL) {
+        config->max_spin_us = atoi(getenv("MAX_SPIN_US"));
+    }
+    if (getenv("FAIR_BUDGET") != NULL) {
+        config->fair_budget = atoi(getenv("FAIR_BUDGET"));
+    }
+    if (getenv("REBALANCE_MS") != NULL) {
+        config->rebalance_ms = atoi(getenv("REBALANCE_MS"));
+    }
+
+    const char *handoff_path = getenv("HANDOFF_PATH");
+    if (handoff_path != NULL) {
+        take_over(config, handoff_path);
+        config->handoff_fd = handoff_listen(handoff_path);
+    }
+
+    const char *stats_port = getenv("STATS_PORT");
+    if (stats_port != NULL) {
+        metrics_enable();
+        if (config->stats_fd < 0) {
+            config->stats_fd = metrics_listen(atoi(stats_port));
+        }
+        log_info("serving stats on port %d", atoi(stats_port));
+    } else if (config->stats_fd >= 0) {
+        close(config->stats_fd);
+        config->stats_fd = -1;
+    }
+
+    const char *tls_cert = getenv("TLS_CERT");
+    if (tls_cert != NULL) {
+        const char *tls_key = getenv("TLS_KEY");
+        if (tls_key == NULL) {
+            fprintf(stderr, "TLS_CERT needs TLS_KEY\n");
+            exit(1);
+        }
+        if (getenv("ZEROCOPY_MIN_BYTES") != NULL) {
+            fprintf(stderr, "kernel TLS sockets don't support MSG_ZEROCOPY; unset ZEROCOPY_MIN_BYTES\n");
+            exit(1);
+        }
+        ktls_server_init(tls_cert, tls_key);
+        if (!ktls_kernel_supported()) {
+            log_warn("this kernel doesn't take TLS keys (%s), handshakes will fail", ktls_error());
+        }
+        config->tls = true;
+        log_info("TLS with certificate %s", tls_cert);
+    }
+
+    const char *unix_path = getenv("UNIX_SOCKET");
+    if (unix_path != NULL) {
+        if (config->unix_fd < 0) {
+            config->unix_fd = listen_unix_socket(unix_path);
+            make_socket_non_blocking(config->unix_fd);
+        }
+        log_info("listening on Unix socket %s", unix_path);
+    } else if (config->unix_fd >= 0) {
+        close(config->unix_fd);
+        config->unix_fd = -1;
+    }
+}
+
+static bool is_live(const reactor_fd_t *f)
+{
+    return f->status.want_read || f->status.want_write;
+}
+
+// Closes a connection the handlers have seen, letting them release its state.
+static void release_peer(reactor_t *r, int fd)
+{
+    if (r->config->handlers.on_peer_closed != NULL) {
+        r->config->handlers.on_peer_closed(fd);
+    }
+    close(fd);
+}
+
+// Puts fd at the back of the deferred list.
+static void defer_peer(reactor_t *r, int fd)
+{
+    reactor_fd_t *f = &r->fds[fd];
+    f->deferred = true;
+    f->prev_deferred = r->deferred_tail;
+    f->next_deferred = -1;
+    if (r->deferred_tail >= 0) {
+        r->fds[r->deferred_tail].next_deferred = fd;
+    } else {
+        r->deferred_head = fd;
+    }
+    r->deferred_tail = fd;
+    r->num_deferred++;
+}
+
+static void undefer_peer(reactor_t *r, int fd)
+{
+    reactor_fd_t *f = &r->fds[fd];
+    if (f->prev_deferred >= 0) {
+        r->fds[f->prev_deferred].next_deferred = f->next_deferred;
+    } else {
+        r->deferred_head = f->next_deferred;
+    }
+    if (f->next_deferred >= 0) {
+        r->fds[f->next_deferred].prev_deferred = f->prev_deferred;
+    } else {
+        r->deferred_tail = f->prev_deferred;
+    }
+    f->deferred = false;
+    r->num_deferred--;
+}
+
+static void close_peer(reactor_t *r, int fd)
+{
+    log_info("socket %d closing", fd);
+    if (r->fds[fd].deferred) {
+        undefer_peer(r, fd);
+    }
+    r->ops->remove(r->poller, fd);
+    release_peer(r, fd);
+    r->fds[fd].status = fd_status_NORW;
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+}
+
+// Records the handlers' verdict for fd: closes it, or updates the poller's
+// interest if it changed.
+static void apply_status(reactor_t *r, int fd, fd_status_t status)
+{
+    reactor_fd_t *f = &r->fds[fd];
+    if (!status.want_read && !status.want_write) {
+        close_peer(r, fd);
+        return;
+    }
+    if (status.want_read != f->status.want_read || status.want_write != f->status.want_write) {
+        r->ops->modify(r->poller, fd, status.want_read, status.want_write);
+    }
+    f->status = status;
+}
+
+static fd_status_t call_recv(reactor_t *r, int fd)
+{
+    uint64_t start_ns = metrics_now_ns();
+    fd_status_t status = r->config->handlers.on_peer_ready_recv(fd);
+    if (start_ns != 0) {
+        metrics_observe(HIST_MESSAGE_PROCESSING_NS, metrics_now_ns() - start_ns);
+    }
+    return status;
+}
+
+// Edge-triggered: keeps calling the handlers until they run out of work or
+// hit EAGAIN, since there won't be another notification until then, or until
+// the connection's budget for this iteration is spent.
+static void drive_peer(reactor_t *r, int fd)
+{
+    reactor_fd_t *f = &r->fds[fd];
+    fd_status_t status = f->status;
+    int budget = r->config->fair_budget;
+
+    for (int calls = 0;; calls++) {
+        bool can_write = status.want_write && f->writable;
+        bool can_read = status.want_read && f->readable;
+        if (!can_write && !can_read) {
+            break;
+        }
+        if (budget > 0 && calls == budget) {
+            // The rest waits its turn.
+            apply_status(r, fd, status);
+            if (!f->deferred) {
+                defer_peer(r, fd);
+            }
+            metrics_add(METRIC_LOOP_DEFERRALS, 1);
+            return;
+        }
+        if (can_write) {
+            status = r->config->handlers.on_peer_ready_send(fd);
+            if (status.blocked) {
+                f->writable = false;
+            }
+        } else {
+            status = call_recv(r, fd);
+            if (status.blocked) {
+                f->readable = false;
+            }
+        }
+    }
+    apply_status(r, fd, status);
+}
+
+// Gives every connection deferred so far one more budget, in order; those
+// that use it up again go to the back.
+static void run_deferred(reactor_t *r)
+{
+    for (int n = r->num_deferred; n > 0 && r->deferred_head >= 0; n--) {
+        int fd = r->deferred_head;
+        undefer_peer(r, fd);
+        r->fds[fd].serviced++;
+        r->serviced++;
+        drive_peer(r, fd);
+    }
+}
+
+// Runs the handshake of TLS connection fd as far as the socket allows. Once
+// the kernel has the keys, the handlers get the connection.
+static void continue_handshake(reactor_t *r, int fd)
+{
+    reactor_fd_t *f = &r->fds[fd];
+    ktls_status_t result = ktls_handshake_step(f->tls);
+    if (result == KTLS_WANT_READ || result == KTLS_WANT_WRITE) {
+        bool want_read = result == KTLS_WANT_READ;
+        if (want_read != f->status.want_read) {
+            r->ops->modify(r->poller, fd, want_read, !want_read);
+        }
+        f->status = want_read ? fd_status_R : fd_status_W;
+        return;
+    }
+
+    ktls_handshake_free(f->tls);
+    f->tls = NULL;
+    if (result == KTLS_FAILED) {
+        log_info("socket %d TLS handshake failed: %s", fd, ktls_error());
+        r->ops->remove(r->poller, fd);
+        close(fd);
+        f->status = fd_status_NORW;
+        metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+        return;
+    }
+
+    struct sockaddr_storage peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    if (getpeername(fd, (struct sockaddr*)&peer_addr, &peer_addr_len) < 0) {
+        memset(&peer_addr, 0, sizeof(peer_addr));
+        peer_addr_len = 0;
+    }
+    apply_status(r, fd, r->config->handlers.on_peer_connected(
+                            fd, (struct sockaddr*)&peer_addr, peer_addr_len));
+    // Edge-triggered backends won't report again what the socket may already
+    // have, such as the client's first request.
+    if (r->ops->edge_triggered && is_live(f)) {
+        f->readable = f->writable = true;
+        drive_peer(r, fd);
+    }
+}
+
+static void service_peer(reactor_t *r, const poller_event_t *ev)
+{
+    int fd = ev->fd;
+    reactor_fd_t *f = &r->fds[fd];
+    fd_status_t status = f->status;
+    f->serviced++;
+    r->serviced++;
+
+    if (f->tls != NULL) {
+        // Errors show up as the handshake failing.
+        continue_handshake(r, fd);
+        return;
+    }
+
+    if (ev->error) {
+        if (r->config->handlers.on_peer_error == NULL) {
+            // Most likely the peer reset the connection; drop just this one.
+            log_info("socket %d error", fd);
+            close_peer(r, fd);
+            return;
+        }
+        apply_status(r, fd, r->config->handlers.on_peer_error(fd));
+        if (!is_live(f)) {
+            return;
+        }
+        status = f->status;
+    }
+
+    if (!r->ops->edge_triggered) {
+        if (ev->readable && status.want_read) {
+            status = call_recv(r, fd);
+        } else if (ev->writable && status.want_write) {
+            status = r->config->handlers.on_peer_ready_send(fd);
+        } else {
+            return;
+        }
+        apply_status(r, fd, status);
+        return;
+    }
+
+    f->readable |= ev->readable;
+    f->writable |= ev->writable;
+    // A deferred connection already has its place in line.
+    if (!f->deferred) {
+        drive_peer(r, fd);
+    }
+}
+
+// Drains the queue of listener listen_fd up to ACCEPT_BUDGET connections and
+// registers each new peer with this reactor.
+static void accept_pending(reactor_t *r, int listen_fd)
+{
+    for (int n = 0; n < ACCEPT_BUDGET; n++) {
+        struct sockaddr_storage peer_addr;
+        socklen_t peer_addr_len = sizeof(peer_addr);
+
+        int newfd = accept_nonblocking(listen_fd, (struct sockaddr*)&peer_addr, &peer_addr_len);
+        if (newfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            } else if (errno == ECONNABORTED) {
+                log_warn("accept: %s", strerror(errno));
+                return;
+            } else if (errno == EMFILE || errno == ENFILE) {
+                if (!accept_drop_pending(listen_fd)) {
+                    return;
+                }
+                continue;
+            } else {
+                perror("ERROR on accept");
+                exit(1);
+            }
+        }
+
+        if (newfd >= r->config->maxfds) {
+            log_error("socket fd (%d) >= maxfds (%d)", newfd, r->config->maxfds);
+            close(newfd);
+            continue;
+        }
+
+        tune_accepted_socket(newfd);
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+        PROBE1(accept, newfd);
+        if (r->config->tls && listen_fd == r->listen_fd) {
+            if (!r->ops->add(r->poller, newfd, true, false, 0)) {
+                log_error("socket fd (%d) can't be watched by %s", newfd, r->ops->name);
+                close(newfd);
+                continue;
+            }
+            r->fds[newfd] = (reactor_fd_t){.status = fd_status_R,
+                                           .tls = ktls_accept_start(newfd)};
+            // The ClientHello may be in already.
+            continue_handshake(r, newfd);
+            continue;
+        }
+        fd_status_t status = r->config->handlers.on_peer_connected(
+            newfd, (struct sockaddr*)&peer_addr, peer_addr_len);
+        if (!status.want_read && !status.want_write) {
+            release_peer(r, newfd);
+            continue;
+        }
+
+        if (!r->ops->add(r->poller, newfd, status.want_read, status.want_write, 0)) {
+            log_error("socket fd (%d) can't be watched by %s", newfd, r->ops->name);
+            release_peer(r, newfd);
+            continue;
+        }
+        r->fds[newfd] = (reactor_fd_t){.status = status};
+    }
+}
+
+static void adopt_peer(reactor_t *r, reactor_adopted_peer_t *peer)
+{
+    int fd = peer->fd;
+    if (fd >= r->config->maxfds || r->config->handlers.restore_peer == NULL) {
+        log_error("can't restore socket %d", fd);
+        free(peer->state);
+        close(fd);
+        return;
+    }
+    fd_status_t status = r->config->handlers.restore_peer(fd, peer->state, peer->state_len);
+    free(peer->state);
+    peer->state = NULL;
+
+    if (!status.want_read && !status.want_write) {
+        release_peer(r, fd);
+        return;
+    }
+    if (!r->ops->add(r->poller, fd, status.want_read, status.want_write, 0)) {
+        log_error("socket fd (%d) can't be watched by %s", fd, r->ops->name);
+        release_peer(r, fd);
+        return;
+    }
+    r->fds[fd] = (reactor_fd_t){.status = status};
+}
+
+// Stops serving fd here and posts it to loop to.
+static void migrate_peer(reactor_t *r, int fd, int to)
+{
+    reactor_fd_t *f = &r->fds[fd];
+    migrant_t *m = malloc(sizeof(*m));
+    if (m == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    m->fd = fd;
+    m->from = r->index;
+    m->status = f->status;
+    m->readable = f->readable;
+    m->writable = f->writable;
+
+    if (f->deferred) {
+        undefer_peer(r, fd);
+    }
+    r->ops->remove(r->poller, fd);
+    f->status = fd_status_NORW;
+    metrics_add(METRIC_CONNECTIONS_MIGRATED, 1);
+    mailbox_post(&group.loops[to].migrations, &m->node);
+}
+
+// Takes over a connection another loop gave away. While the loops are parked
+// for a hot restart it is only recorded, and reattach_all adds it if the
+// handoff fails.
+static void land_migrant(reactor_t *r, migrant_t *m, bool attach)
+{
+    int fd = m->fd;
+    reactor_fd_t *f = &r->fds[fd];
+    r->config->handlers.on_peer_migrated(fd, m->from);
+    *f = (reactor_fd_t){.status = m->status, .readable = m->readable, .writable = m->writable};
+    free(m);
+    if (!attach) {
+        return;
+    }
+
+    if (!r->ops->add(r->poller, fd, f->status.want_read, f->status.want_write, 0)) {
+        log_error("socket fd (%d) can't be watched by %s", fd, r->ops->name);
+        release_peer(r, fd);
+        f->status = fd_status_NORW;
+        metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+        return;
+    }
+    // Readiness the socket had on the old loop may not be reported again.
+    if (r->ops->edge_triggered &&
+        ((f->status.want_write && f->writable) || (f->status.want_read && f->readable))) {
+        defer_peer(r, fd);
+    }
+}
+
+static void deliver_migrant(mailbox_node_t *node, void *arg)
+{
+    land_migrant(arg, (migrant_t *)node, true);
+}
+
+static void record_migrant(mailbox_node_t *node, void *arg)
+{
+    land_migrant(arg, (migrant_t *)node, false);
+}
+
+// Ends a rebalancing interval: publishes this loop's load and, if it is much
+// busier than the idlest loop, moves enough connections there, by events, to
+// even the two out.
+static void rebalance(reactor_t *r, uint64_t now)
+{
+    uint32_t load = r->busy_ns * 1000 / (now - r->interval_start_ns);
+    if (load > 1000) {
+        load = 1000;
+    }
+    uint64_t serviced = r->serviced;
+    uint64_t events_per_sec = serviced * 1000000000ull / (now - r->interval_start_ns);
+    atomic_store_explicit(&r->load, load, memory_order_relaxed);
+    atomic_store_explicit(&r->load_at_ns, now, memory_order_relaxed);
+    r->interval_start_ns = now;
+    r->busy_ns = 0;
+    r->serviced = 0;
+
+    // A loop that hasn't reported for a couple of intervals is asleep in its
+    // poller, with nothing to do.
+    uint64_t stale_ns = 2 * (uint64_t)r->config->rebalance_ms * 1000000;
+    int target = -1;
+    uint32_t target_load = 0;
+    for (int i = 0; i < group.num_loops; i++) {
+        if (i == r->index) {
+            continue;
+        }
+        uint32_t l = atomic_load_explicit(&group.loops[i].load, memory_order_relaxed);
+        if (atomic_load_explicit(&group.loops[i].load_at_ns, memory_order_relaxed) + stale_ns < now) {
+            l = 0;
+        }
+        if (target < 0 || l < target_load) {
+            target = i;
+            target_load = l;
+        }
+    }
+    uint64_t to_move = 0;
+    if (load >= REBALANCE_MIN_LOAD && load > target_load &&
+        load - target_load >= REBALANCE_MIN_GAP) {
+        to_move = serviced * (load - target_load) / (2 * load);
+    }
+
+    int moved = 0;
+    uint64_t moved_serviced = 0;
+    for (int fd = 0; fd < r->config->maxfds; fd++) {
+        reactor_fd_t *f = &r->fds[fd];
+        uint32_t n = f->serviced;
+        f->serviced = 0;
+        if (n > 0 && n <= to_move - moved_serviced && moved < REBALANCE_MAX_MOVES && is_live(f) &&
+            f->tls == NULL) {
+            migrate_peer(r, fd, target);
+            moved++;
+            moved_serviced += n;
+        }
+    }
+    if (moved > 0) {
+        log_info("loop %d, %u%% busy at %lu events/s: moved %d connection(s) with %lu events "
+                 "to loop %d, %u%% busy", r->index, load / 10, (unsigned long)events_per_sec,
+                 moved, (unsigned long)moved_serviced, target, target_load / 10);
+    }
+}
+
+// Takes the listeners and connections out of this loop's poller so that it
+// leaves them alone while they are being handed off.
+static void detach_all(reactor_t *r)
+{
+    r->ops->remove(r->poller, r->listen_fd);
+    if (r->unix_fd >= 0) {
+        r->ops->remove(r->poller, r->unix_fd);
+    }
+    if (r->stats_fd >= 0) {
+        r->ops->remove(r->poller, r->stats_fd);
+    }
+    for (int fd = 0; fd < r->config->maxfds; fd++) {
+        if (is_live(&r->fds[fd])) {
+            r->ops->remove(r->poller, fd);
+        }
+    }
+}
+
+static void reattach_all(reactor_t *r)
+{
+    r->ops->add(r->poller, r->listen_fd, true, false, r->listen_flags);
+    if (r->unix_fd >= 0) {
+        r->ops->add(r->poller, r->unix_fd, true, false, r->listen_flags);
+    }
+    if (r->stats_fd >= 0) {
+        r->ops->add(r->poller, r->stats_fd, true, false, POLLER_LEVEL);
+    }
+    for (int fd = 0; fd < r->config->maxfds; fd++) {
+        reactor_fd_t *f = &r->fds[fd];
+        if (is_live(f)) {
+            r->ops->add(r->poller, fd, f->status.want_read, f->status.want_write, 0);
+        }
+    }
+}
+
+// Called on the other loops when a handoff starts: detaches everything and
+// waits until the handoff is over. Only returns if it failed.
+static void park(reactor_t *r)
+{
+    detach_all(r);
+    pthread_mutex_lock(&group.lock);
+    unsigned round = group.round;
+    group.parked++;
+    pthread_cond_broadcast(&group.cond);
+    while (group.round == round) {
+        pthread_cond_wait(&group.cond, &group.lock);
+    }
+    pthread_mutex_unlock(&group.lock);
+    reattach_all(r);
+}
+
+static bool send_snapshot(reactor_t *r, int sock, int *num_peers)
+{
+    handoff_writer_t *w = malloc(sizeof(*w));
+    if (w == NULL) {
+        return false;
+    }
+    handoff_writer_init(w, sock);
+
+    bool ok = handoff_put(w, HANDOFF_LISTENER, r->listen_fd, NULL, 0);
+    if (ok && r->unix_fd >= 0) {
+        ok = handoff_put(w, HANDOFF_UNIX_LISTENER, r->unix_fd, NULL, 0);
+    }
+    if (ok && r->stats_fd >= 0) {
+        ok = handoff_put(w, HANDOFF_STATS, r->stats_fd, NULL, 0);
+    }
+    uint8_t state[PEER_STATE_MAX];
+    for (int i = 0; ok && i < group.num_loops; i++) {
+        reactor_t *loop = &group.loops[i];
+        for (int fd = 0; ok && fd < loop->config->maxfds; fd++) {
+            // Handshakes in progress can't be carried over; they are dropped.
+            if (is_live(&loop->fds[fd]) && loop->fds[fd].tls == NULL) {
+                size_t len = r->config->handlers.save_peer(fd, state, sizeof(state));
+                ok = handoff_put(w, HANDOFF_PEER, fd, state, len);
+                (*num_peers)++;
+            }
+        }
+    }
+    ok = ok && handoff_finish(w);
+    free(w);
+    return ok;
+}
+
+// A new process connected to the handoff socket: park every loop, send it
+// the listeners, connections and their state, and exit once it acks. If it
+// doesn't, put everything back and keep serving.
+static void hand_off(reactor_t *r)
+{
+    int sock = accept4(r->config->handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (sock < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_warn("handoff accept: %s", strerror(errno));
+        }
+        return;
+    }
+    log_info("handing off to a new process");
+
+    if (group.wake_fd >= 0) {
+        uint64_t one = 1;
+        if (write(group.wake_fd, &one, sizeof(one)) < 0) {
+            perror("eventfd write");
+            exit(1);
+        }
+    }
+    detach_all(r);
+    pthread_mutex_lock(&group.lock);
+    while (group.parked < group.num_loops - 1) {
+        pthread_cond_wait(&group.cond, &group.lock);
+    }
+    pthread_mutex_unlock(&group.lock);
+    // Connections in the middle of a move are in no loop's table yet.
+    for (int i = 0; group.rebalance && i < group.num_loops; i++) {
+        mailbox_drain(&group.loops[i].migrations, record_migrant, &group.loops[i], SIZE_MAX);
+    }
+
+    int num_peers = 0;
+    bool ok = send_snapshot(r, sock, &num_peers);
+    struct timeval timeout = {.tv_sec = HANDOFF_ACK_TIMEOUT_SEC};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    uint8_t ack;
+    if (ok && recv(sock, &ack, 1, 0) == 1) {
+        // The new process owns our sockets now; exiting only drops our
+        // references to them.
+        log_info("handed off %d connection(s), exiting", num_peers);
+        logger_flush();
+        exit(0);
+    }
+
+    log_error("handoff failed, resuming service");
+    close(sock);
+    if (group.wake_fd >= 0) {
+        uint64_t count;
+        if (read(group.wake_fd, &count, sizeof(count)) < 0) {
+            perror("eventfd read");
+            exit(1);
+        }
+    }
+    pthread_mutex_lock(&group.lock);
+    group.parked = 0;
+    group.round++;
+    pthread_cond_broadcast(&group.cond);
+    pthread_mutex_unlock(&group.lock);
+    reattach_all(r);
+}
+
+static __thread int current_loop = -1;
+
+void reactor_post(int loop, mailbox_node_t *msg)
+{
+    mailbox_post(&group.loops[loop].mailbox, msg);
+}
+
+int reactor_current_loop(void)
+{
+    return current_loop;
+}
+
+void reactor_update(int fd, fd_status_t status)
+{
+    reactor_t *r = &group.loops[current_loop];
+    reactor_fd_t *f = &r->fds[fd];
+    if (!is_live(f)) {
+        return;
+    }
+    apply_status(r, fd, status);
+    // Edge-triggered backends won't report readiness the socket already had;
+    // the deferred list gets the connection driven after this batch instead.
+    if (r->ops->edge_triggered && !f->deferred &&
+        ((status.want_write && f->writable) || (status.want_read && f->readable))) {
+        defer_peer(r, fd);
+    }
+}
+
+static void deliver(mailbox_node_t *msg, void *arg)
+{
+    const reactor_t *r = arg;
+    r->config->handlers.on_message(msg);
+}
+
+static int wait_fn(void *arg, int timeout_ms)
+{
+    reactor_t *r = arg;
+    // Deferred connections still have work: just pick up new events.
+    if (r->deferred_head >= 0) {
+        timeout_ms = 0;
+    }
+    return r->ops->wait(r->poller, r->events, MAX_EVENTS, timeout_ms);
+}
+
+static void run_loop(reactor_t *r)
+{
+    const reactor_config_t *config = r->config;
+    r->ops = config->poller;
+    r->listen_fd = config->listen_fd;
+    r->unix_fd = config->unix_fd;
+    // Only the first loop serves stats and hot restarts.
+    r->stats_fd = r->index == 0 ? config->stats_fd : -1;
+    r->deferred_head = r->deferred_tail = -1;
+    current_loop = r->index;
+    accept_reserve_init();
+    r->poller = r->ops->create(config->maxfds);
+    r->fds = calloc(config->maxfds, sizeof(*r->fds));
+    r->events = calloc(MAX_EVENTS, sizeof(*r->events));
+    if (r->poller == NULL || r->fds == NULL || r->events == NULL) {
+        log_error("unable to set up %s reactor", r->ops->name);
+        logger_flush();
+        exit(1);
+    }
+
+    // With several loops waiting on the same listener, exclusive wakeups
+    // (where the backend supports them) wake one loop per connection.
+    r->listen_flags = POLLER_LEVEL | (group.num_loops > 1 ? POLLER_EXCLUSIVE : 0);
+    r->ops->add(r->poller, r->listen_fd, true, false, r->listen_flags);
+    if (r->unix_fd >= 0) {
+        r->ops->add(r->poller, r->unix_fd, true, false, r->listen_flags);
+    }
+    if (r->stats_fd >= 0) {
+        r->ops->add(r->poller, r->stats_fd, true, false, POLLER_LEVEL);
+    }
+    int handoff_fd = -1;
+    if (config->handoff_fd >= 0) {
+        if (r->index == 0) {
+            handoff_fd = config->handoff_fd;
+            r->ops->add(r->poller, handoff_fd, true, false, POLLER_LEVEL);
+        } else {
+            r->ops->add(r->poller, group.wake_fd, true, false, POLLER_LEVEL);
+        }
+    }
+
+    if (config->handlers.on_message != NULL) {
+        r->ops->add(r->poller, mailbox_fd(&r->mailbox), true, false, POLLER_LEVEL);
+    }
+    if (group.rebalance) {
+        r->ops->add(r->poller, mailbox_fd(&r->migrations), true, false, POLLER_LEVEL);
+    }
+    uint64_t interval_ns = (uint64_t)config->rebalance_ms * 1000000;
+    r->interval_start_ns = now_ns();
+
+    for (int i = r->index; i < config->num_adopted; i += group.num_loops) {
+        adopt_peer(r, &config->adopted[i]);
+    }
+
+    adaptive_poller_t waiter;
+    adaptive_poller_init(&waiter, config->poll_mode, config->max_spin_us);
+
+    while (1) {
+        int nready = adaptive_wait(&waiter, wait_fn, r);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait");
+            exit(1);
+        }
+        PROBE2(loop_wakeup, r->index, nready);
+        uint64_t wake_ns = group.rebalance ? now_ns() : 0;
+        uint64_t iteration_start_ns = metrics_now_ns();
+        metrics_add(METRIC_LOOP_ITERATIONS, 1);
+        metrics_observe(HIST_POLL_BATCH, nready);
+
+        for (int i = 0; i < nready; i++) {
+            int fd = r->events[i].fd;
+            if (fd == r->listen_fd || fd == r->unix_fd) {
+                accept_pending(r, fd);
+            } else if (fd == r->stats_fd) {
+                metrics_serve_pending(r->stats_fd);
+            } else if (fd == handoff_fd) {
+                // hand_off only returns if no handoff took place, and the
+                // rest of this batch may predate the fds being re-added.
+                hand_off(r);
+                break;
+            } else if (r->index > 0 && fd == group.wake_fd) {
+                park(r);
+                break;
+            } else if (fd == mailbox_fd(&r->mailbox)) {
+                mailbox_drain(&r->mailbox, deliver, r, MAILBOX_BATCH);
+            } else if (group.rebalance && fd == mailbox_fd(&r->migrations)) {
+                mailbox_drain(&r->migrations, deliver_migrant, r, MAILBOX_BATCH);
+            } else {
+                service_peer(r, &r->events[i]);
+            }
+        }
+        run_deferred(r);
+
+        if (iteration_start_ns != 0) {
+            metrics_observe(HIST_LOOP_ITERATION_NS, metrics_now_ns() - iteration_start_ns);
+        }
+        if (group.rebalance) {
+            uint64_t now = now_ns();
+            r->busy_ns += now - wake_ns;
+            if (now - r->interval_start_ns >= interval_ns) {
+                rebalance(r, now);
+            }
+        }
+    }
+}
+
+static void *reactor_thread(void *arg)
+{
+    run_loop(arg);
+    return NULL;
+}
+
+void reactor_run(const reactor_config_t *config, int num_threads)
+{
+    log_info("running %d %s event loop(s)", num_threads, config->poller->name);
+    if (config->handoff_fd >= 0 && config->handlers.save_peer == NULL) {
+        log_error("these handlers don't support hot restart");
+        logger_flush();
+        exit(1);
+    }
+
+    group.num_loops = num_threads;
+    group.rebalance = config->rebalance_ms > 0 && num_threads > 1;
+    if (group.rebalance && config->handlers.on_peer_migrated == NULL) {
+        log_warn("these handlers don't support rebalancing; REBALANCE_MS ignored");
+        group.rebalance = false;
+    }
+    group.loops = calloc(num_threads, sizeof(*group.loops));
+    if (group.loops == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    if (config->handoff_fd >= 0 && num_threads > 1) {
+        group.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (group.wake_fd < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        group.loops[i].config = config;
+        group.loops[i].index = i;
+        mailbox_init(&group.loops[i].mailbox);
+        if (group.rebalance) {
+            mailbox_init(&group.loops[i].migrations);
+        }
+    }
+    for (int i = 1; i < num_threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, reactor_thread, &group.loops[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    run_loop(&group.loops[0]);
+}
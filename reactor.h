@@ -0,0 +1,162 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+// Event loop shared by the event-driven servers.
+//
+// A server provides the three fd_status_t handlers below and a listening
+// socket; the reactor accepts connections, waits for readiness through a
+// pluggable poller backend (see poller.h) and calls the handlers. Each
+// handler returns what the connection wants next; returning fd_status_NORW
+// closes it.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "busypoll.h"
+#include "mailbox.h"
+#include "poller.h"
+
+typedef struct {
+    bool want_read;
+    bool want_write;
+    // Set when the handler stopped because recv/send hit EAGAIN. Edge-
+    // triggered backends only call the handler again after a new readiness
+    // edge; level-triggered ones ignore this.
+    bool blocked;
+} fd_status_t;
+
+// Defined here rather than in reactor.c, so that handlers built for
+// reactor-static.h's loops don't have to link the dynamic reactor.
+static const fd_status_t fd_status_R = {.want_read = true, .want_write = false};
+static const fd_status_t fd_status_W = {.want_read = false, .want_write = true};
+static const fd_status_t fd_status_RW = {.want_read = true, .want_write = true};
+static const fd_status_t fd_status_NORW = {.want_read = false, .want_write = false};
+static const fd_status_t fd_status_R_BLOCKED = {.want_read = true, .want_write = false,
+                                               .blocked = true};
+static const fd_status_t fd_status_W_BLOCKED = {.want_read = false, .want_write = true,
+                                               .blocked = true};
+
+typedef struct {
+    fd_status_t (*on_peer_connected)(int sockfd, const struct sockaddr *peer_addr,
+                                     socklen_t peer_addr_len);
+    fd_status_t (*on_peer_ready_recv)(int sockfd);
+    fd_status_t (*on_peer_ready_send)(int sockfd);
+    // Optional: called just before the reactor closes a connection, for any
+    // reason, so that the handlers can release its state.
+    void (*on_peer_closed)(int sockfd);
+    // Optional: called when the poller reports an error condition on the
+    // socket, which needn't be fatal (MSG_ZEROCOPY completions, say, are
+    // signalled that way). Without it the connection is closed.
+    fd_status_t (*on_peer_error)(int sockfd);
+    // Optional: receives, on the loop's thread, the messages reactor_post
+    // sends to that loop.
+    void (*on_message)(mailbox_node_t *msg);
+    // Optional, for hot restart (see handoff.h): save_peer serializes the
+    // connection's state into buf and returns its size (at most len), and
+    // restore_peer rebuilds it in the new process and returns what the
+    // connection wants next.
+    size_t (*save_peer)(int sockfd, uint8_t *buf, size_t len);
+    fd_status_t (*restore_peer)(int sockfd, const uint8_t *buf, size_t len);
+    // Optional, for load rebalancing (see REBALANCE_MS below): called when a
+    // connection has been moved to another loop, before that loop serves it,
+    // with the loop it came from. Only handlers that set it get their connections
+    // moved, so their per-connection state must not belong to a loop.
+    void (*on_peer_migrated)(int sockfd, int from_loop);
+} reactor_handlers_t;
+
+// A connection taken over from the previous process.
+typedef struct {
+    int fd;
+    size_t state_len;
+    uint8_t *state;
+} reactor_adopted_peer_t;
+
+typedef struct {
+    const poller_ops_t *poller;
+    reactor_handlers_t handlers;
+    int listen_fd;
+    int unix_fd;     // Unix socket listener served alongside, or -1.
+    int stats_fd;    // Metrics endpoint listener, or -1.
+    int maxfds;      // Peers with fds at or above this are refused.
+    poll_mode_t poll_mode;
+    int max_spin_us;
+    // Handler calls one connection may take per loop iteration on edge-
+    // triggered backends, or 0 for no limit.
+    int fair_budget;
+    // How often each loop weighs its load against the others', in ms, or 0
+    // for never.
+    int rebalance_ms;
+    // TCP connections start with a TLS handshake; see ktls.h.
+    bool tls;
+    // Hot restart listener, or -1, and the connections inherited from the
+    // process we took over from, spread across the loops by reactor_run.
+    int handoff_fd;
+    reactor_adopted_peer_t *adopted;
+    int num_adopted;
+} reactor_config_t;
+
+// Fills in the defaults and applies the environment: POLLER (backend name),
+// POLL_MODE and MAX_SPIN_US (see busypoll.h), FAIR_BUDGET, STATS_PORT,
+// which enables metrics and opens the stats listener, and UNIX_SOCKET, which
+// opens unix_fd (see listen_unix_socket).
+//
+// TLS_CERT and TLS_KEY, PEM files (make-cert.sh makes a self-signed pair),
+// turn on TLS for the TCP listener, with the record layer in the kernel (see
+// ktls.h). The reactor runs each handshake without blocking, alongside the
+// other connections, and only calls on_peer_connected once the kernel has
+// the keys, so the handlers' send and recv stay plain syscalls on
+// plaintext. Connections whose handshake fails are closed unseen, as are
+// any still in their handshake at a hot restart. The Unix socket listener
+// stays plaintext.
+//
+// Level-triggered backends call a ready connection's handler once per loop
+// iteration, so every ready connection gets its turn. Edge-triggered ones
+// have to keep calling it until the socket runs dry, which would let one fast
+// sender hold the loop indefinitely; instead, a connection that uses up its
+// FAIR_BUDGET of handler calls (16 by default; each one moves at most a
+// buffer's worth of data) goes to the back of a deferred list, serviced
+// round-robin, one budget at a time, between polls that then don't block.
+//
+// REBALANCE_MS moves connections from busy loops to idle ones, for handlers
+// with on_peer_migrated. Connections stay on the loop that accepted them,
+// and long-lived ones can leave one loop saturated while the rest idle.
+// With this set, every loop measures, each REBALANCE_MS, the share of its
+// time spent handling events rather than waiting, and the events each
+// connection had. A loop over 60% busy and 20 points above the least busy
+// one then hands the latter enough of its connections to even the two out,
+// by events, up to 64 at a time: it stops polling them and posts them to
+// the other loop's mailbox, which polls them from then on. Nothing is read
+// or written on the way, so unread input waits in the socket and pending
+// output in the handlers' state. A connection busier than the whole amount
+// to move stays put, as it would just make the other loop the busy one.
+//
+// HANDOFF_PATH enables hot restart: if a server is already listening on that
+// Unix socket path, this takes over its listeners and connections, leaving
+// listen_fd (and unix_fd) set (the caller should then not open its own).
+// Either way, the path is then bound so that the next process can take over
+// from this one.
+void reactor_config_init(reactor_config_t *config, const char *default_poller);
+
+// Runs num_threads event loops sharing the listener; the calling thread
+// becomes one of them and is the only one serving the stats endpoint.
+// Never returns.
+void reactor_run(const reactor_config_t *config, int num_threads);
+
+// Sends msg to event loop number loop (from 0) once reactor_run has started,
+// from any thread; the loop hands it to on_message in a batch with the rest
+// of its mail. See mailbox.h.
+void reactor_post(int loop, mailbox_node_t *msg);
+
+// The index of the event loop running on the calling thread, or -1.
+int reactor_current_loop(void);
+
+// Changes what connection fd waits for from outside its handlers, e.g. to
+// have it send output that another connection's handler queued for it. Only
+// for connections of the calling thread's loop, and not for closing them
+// (have a handler return fd_status_NORW for that); does nothing if fd isn't
+// open. The handlers are called back later, never from in here.
+void reactor_update(int fd, fd_status_t status);
+
+#endif
@@ -0,0 +1,384 @@
+// Replays traffic captured by a server running with CAPTURE_PATH set (see
+// capture.h) against any server: every captured connection is opened, sent
+// the same bytes in the same chunks and closed again, on the captured
+// schedule. Replies are read and thrown away.
+//
+// usage: replay [-x speed] <log> <host> <port>
+//
+// -x scales the schedule: 2 replays twice as fast, 0 as fast as possible;
+// the default is 1, real time. The report includes how late sends went out
+// relative to the schedule; when that grows, the server (or the replay
+// itself) isn't keeping up with the captured load.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+// How long to keep flushing output after the last record.
+#define DRAIN_NS 5000000000ull
+
+typedef struct {
+    int fd; // -1 if not open.
+    bool closing; // Close once the pending output is out.
+    uint8_t *pending;
+    size_t pending_len;
+    size_t pending_cap;
+} replay_conn_t;
+
+typedef struct {
+    uint64_t connections;
+    uint64_t chunks;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t errors;
+    uint64_t *lag_ns; // Per chunk: how late it was handed to the socket.
+    size_t num_lag;
+    size_t cap_lag;
+} replay_stats_t;
+
+static struct addrinfo *server_addr;
+static int epfd;
+static replay_conn_t *conns; // Indexed by captured connection id.
+static uint32_t num_conns;
+static uint64_t open_conns;
+static replay_stats_t stats;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static replay_conn_t *conn_get(uint32_t id)
+{
+    if (id >= num_conns) {
+        uint32_t n = num_conns ? num_conns : 1024;
+        while (n <= id) {
+            n *= 2;
+        }
+        conns = realloc(conns, n * sizeof(*conns));
+        if (conns == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+        memset(&conns[num_conns], 0, (n - num_conns) * sizeof(*conns));
+        for (uint32_t i = num_conns; i < n; i++) {
+            conns[i].fd = -1;
+        }
+        num_conns = n;
+    }
+    return &conns[id];
+}
+
+static void conn_close(replay_conn_t *c)
+{
+    close(c->fd);
+    c->fd = -1;
+    c->closing = false;
+    c->pending_len = 0;
+    open_conns--;
+}
+
+static void conn_open(uint32_t id)
+{
+    replay_conn_t *c = conn_get(id);
+    if (c->fd >= 0) {
+        conn_close(c);
+    }
+    int fd = socket(server_addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) < 0 &&
+                   errno != EINPROGRESS)) {
+        stats.errors++;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // Edge-triggered: output is flushed on EPOLLOUT edges, input drained on
+    // EPOLLIN ones.
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.u32 = id};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    c->fd = fd;
+    open_conns++;
+    stats.connections++;
+}
+
+// Sends as much pending output as the socket takes. Returns false if the
+// connection failed and was dropped.
+static bool conn_flush(replay_conn_t *c)
+{
+    size_t off = 0;
+    while (off < c->pending_len) {
+        ssize_t n = send(c->fd, c->pending + off, c->pending_len - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            stats.errors++;
+            conn_close(c);
+            return false;
+        }
+        off += n;
+        stats.bytes_sent += n;
+    }
+    memmove(c->pending, c->pending + off, c->pending_len - off);
+    c->pending_len -= off;
+    if (c->closing && c->pending_len == 0) {
+        conn_close(c);
+    }
+    return true;
+}
+
+static void record_lag(uint64_t ns)
+{
+    if (stats.num_lag == stats.cap_lag) {
+        stats.cap_lag = stats.cap_lag ? stats.cap_lag * 2 : 4096;
+        stats.lag_ns = realloc(stats.lag_ns, stats.cap_lag * sizeof(*stats.lag_ns));
+        if (stats.lag_ns == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+    }
+    stats.lag_ns[stats.num_lag++] = ns;
+}
+
+static void conn_send(uint32_t id, const uint8_t *data, size_t len, uint64_t due_ns)
+{
+    replay_conn_t *c = conn_get(id);
+    if (c->fd < 0) {
+        return; // Never opened, or failed.
+    }
+    if (c->pending_len + len > c->pending_cap) {
+        c->pending_cap = (c->pending_len + len) * 2;
+        c->pending = realloc(c->pending, c->pending_cap);
+        if (c->pending == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+    }
+    memcpy(c->pending + c->pending_len, data, len);
+    c->pending_len += len;
+    stats.chunks++;
+    uint64_t now = now_ns();
+    record_lag(now > due_ns ? now - due_ns : 0);
+    conn_flush(c);
+}
+
+static void conn_finish(uint32_t id)
+{
+    replay_conn_t *c = conn_get(id);
+    if (c->fd < 0) {
+        return;
+    }
+    c->closing = true;
+    conn_flush(c);
+}
+
+// Handles socket events until deadline_ns (or just what's ready, if that
+// has passed).
+static void poll_until(uint64_t deadline_ns)
+{
+    struct epoll_event events[256];
+    uint8_t buf[65536];
+
+    do {
+        uint64_t now = now_ns();
+        uint64_t wait = deadline_ns > now ? deadline_ns - now : 0;
+        struct timespec timeout = {.tv_sec = wait / 1000000000ull, .tv_nsec = wait % 1000000000ull};
+        int n = epoll_pwait2(epfd, events, 256, &timeout, NULL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_pwait2");
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            replay_conn_t *c = &conns[events[i].data.u32];
+            if (c->fd < 0) {
+                continue;
+            }
+            if (events[i].events & EPOLLIN) {
+                ssize_t got;
+                while ((got = recv(c->fd, buf, sizeof(buf), 0)) > 0) {
+                    stats.bytes_received += got;
+                }
+                if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    // The server hung up; the replay only closes on schedule
+                    // but there's nothing left to talk to.
+                    if (got < 0 || c->pending_len > 0) {
+                        stats.errors++;
+                    }
+                    conn_close(c);
+                    continue;
+                }
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                stats.errors++;
+                conn_close(c);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                conn_flush(c);
+            }
+        }
+    } while (now_ns() < deadline_ns);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: replay [-x speed] <log> <host> <port>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    double speed = 1.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:")) != -1) {
+        switch (opt) {
+        case 'x':
+            speed = atof(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 3 || speed < 0) {
+        usage();
+    }
+
+    int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    const uint8_t *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (log == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    if ((size_t)st.st_size < sizeof(capture_header_t) ||
+        memcmp(log, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a capture log\n", argv[optind]);
+        exit(1);
+    }
+    madvise((void *)log, st.st_size, MADV_SEQUENTIAL);
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int rc = getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &server_addr);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        exit(1);
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    uint64_t captured_ns = 0;
+    uint64_t behind = 0;
+    size_t off = sizeof(capture_header_t);
+    while (off + sizeof(capture_record_t) <= (size_t)st.st_size) {
+        capture_record_t rec;
+        memcpy(&rec, log + off, sizeof(rec));
+        uint32_t kind = CAPTURE_KIND(rec.kind_len);
+        size_t len = CAPTURE_LEN(rec.kind_len);
+        if (kind == 0 || off + CAPTURE_RECORD_SIZE(len) > (size_t)st.st_size) {
+            break; // The end of what was written.
+        }
+
+        // Records from different threads can be a little out of order; a
+        // due time in the past just goes out now.
+        uint64_t due = start + (speed > 0 ? (uint64_t)(rec.time_ns / speed) : 0);
+        if (rec.time_ns > captured_ns) {
+            captured_ns = rec.time_ns;
+        }
+        if (due > now_ns()) {
+            poll_until(due);
+        } else if (++behind % 64 == 0) {
+            poll_until(0); // Running late: still pick up replies now and then.
+        }
+
+        if (kind == CAPTURE_OPEN) {
+            conn_open(rec.conn);
+        } else if (kind == CAPTURE_DATA) {
+            conn_send(rec.conn, log + off + sizeof(rec), len, due);
+        } else if (kind == CAPTURE_CLOSE) {
+            conn_finish(rec.conn);
+        }
+        off += CAPTURE_RECORD_SIZE(len);
+    }
+
+    // Let pending output go out, then hang up on connections the capture
+    // never saw closed.
+    uint64_t drain_deadline = now_ns() + DRAIN_NS;
+    while (now_ns() < drain_deadline) {
+        bool pending = false;
+        for (uint32_t i = 0; i < num_conns; i++) {
+            pending |= conns[i].fd >= 0 && conns[i].pending_len > 0;
+        }
+        if (!pending) {
+            break;
+        }
+        poll_until(now_ns() + 10000000);
+    }
+    uint64_t unfinished = open_conns;
+    for (uint32_t i = 0; i < num_conns; i++) {
+        if (conns[i].fd >= 0) {
+            conn_close(&conns[i]);
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("replayed %.2fs of traffic in %.2fs (speed %g)\n", captured_ns / 1e9, elapsed, speed);
+    printf("  connections: %lu (still open at the end %lu, errors %lu)\n",
+           (unsigned long)stats.connections, (unsigned long)unfinished,
+           (unsigned long)stats.errors);
+    printf("  chunks: %lu, bytes sent %lu, received %lu\n", (unsigned long)stats.chunks,
+           (unsigned long)stats.bytes_sent, (unsigned long)stats.bytes_received);
+    if (stats.num_lag > 0) {
+        qsort(stats.lag_ns, stats.num_lag, sizeof(*stats.lag_ns), cmp_u64);
+        const double pcts[] = {50, 90, 99, 99.9};
+        printf("  send lag us:");
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+            size_t idx = (size_t)(pcts[i] / 100.0 * (stats.num_lag - 1));
+            printf(" p%g=%.1f", pcts[i], stats.lag_ns[idx] / 1000.0);
+        }
+        printf(" max=%.1f\n", stats.lag_ns[stats.num_lag - 1] / 1000.0);
+    }
+    return 0;
+}
@@ -2,7 +2,12 @@
 //
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
+//
+// With UNIX_SOCKET set, clients may also connect on that Unix socket (see
+// listen_unix_socket); they're still served one at a time.
 
+#include <errno.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +16,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "logger.h"
 #include "utils.h"
 
 
@@ -43,13 +49,13 @@ void serve_connection(int sockfd) {
             case WAIT_FOR_MSG:
                 if (buf[i] == '^') {
                     state = IN_MSG;
-                    printf("Received message from %d: %s\n", sockfd, buf);
+                    log_debug("Received message from %d: %.*s", sockfd, len - i, &buf[i]);
                 }
                 break;
             case IN_MSG:
                 if (buf[i] == '$') {
                     state = WAIT_FOR_MSG;
-                    printf("Waiting for message from %d\n", sockfd);
+                    log_debug("Waiting for message from %d", sockfd);
                 } else {
                     buf[i] += 1;
                     if (send(sockfd, &buf[i], 1, 0) < 1) {
@@ -67,30 +73,49 @@ void serve_connection(int sockfd) {
 
 int main(int argc, char *argv[])
 {
-    setvbuf(stdout, NULL, _IONBF, 0);
+    logger_init(LOG_LEVEL_INFO);
 
     int portnum = 9090;
     if (argc >= 2) {
         portnum = atoi(argv[1]);
     }
-    printf("Serving on port %d\n", portnum);
+    log_info("Serving on port %d", portnum);
 
     int sockfd = listen_inet_socket(portnum);
+    struct pollfd pfds[2] = {{.fd = sockfd, .events = POLLIN}, {.fd = -1, .events = POLLIN}};
+    const char *unix_path = getenv("UNIX_SOCKET");
+    if (unix_path != NULL) {
+        pfds[1].fd = listen_unix_socket(unix_path);
+        log_info("Serving on Unix socket %s", unix_path);
+    }
 
     while (1) {
-        struct sockaddr_in peer_addr;
+        int listen_fd = sockfd;
+        if (pfds[1].fd >= 0) {
+            if (poll(pfds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("poll");
+                exit(1);
+            }
+            listen_fd = (pfds[0].revents & POLLIN) ? sockfd : pfds[1].fd;
+        }
+
+        struct sockaddr_storage peer_addr;
         socklen_t peer_addr_len = sizeof(peer_addr);
 
-        int newfd = accept(sockfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
+        int newfd = accept(listen_fd, (struct sockaddr *)&peer_addr, &peer_addr_len);
 
         if (newfd < 0) {
             perror("ERROR on accept");
             exit(1);
         }
 
-        report_peer_connected(&peer_addr, peer_addr_len);
+        tune_accepted_socket(newfd);
+        report_peer_connected(newfd, (struct sockaddr*)&peer_addr, peer_addr_len);
         serve_connection(newfd);
-        printf("peer done\n");
+        log_info("peer done");
         
     }
     return 0;
@@ -0,0 +1,72 @@
+#include "serve.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+typedef enum { WAIT_FOR_MSG, IN_MSG } ProcessingState;
+
+void serve_connection(int sockfd)
+{
+    uint32_t conn = capture_open_conn();
+
+    if (send(sockfd, "*", 1, MSG_NOSIGNAL) < 1) {
+        if (errno == ECONNRESET || errno == EPIPE) {
+            capture_close_conn(conn);
+            close(sockfd);
+            return;
+        }
+        perror("send");
+        exit(1);
+    }
+
+    ProcessingState state = WAIT_FOR_MSG;
+
+    while (1) {
+        uint8_t buf[1024];
+        int len = recv(sockfd, buf, sizeof(buf), 0);
+        if (len < 0) {
+            if (errno == ECONNRESET) {
+                break;
+            }
+            perror("recv");
+            exit(1);
+        } else if (len == 0) {
+            break;
+        }
+        capture_data(conn, buf, len);
+    
+        for (int i=0; i<len; ++i) {
+            switch (state) {
+            case WAIT_FOR_MSG:
+                if (buf[i] == '^') {
+                    state = IN_MSG;
+                }
+                break;
+            case IN_MSG:
+                if (buf[i] == '$') {
+                    state = WAIT_FOR_MSG;
+                } else {
+                    buf[i] += 1;
+                    if (send(sockfd, &buf[i], 1, MSG_NOSIGNAL) < 1) {
+                        if (errno == ECONNRESET || errno == EPIPE) {
+                            capture_close_conn(conn);
+                            close(sockfd);
+                            return;
+                        }
+                        perror("send error");
+                        exit(1);
+                    }
+                }
+                break;
+            }
+        }
+    }
+    capture_close_conn(conn);
+    close(sockfd);
+}
@@ -0,0 +1,14 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+// The '*' ack and ^...$ echo protocol (see protocol.h) over a blocking
+// socket, as threaded-server serves it from an OS thread per connection and
+// green-server from a green thread.
+//
+// Sends the ack, then echoes until the client hangs up, and closes sockfd.
+// Replies go out a byte per send(), which is what makes Nagle matter here.
+// Exits on any error but the peer resetting the connection. Records the
+// connection's traffic when CAPTURE_PATH is set (see capture.h).
+void serve_connection(int sockfd);
+
+#endif
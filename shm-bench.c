@@ -0,0 +1,208 @@
+// Latency benchmark for shm-server: loadgen's echo mode over shared-memory
+// rings instead of a socket.
+//
+// usage: shm-bench [-t threads] [-d seconds] [-s size] <socket_path>
+//
+// Each thread opens a session at socket_path and sends ^<size bytes>$,
+// waiting for the transformed reply before sending the next one; a message
+// has to fit in a ring, so size is at most 65534. Reports messages per
+// second and round-trip latency percentiles in loadgen's format, so that
+// bench-shm.sh can set the two side by side. SHM_SPIN_US sets how long a
+// waiting thread spins before it sleeps, as on the server.
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+typedef struct {
+    const char *path;
+    int msg_size;
+    uint64_t deadline_ns;
+    int id;
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t *samples;
+    size_t num_samples;
+    size_t cap_samples;
+} thread_ctx_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record_sample(thread_ctx_t *ctx, uint64_t ns)
+{
+    if (ctx->num_samples == ctx->cap_samples) {
+        ctx->cap_samples = ctx->cap_samples ? ctx->cap_samples * 2 : 4096;
+        ctx->samples = realloc(ctx->samples, ctx->cap_samples * sizeof(*ctx->samples));
+        if (ctx->samples == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+    }
+    ctx->samples[ctx->num_samples++] = ns;
+}
+
+// Reads exactly len bytes of reply.
+static bool recv_all(shm_client_t *c, uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        size_t n = shm_client_recv(c, buf, len);
+        if (n == 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void *echo_worker(void *arg)
+{
+    thread_ctx_t *ctx = arg;
+    shm_client_t c;
+    if (!shm_client_connect(&c, ctx->path)) {
+        fprintf(stderr, "thread %d: unable to connect\n", ctx->id);
+        ctx->errors++;
+        return NULL;
+    }
+
+    size_t msg_len = ctx->msg_size + 2;
+    uint8_t *msg = malloc(msg_len);
+    uint8_t *reply = malloc(ctx->msg_size);
+    if (msg == NULL || reply == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    msg[0] = '^';
+    msg[msg_len - 1] = '$';
+    for (int i = 0; i < ctx->msg_size; i++) {
+        msg[i + 1] = 'a' + i % 25;
+    }
+
+    while (now_ns() < ctx->deadline_ns) {
+        uint64_t start = now_ns();
+        if (!shm_client_send(&c, msg, msg_len) || !recv_all(&c, reply, ctx->msg_size) ||
+            reply[0] != 'b') {
+            ctx->errors++;
+            break;
+        }
+        record_sample(ctx, now_ns() - start);
+        ctx->ops++;
+    }
+
+    free(msg);
+    free(reply);
+    shm_client_close(&c);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(thread_ctx_t *ctxs, int n, double elapsed)
+{
+    thread_ctx_t all = {0};
+    for (int i = 0; i < n; i++) {
+        all.ops += ctxs[i].ops;
+        all.errors += ctxs[i].errors;
+        for (size_t j = 0; j < ctxs[i].num_samples; j++) {
+            record_sample(&all, ctxs[i].samples[j]);
+        }
+        free(ctxs[i].samples);
+    }
+
+    printf("mode=echo (shared memory) threads=%d elapsed=%.2fs\n", n, elapsed);
+    printf("  msg/s: %.0f (total %lu, errors %lu)\n", all.ops / elapsed,
+           (unsigned long)all.ops, (unsigned long)all.errors);
+    if (all.num_samples > 0) {
+        qsort(all.samples, all.num_samples, sizeof(*all.samples), cmp_u64);
+        const double pcts[] = {50, 90, 99, 99.9};
+        printf("  latency us:");
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+            size_t idx = (size_t)(pcts[i] / 100.0 * (all.num_samples - 1));
+            printf(" p%g=%.1f", pcts[i], all.samples[idx] / 1000.0);
+        }
+        printf(" max=%.1f\n", all.samples[all.num_samples - 1] / 1000.0);
+    }
+    free(all.samples);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: shm-bench [-t threads] [-d seconds] [-s size] <socket_path>\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int num_threads = 4;
+    int duration_sec = 5;
+    int msg_size = 32;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'd':
+            duration_sec = atoi(optarg);
+            break;
+        case 's':
+            msg_size = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (argc - optind != 1 || num_threads < 1 || duration_sec < 1 || msg_size < 1) {
+        usage();
+    }
+    if (msg_size + 2 > SHMRING_SIZE) {
+        // A thread blocked sending the rest of a message would never read the
+        // replies that the server is waiting to write.
+        fprintf(stderr, "size must be at most %d\n", SHMRING_SIZE - 2);
+        exit(1);
+    }
+
+    thread_ctx_t *ctxs = calloc(num_threads, sizeof(*ctxs));
+    pthread_t *threads = calloc(num_threads, sizeof(*threads));
+    if (ctxs == NULL || threads == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < num_threads; i++) {
+        ctxs[i].path = argv[optind];
+        ctxs[i].msg_size = msg_size;
+        ctxs[i].deadline_ns = start + (uint64_t)duration_sec * 1000000000ull;
+        ctxs[i].id = i;
+        if (pthread_create(&threads[i], NULL, echo_worker, &ctxs[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report(ctxs, num_threads, (now_ns() - start) / 1e9);
+
+    free(ctxs);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,312 @@
+// Echo server over shared-memory rings, for clients on the same host.
+//
+// usage: shm-server [socket_path]
+//
+// Clients connect to the Unix socket at socket_path (@echo-shm by default;
+// '@' for the abstract namespace) and get a channel of their own, as
+// shmring.h describes; shm-bench is one. From then on no data goes over the
+// socket: one thread serves every channel's requests, running protocol.c's
+// engine on them just as the socket servers do, binary framing included,
+// while the main thread only accepts sessions and hands them over. The ring
+// thread watches the sessions' sockets itself, for wake-ups and for clients
+// hanging up.
+//
+// Once the ring thread runs out of work, it spins SHM_SPIN_US microseconds
+// before going to sleep on the sockets: 50 by default, or 0 on a single
+// CPU, where spinning only holds the clients off. 0 sleeps at once, which
+// saves the CPU at the cost of a wake-up per message.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "protocol.h"
+#include "shmring.h"
+#include "utils.h"
+
+// Sessions served at once.
+#define MAX_SESSIONS 1024
+
+#define MAX_EVENTS 64
+
+// How often the ring thread looks at the sockets while it has work.
+#define SOCKET_CHECK_MS 10
+
+typedef struct session {
+    int sock;
+    shm_channel_t *channel;
+    peer_state_t peerstate;
+    struct session *next; // While incoming.
+} session_t;
+
+static int spin_us;
+
+// Sessions handed from the main thread to the ring thread, whether there are
+// any, and an eventfd to wake the ring thread for them.
+static pthread_mutex_t incoming_mutex = PTHREAD_MUTEX_INITIALIZER;
+static session_t *incoming;
+static atomic_bool changes;
+static int wake_fd;
+static atomic_int num_open;
+
+// The ring thread's own: its sessions, their channels in the same order for
+// shm_server_sleep, and the epoll set of their sockets and wake_fd.
+static session_t *sessions[MAX_SESSIONS];
+static shm_channel_t *channels[MAX_SESSIONS];
+static int num_sessions;
+static int epollfd;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Whether s has requests and room for the replies to them.
+static bool session_ready(session_t *s)
+{
+    return shmring_readable(&s->channel->requests) > 0 &&
+           shmring_writable(&s->channel->responses) > 0;
+}
+
+static bool has_work(void *arg)
+{
+    if (atomic_load(&changes)) {
+        return true;
+    }
+    for (int i = 0; i < num_sessions; i++) {
+        if (session_ready(sessions[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void adopt_sessions(void)
+{
+    pthread_mutex_lock(&incoming_mutex);
+    session_t *s = incoming;
+    incoming = NULL;
+    pthread_mutex_unlock(&incoming_mutex);
+    while (s != NULL) {
+        session_t *next = s->next;
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = s};
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, s->sock, &ev) < 0) {
+            perror("epoll_ctl EPOLL_CTL_ADD");
+            exit(1);
+        }
+        sessions[num_sessions] = s;
+        channels[num_sessions] = s->channel;
+        num_sessions++;
+        s = next;
+    }
+}
+
+static void end_session(session_t *s)
+{
+    for (int i = 0; i < num_sessions; i++) {
+        if (sessions[i] == s) {
+            num_sessions--;
+            sessions[i] = sessions[num_sessions];
+            channels[i] = channels[num_sessions];
+            break;
+        }
+    }
+    log_info("session on fd %d closed", s->sock);
+    close(s->sock);
+    munmap(s->channel, sizeof(shm_channel_t));
+    free(s);
+    atomic_fetch_sub(&num_open, 1);
+}
+
+// Handles what epoll reported: wake-up bytes, which only needed to wake us,
+// and clients hanging up.
+static void handle_events(struct epoll_event *events, int nready)
+{
+    for (int i = 0; i < nready; i++) {
+        session_t *s = events[i].data.ptr;
+        if (s == NULL) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                perror("read eventfd");
+                exit(1);
+            }
+            continue;
+        }
+        uint8_t bytes[256];
+        ssize_t n = recv(s->sock, bytes, sizeof(bytes), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            end_session(s);
+        }
+    }
+}
+
+// Runs as much of s's requests through the engine as there is room to reply
+// to. Replies are never longer than their requests, so they always fit.
+static bool serve_session(session_t *s, uint8_t *buf, size_t bufsize)
+{
+    shm_channel_t *ch = s->channel;
+    size_t n = shmring_readable(&ch->requests);
+    size_t room = shmring_writable(&ch->responses);
+    if (n > room) {
+        n = room;
+    }
+    if (n > bufsize) {
+        n = bufsize;
+    }
+    if (n == 0) {
+        return false;
+    }
+    shmring_read(&ch->requests, buf, n);
+    int outlen = protocol_process(&s->peerstate, buf, n, buf);
+    if (outlen > 0) {
+        shmring_write(&ch->responses, buf, outlen);
+    }
+    // Wakes the client for the replies, or for the room it may be waiting
+    // on to send more.
+    shm_wake(&ch->client_asleep);
+    return true;
+}
+
+static void *ring_thread(void *arg)
+{
+    static uint8_t buf[SHMRING_SIZE];
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t idle_since = now_ns();
+    uint64_t checked = idle_since;
+    for (;;) {
+        if (atomic_exchange(&changes, false)) {
+            adopt_sessions();
+        }
+        bool progress = false;
+        for (int i = 0; i < num_sessions; i++) {
+            progress |= serve_session(sessions[i], buf, sizeof(buf));
+        }
+        uint64_t now = now_ns();
+        if (progress) {
+            idle_since = now;
+        } else if (now - idle_since >= (uint64_t)spin_us * 1000) {
+            int nready = shm_server_sleep(channels, num_sessions, has_work, NULL, epollfd,
+                                          events, MAX_EVENTS, -1);
+            handle_events(events, nready);
+            idle_since = checked = now_ns();
+            continue;
+        }
+        // Kept busy, it still has to notice clients hanging up.
+        if (now - checked >= SOCKET_CHECK_MS * 1000000ull) {
+            handle_events(events, epoll_wait(epollfd, events, MAX_EVENTS, 0));
+            checked = now;
+        }
+    }
+    return NULL;
+}
+
+// Sets up a channel for the client on sock and passes it to the ring thread.
+// Returns false if the client is gone already.
+static bool start_session(int sock)
+{
+    session_t *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    s->sock = sock;
+    void *addr;
+    int channel_fd = shm_create("shm-channel", sizeof(shm_channel_t), &addr);
+    s->channel = addr;
+    s->channel->magic = SHM_CHANNEL_MAGIC;
+    protocol_session_init(&s->peerstate);
+
+    bool sent = shm_send_fd(sock, channel_fd);
+    close(channel_fd);
+    if (!sent) {
+        munmap(s->channel, sizeof(shm_channel_t));
+        free(s);
+        return false;
+    }
+
+    peer_credentials_t cred;
+    if (unix_peer_credentials(sock, &cred)) {
+        log_info("session from pid %d, uid %d", (int)cred.pid, (int)cred.uid);
+    }
+
+    atomic_fetch_add(&num_open, 1);
+    pthread_mutex_lock(&incoming_mutex);
+    s->next = incoming;
+    incoming = s;
+    pthread_mutex_unlock(&incoming_mutex);
+    atomic_store(&changes, true);
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("write eventfd");
+        exit(1);
+    }
+    return true;
+}
+
+int main(int argc, const char **argv)
+{
+    logger_init(LOG_LEVEL_INFO);
+
+    const char *path = argc >= 2 ? argv[1] : "@echo-shm";
+    spin_us = shm_spin_us();
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epollfd < 0 || wake_fd < 0) {
+        perror("epoll_create1/eventfd");
+        exit(1);
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, wake_fd, &ev) < 0) {
+        perror("epoll_ctl EPOLL_CTL_ADD");
+        exit(1);
+    }
+
+    int listen_fd = listen_unix_socket(path);
+    log_info("serving shared-memory sessions on %s, spinning %d us", path, spin_us);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, ring_thread, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    for (;;) {
+        int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                // Wait for sessions to end rather than spin.
+                log_warn("accept: %s", strerror(errno));
+                sleep(1);
+            } else if (errno != ECONNABORTED && errno != EINTR) {
+                perror("accept");
+                exit(1);
+            }
+            continue;
+        }
+        if (atomic_load(&num_open) >= MAX_SESSIONS) {
+            log_warn("too many sessions, refusing fd %d", sock);
+            close(sock);
+            continue;
+        }
+        if (!start_session(sock)) {
+            close(sock);
+        }
+    }
+    return 0;
+}
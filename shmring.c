@@ -0,0 +1,339 @@
+#define _GNU_SOURCE
+#include "shmring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// How long a client sleeps before checking that the server is still there.
+#define CLIENT_CHECK_MS 100
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// A peer that has run ahead of the other end's position by more than the
+// ring holds is lying; clamp, so nothing is ever copied twice over.
+uint32_t shmring_readable(shmring_t *r)
+{
+    uint32_t n = atomic_load_explicit(&r->tail, memory_order_acquire) -
+                 atomic_load_explicit(&r->head, memory_order_relaxed);
+    return n > SHMRING_SIZE ? SHMRING_SIZE : n;
+}
+
+uint32_t shmring_writable(shmring_t *r)
+{
+    uint32_t used = atomic_load_explicit(&r->tail, memory_order_relaxed) -
+                    atomic_load_explicit(&r->head, memory_order_acquire);
+    return used > SHMRING_SIZE ? 0 : SHMRING_SIZE - used;
+}
+
+size_t shmring_write(shmring_t *r, const void *buf, size_t len)
+{
+    uint32_t space = shmring_writable(r);
+    if (len > space) {
+        len = space;
+    }
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t at = tail & (SHMRING_SIZE - 1);
+    size_t first = len < SHMRING_SIZE - at ? len : SHMRING_SIZE - at;
+    memcpy(&r->data[at], buf, first);
+    memcpy(r->data, (const uint8_t *)buf + first, len - first);
+    atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+    return len;
+}
+
+size_t shmring_read(shmring_t *r, void *buf, size_t len)
+{
+    uint32_t avail = shmring_readable(r);
+    if (len > avail) {
+        len = avail;
+    }
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t at = head & (SHMRING_SIZE - 1);
+    size_t first = len < SHMRING_SIZE - at ? len : SHMRING_SIZE - at;
+    memcpy(buf, &r->data[at], first);
+    memcpy((uint8_t *)buf + first, r->data, len - first);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+    return len;
+}
+
+// Not FUTEX_PRIVATE_FLAG: the words are shared between processes.
+static void futex_wait(_Atomic uint32_t *word, uint32_t val, int timeout_ms)
+{
+    struct timespec ts = {.tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, word, FUTEX_WAIT, val, timeout_ms >= 0 ? &ts : NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *word)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// The fences pair up: either the sleeper sees the waker's data when it
+// checks after setting its word, or the waker sees the word set.
+void shm_wake(_Atomic uint32_t *asleep)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(asleep, memory_order_relaxed) != 0 &&
+        atomic_exchange_explicit(asleep, 0, memory_order_relaxed) != 0) {
+        futex_wake(asleep);
+    }
+}
+
+void shm_sleep(_Atomic uint32_t *asleep, bool (*ready)(void *arg), void *arg, int timeout_ms)
+{
+    atomic_store_explicit(asleep, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!ready(arg)) {
+        futex_wait(asleep, 1, timeout_ms);
+    }
+    atomic_store_explicit(asleep, 0, memory_order_relaxed);
+}
+
+int shm_spin_us(void)
+{
+    const char *spin = getenv("SHM_SPIN_US");
+    if (spin != NULL) {
+        return atoi(spin);
+    }
+    // On a single CPU the peer can't make progress while we spin.
+    return sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 50 : 0;
+}
+
+int shm_create(const char *name, size_t size, void **addr)
+{
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create");
+        exit(1);
+    }
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        exit(1);
+    }
+    // Otherwise a client could truncate it under the server's mapping, and
+    // the server's next access would raise SIGBUS.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        perror("fcntl F_ADD_SEALS");
+        exit(1);
+    }
+    *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (*addr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return fd;
+}
+
+bool shm_send_fd(int sock, int channel_fd)
+{
+    char ack = '*';
+    struct iovec iov = {.iov_base = &ack, .iov_len = 1};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &channel_fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+int shm_server_sleep(shm_channel_t **channels, int n, bool (*ready)(void *arg), void *arg,
+                     int epollfd, struct epoll_event *events, int maxevents, int timeout_ms)
+{
+    // As in shm_sleep, paired with the fence in wake_server.
+    for (int i = 0; i < n; i++) {
+        atomic_store_explicit(&channels[i]->server_asleep, 1, memory_order_relaxed);
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    int nready = 0;
+    if (!ready(arg)) {
+        nready = epoll_wait(epollfd, events, maxevents, timeout_ms);
+    }
+    for (int i = 0; i < n; i++) {
+        atomic_store_explicit(&channels[i]->server_asleep, 0, memory_order_relaxed);
+    }
+    return nready;
+}
+
+// Receives the ack and the fd of shm_send_fd.
+static bool recv_fd(int sock, int *fd)
+{
+    char ack;
+    struct iovec iov = {.iov_base = &ack, .iov_len = 1};
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || ack != '*') {
+        return false;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+        return false;
+    }
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return true;
+}
+
+static void *map_fd(int fd, size_t size)
+{
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+bool shm_client_connect(shm_client_t *c, const char *path)
+{
+    memset(c, 0, sizeof(*c));
+    c->spin_us = shm_spin_us();
+
+    // As in utils.c: '@' stands for the abstract namespace's leading NUL.
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, path, len);
+    socklen_t addrlen = offsetof(struct sockaddr_un, sun_path) + len + 1;
+    if (path[0] == '@') {
+        addr.sun_path[0] = '\0';
+        addrlen--;
+    }
+
+    c->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int fd;
+    if (c->sock < 0 || connect(c->sock, (struct sockaddr *)&addr, addrlen) < 0 ||
+        !recv_fd(c->sock, &fd)) {
+        close(c->sock);
+        return false;
+    }
+    c->channel = map_fd(fd, sizeof(shm_channel_t));
+    if (c->channel == NULL || c->channel->magic != SHM_CHANNEL_MAGIC) {
+        shm_client_close(c);
+        return false;
+    }
+    return true;
+}
+
+void shm_client_close(shm_client_t *c)
+{
+    if (c->channel != NULL) {
+        munmap(c->channel, sizeof(shm_channel_t));
+    }
+    close(c->sock);
+    memset(c, 0, sizeof(*c));
+    c->sock = -1;
+}
+
+static bool server_gone(shm_client_t *c)
+{
+    struct pollfd pfd = {.fd = c->sock, .events = POLLIN | POLLRDHUP};
+    return poll(&pfd, 1, 0) != 0;
+}
+
+// The server's side of shm_wake: it sleeps in epoll, so a byte on the
+// socket wakes it. A full socket buffer means it has bytes to wake to
+// already.
+static void wake_server(shm_client_t *c)
+{
+    _Atomic uint32_t *asleep = &c->channel->server_asleep;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(asleep, memory_order_relaxed) != 0 &&
+        atomic_exchange_explicit(asleep, 0, memory_order_relaxed) != 0) {
+        send(c->sock, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+}
+
+static bool can_send(void *arg)
+{
+    return shmring_writable(&((shm_client_t *)arg)->channel->requests) > 0;
+}
+
+static bool can_recv(void *arg)
+{
+    return shmring_readable(&((shm_client_t *)arg)->channel->responses) > 0;
+}
+
+// Spins for spin_us, then sleeps, until ready(c). Returns false if the
+// server went away meanwhile.
+static bool client_wait(shm_client_t *c, bool (*ready)(void *arg))
+{
+    uint64_t deadline = now_ns() + (uint64_t)c->spin_us * 1000;
+    for (int n = 0; !ready(c); n++) {
+        if ((n & 63) != 0 || now_ns() < deadline) {
+            cpu_relax();
+            continue;
+        }
+        shm_sleep(&c->channel->client_asleep, ready, c, CLIENT_CHECK_MS);
+        if (!ready(c) && server_gone(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool shm_client_send(shm_client_t *c, const void *buf, size_t len)
+{
+    while (len > 0) {
+        if (!client_wait(c, can_send)) {
+            return false;
+        }
+        size_t n = shmring_write(&c->channel->requests, buf, len);
+        wake_server(c);
+        buf = (const uint8_t *)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+size_t shm_client_recv(shm_client_t *c, void *buf, size_t len)
+{
+    if (!client_wait(c, can_recv)) {
+        return 0;
+    }
+    size_t n = shmring_read(&c->channel->responses, buf, len);
+    // The server may be waiting for the room.
+    wake_server(c);
+    return n;
+}
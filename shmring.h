@@ -0,0 +1,117 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+// Shared-memory transport for clients on the same host.
+//
+// Even over a Unix socket every message costs a send and a recv syscall on
+// each side. Here a client and the server share a memfd region, a channel,
+// holding two single-producer, single-consumer byte rings: requests from the
+// client and responses back. Each side moves data with plain loads and
+// stores, and only makes a syscall to wake the other if it went to sleep:
+// a side that runs out of work spins for a while (SHM_SPIN_US, 50 by
+// default, none on a single CPU), then announces in the channel that it
+// sleeps, and the other side, after making progress, wakes it only when the
+// channel says so. The client sleeps on a futex word. The server serves all
+// its channels from one thread, so it sleeps in epoll on its clients' Unix
+// sockets instead, having set a flag in every channel; a client that finds
+// its channel's flag set wakes the server by sending a byte over its socket.
+//
+// Handshake: the client connects to the server's Unix socket and gets the
+// channel's fd with SCM_RIGHTS, along with the '*' ack byte. From there on
+// the rings carry the byte stream the socket would have, and the server runs
+// protocol.c's engine on it (see shm-server.c). The client keeps the socket
+// open for as long as the session lasts; closing it ends the session, and
+// the server going away shows up as it closing.
+//
+// Nothing in shared memory is shared between sessions. The memfd is sealed
+// at its size; positions are free-running 32-bit byte counts, only ever
+// masked to index the ring; and a wake-up a client suppresses is one meant
+// for itself. So whatever a misbehaving client writes into the shared memory
+// can only stall or garble its own session, and what it sends over its
+// socket costs the server no more than it would from a socket client.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+// Bytes per ring; a power of two.
+#define SHMRING_SIZE (64 * 1024)
+
+#define SHM_CHANNEL_MAGIC 0x5e4d4348
+
+typedef struct {
+    // Bytes ever written, by the producer, and read, by the consumer, on
+    // separate cache lines.
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+    _Atomic uint32_t head __attribute__((aligned(64)));
+    uint8_t data[SHMRING_SIZE] __attribute__((aligned(64)));
+} shmring_t;
+
+typedef struct {
+    uint32_t magic;
+    // Nonzero while the client sleeps on it, waiting on either ring.
+    _Atomic uint32_t client_asleep __attribute__((aligned(64)));
+    // Nonzero while the server sleeps, waiting on all its channels.
+    _Atomic uint32_t server_asleep __attribute__((aligned(64)));
+    shmring_t requests;
+    shmring_t responses;
+} shm_channel_t;
+
+// Bytes the consumer can read, and the producer can write.
+uint32_t shmring_readable(shmring_t *r);
+uint32_t shmring_writable(shmring_t *r);
+
+// Copy up to len bytes in or out and return how many.
+size_t shmring_write(shmring_t *r, const void *buf, size_t len);
+size_t shmring_read(shmring_t *r, void *buf, size_t len);
+
+// Wakes the side sleeping on asleep, if it is; costs one load if it isn't.
+// Call after making data or space available to it.
+void shm_wake(_Atomic uint32_t *asleep);
+
+// Sleeps on asleep until woken, unless ready(arg) turns out true once the
+// word is set, so that a wake racing with falling asleep isn't lost; or for
+// at most timeout_ms, if not negative.
+void shm_sleep(_Atomic uint32_t *asleep, bool (*ready)(void *arg), void *arg, int timeout_ms);
+
+// SHM_SPIN_US from the environment; if unset, 50, or 0 on a single CPU.
+int shm_spin_us(void);
+
+// Creates a memfd of size bytes, sealed at that size so that whoever it is
+// passed to can't shrink it under the mapping, and maps it; returns the fd
+// and sets *addr, or exits.
+int shm_create(const char *name, size_t size, void **addr);
+
+// Server side of the handshake: passes the channel fd over the Unix socket
+// sock, along with the ack. Returns false if the client is gone.
+bool shm_send_fd(int sock, int channel_fd);
+
+// The server's shm_sleep: sets server_asleep in each of the n channels and,
+// unless ready(arg) turns out true once they are set, waits in epoll_wait on
+// epollfd, which should hold the clients' sockets, for at most timeout_ms
+// if not negative. Clears the flags again, so that clients don't wake a
+// server that is up, and returns what epoll_wait did (0 if it didn't wait).
+int shm_server_sleep(shm_channel_t **channels, int n, bool (*ready)(void *arg), void *arg,
+                     int epollfd, struct epoll_event *events, int maxevents, int timeout_ms);
+
+typedef struct {
+    int sock;
+    shm_channel_t *channel;
+    int spin_us;
+} shm_client_t;
+
+// Client side: connects to the server's Unix socket at path ('@' for the
+// abstract namespace), maps what it sends and checks the ack. Returns false
+// if any of that fails.
+bool shm_client_connect(shm_client_t *c, const char *path);
+void shm_client_close(shm_client_t *c);
+
+// Blocking send and receive over the rings. shm_client_send returns true
+// once all len bytes are in, shm_client_recv the bytes it got, at least one;
+// they return false and 0 if the server has gone.
+bool shm_client_send(shm_client_t *c, const void *buf, size_t len);
+size_t shm_client_recv(shm_client_t *c, void *buf, size_t len);
+
+#endif
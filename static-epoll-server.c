@@ -0,0 +1,84 @@
+// epoll-server with its event loop specialized at compile time.
+//
+// usage: static-epoll-server [port] [num_event_loops]
+//
+// Serves the protocol.h handlers from loops instantiated by
+// reactor-static.h, one level-triggered and one edge-triggered; POLLER=epoll
+// (the default) or epoll-et picks one at startup. It links with protocol.c,
+// utils.c, logger.c, metrics.c, busypoll.c and capture.c, none of reactor.c;
+// build it with -flto to have the handlers inlined into the loop too (see
+// bench-static.sh).
+// There is no hot restart or stats endpoint; see reactor-static.h.
+// UNIX_SOCKET adds a Unix socket listener, as for the other servers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+#include "protocol.h"
+#include "utils.h"
+
+#define REACTOR_STATIC_NAME echo_level
+#define REACTOR_STATIC_EDGE 0
+#define REACTOR_STATIC_MAXFDS MAXFDS
+#define REACTOR_STATIC_CONNECTED on_peer_connected
+#define REACTOR_STATIC_RECV on_peer_ready_recv
+#define REACTOR_STATIC_SEND on_peer_ready_send
+#define REACTOR_STATIC_ERROR on_peer_error
+#define REACTOR_STATIC_CLOSED on_peer_closed
+#include "reactor-static.h"
+
+#define REACTOR_STATIC_NAME echo_edge
+#define REACTOR_STATIC_EDGE 1
+#define REACTOR_STATIC_MAXFDS MAXFDS
+#define REACTOR_STATIC_CONNECTED on_peer_connected
+#define REACTOR_STATIC_RECV on_peer_ready_recv
+#define REACTOR_STATIC_SEND on_peer_ready_send
+#define REACTOR_STATIC_ERROR on_peer_error
+#define REACTOR_STATIC_CLOSED on_peer_closed
+#include "reactor-static.h"
+
+int main(int argc, const char **argv)
+{
+    logger_init(LOG_LEVEL_INFO);
+
+    int portnum = 9090;
+    if (argc >= 2) {
+        portnum = atoi(argv[1]);
+    }
+    int num_threads = 1;
+    if (argc >= 3) {
+        num_threads = atoi(argv[2]);
+        if (num_threads < 1) {
+            num_threads = 1;
+        }
+    }
+    const char *poller = getenv("POLLER");
+    if (poller == NULL) {
+        poller = "epoll";
+    }
+    if (strcmp(poller, "epoll") != 0 && strcmp(poller, "epoll-et") != 0) {
+        fprintf(stderr, "static-epoll-server only has POLLER=epoll and epoll-et\n");
+        exit(1);
+    }
+
+    log_info("listening on port %d, backlog %d", portnum, listen_backlog());
+    int listen_fd = listen_inet_socket(portnum);
+    make_socket_non_blocking(listen_fd);
+
+    int unix_fd = -1;
+    const char *unix_path = getenv("UNIX_SOCKET");
+    if (unix_path != NULL) {
+        unix_fd = listen_unix_socket(unix_path);
+        make_socket_non_blocking(unix_fd);
+        log_info("listening on Unix socket %s", unix_path);
+    }
+
+    log_info("running %d specialized %s event loop(s)", num_threads, poller);
+    if (strcmp(poller, "epoll-et") == 0) {
+        echo_edge_run(listen_fd, unix_fd, num_threads);
+    } else {
+        echo_level_run(listen_fd, unix_fd, num_threads);
+    }
+    return 0;
+}
@@ -3,7 +3,22 @@
 //
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
+//
+// Serving threads are cached: one that finishes its connection parks itself
+// for the next one instead of exiting, so short connections don't pay for
+// thread creation and teardown. Tunables (environment):
+//   THREAD_STACK_KB   stack size of serving threads; default 64, 0 for the
+//                     system default (usually 8 MB)
+//   THREAD_PRESPAWN   threads started and parked up front, at most
+//                     THREAD_CACHE_MAX; default 0
+//   THREAD_CACHE_MAX  most threads kept parked; default 256
+//   CAPTURE_PATH      record incoming traffic for replay; see capture.h
+//   UNIX_SOCKET       also accept on this Unix socket, from a thread of its
+//                     own; see listen_unix_socket
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,107 +27,200 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "logger.h"
+#include "probes.h"
+#include "serve.h"
 #include "utils.h"
 
-typedef struct { int sockfd; } thread_config_t;
-typedef enum { WAIT_FOR_MSG, IN_MSG } ProcessingState;
+#define DEFAULT_STACK_KB 64
+#define DEFAULT_CACHE_MAX 256
 
-void serve_connection(int sockfd)
-{
-    if (send(sockfd, "*", 1, 0) < 1) {
-        perror("send");
-        exit(1);
-    }
+// How long an acceptor waits when out of descriptors before trying again.
+#define ACCEPT_BACKOFF_MS 100
 
-    ProcessingState state = WAIT_FOR_MSG;
+// A serving thread. sockfd is its connection, or -1 while it's parked in
+// the cache; both are only touched under cache_lock.
+typedef struct worker {
+    pthread_cond_t cond;
+    int sockfd;
+    struct worker *next;
+} worker_t;
 
-    while (1) {
-        uint8_t buf[1024];
-        int len = recv(sockfd, buf, sizeof(buf), 0);
-        if (len < 0) {
-            perror("recv");
-            exit(1);
-        } else if (len == 0) {
-            break;
-        }
-    
-        for (int i=0; i<len; ++i) {
-            switch (state) {
-            case WAIT_FOR_MSG:
-                if (buf[i] == '^') {
-                    state = IN_MSG;
-                }
-                break;
-            case IN_MSG:
-                if (buf[i] == '$') {
-                    state = WAIT_FOR_MSG;
-                } else {
-                    buf[i] += 1;
-                    if (send(sockfd, &buf[i], 1, 0) < 1) {
-                        perror("send error");
-                        exit(1);
-                        close(sockfd);
-                        return;
-                    }
-                }
-                break;
-            }
-        }
-    }
-    close(sockfd);
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static worker_t *idle_workers;
+static int num_idle;
+static int cache_max = DEFAULT_CACHE_MAX;
+static pthread_attr_t thread_attr;
+
+static int env_int(const char *name, int default_value)
+{
+    const char *value = getenv(name);
+    return value != NULL ? atoi(value) : default_value;
 }
 
 void* server_thread(void* arg) {
-    thread_config_t *config = (thread_config_t *)arg;
-    int sockfd = config->sockfd;
-    free(config);
+    worker_t *w = arg;
 
     // This cast will work for Linux, but in general casting pthread_id to an
     // integral type isn't portable.
     unsigned long id = (unsigned long)pthread_self();
-    printf("Thread %lu created to handle connection with socket %d\n", id, sockfd);
-    serve_connection(sockfd);
-    printf("Thread %lu done\n", id);
+
+    while (1) {
+        pthread_mutex_lock(&cache_lock);
+        while (w->sockfd < 0) {
+            pthread_cond_wait(&w->cond, &cache_lock);
+        }
+        int sockfd = w->sockfd;
+        pthread_mutex_unlock(&cache_lock);
+
+        log_info("Thread %lu serving socket %d", id, sockfd);
+        serve_connection(sockfd);
+        log_info("Thread %lu done", id);
+
+        pthread_mutex_lock(&cache_lock);
+        if (num_idle >= cache_max) {
+            pthread_mutex_unlock(&cache_lock);
+            break;
+        }
+        w->sockfd = -1;
+        w->next = idle_workers;
+        idle_workers = w;
+        num_idle++;
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    pthread_cond_destroy(&w->cond);
+    free(w);
     return 0;
 }
 
-int main(int argc, char **argv)
+// Starts a serving thread for sockfd, or a parked one if sockfd is -1.
+static void spawn_worker(int sockfd)
 {
-    setvbuf(stdout, NULL, _IONBF, 0);
+    worker_t *w = malloc(sizeof(*w));
+    if (!w) {
+        perror("OOM");
+        exit(1);
+    }
+    pthread_cond_init(&w->cond, NULL);
+    w->sockfd = sockfd;
+    if (sockfd < 0) {
+        pthread_mutex_lock(&cache_lock);
+        w->next = idle_workers;
+        idle_workers = w;
+        num_idle++;
+        pthread_mutex_unlock(&cache_lock);
+    }
 
-    int portnum = 9090;
-    if (argc >= 2) {
-        portnum = atoi(argv[1]);
+    pthread_t the_thread;
+    if (pthread_create(&the_thread, &thread_attr, server_thread, w) != 0) {
+        perror("pthread_create");
+        exit(1);
     }
-    printf("Serving on port %d\n", portnum);
-    fflush(stdout);
+}
 
-    int sockfd = listen_inet_socket(portnum);
+// Hands sockfd to a parked thread if there is one, else starts a new thread.
+static void dispatch_connection(int sockfd)
+{
+    pthread_mutex_lock(&cache_lock);
+    worker_t *w = idle_workers;
+    if (w != NULL) {
+        idle_workers = w->next;
+        num_idle--;
+        w->sockfd = sockfd;
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (w == NULL) {
+        spawn_worker(sockfd);
+    }
+}
+
+// Accepts connections on the listener in arg forever.
+static void *accept_loop(void *arg)
+{
+    int sockfd = (int)(intptr_t)arg;
+    bool out_of_fds = false;
 
     while(1) {
-        struct sockaddr_in peer_addr;
+        struct sockaddr_storage peer_addr;
         socklen_t peer_addr_len = sizeof(peer_addr);
 
         int newfd = accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
         if (newfd < 0) {
-            perror("ERROR on accept");
+            if (errno == EMFILE || errno == ENFILE) {
+                // The connection stays queued, so accept would fail again at
+                // once; wait for some to close, warning once per shortage.
+                if (!out_of_fds) {
+                    log_warn("accept: %s; retrying every %d ms", strerror(errno),
+                             ACCEPT_BACKOFF_MS);
+                    out_of_fds = true;
+                }
+                usleep(ACCEPT_BACKOFF_MS * 1000);
+            } else {
+                perror("ERROR on accept");
+            }
+            continue;
         }
+        out_of_fds = false;
 
-        report_peer_connected(&peer_addr, peer_addr_len);
-        pthread_t the_thread;
+        tune_accepted_socket(newfd);
+        PROBE1(accept, newfd);
+        report_peer_connected(newfd, (struct sockaddr*)&peer_addr, peer_addr_len);
+        dispatch_connection(newfd);
+    }
+    return NULL;
+}
 
-        thread_config_t* config = (thread_config_t*)malloc(sizeof(*config));
-        if (!config) {
-            perror("OOM");
-            exit(1);
+int main(int argc, char **argv)
+{
+    logger_init(LOG_LEVEL_INFO);
+
+    int portnum = 9090;
+    if (argc >= 2) {
+        portnum = atoi(argv[1]);
+    }
+
+    // Serving threads are detached - when one exits, its resources are
+    // cleaned up. Since the main thread lives forever, it outlives them.
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    int stack_kb = env_int("THREAD_STACK_KB", DEFAULT_STACK_KB);
+    if (stack_kb > 0) {
+        size_t stack_size = (size_t)stack_kb * 1024;
+        if (stack_size < PTHREAD_STACK_MIN) {
+            stack_size = PTHREAD_STACK_MIN;
         }
+        pthread_attr_setstacksize(&thread_attr, stack_size);
+    }
+    cache_max = env_int("THREAD_CACHE_MAX", DEFAULT_CACHE_MAX);
+    int prespawn = env_int("THREAD_PRESPAWN", 0);
+    if (prespawn > cache_max) {
+        // The extra threads would only exit the first time they park.
+        log_warn("THREAD_PRESPAWN %d is over THREAD_CACHE_MAX; prespawning %d", prespawn,
+                 cache_max);
+        prespawn = cache_max;
+    }
+    for (int i = 0; i < prespawn; i++) {
+        spawn_worker(-1);
+    }
+    log_info("Serving on port %d (stack %d KB, %d threads prespawned, cache %d)",
+             portnum, stack_kb, prespawn, cache_max);
 
-        config->sockfd = newfd;
-        pthread_create(&the_thread, NULL, server_thread, config);
+    int sockfd = listen_inet_socket(portnum);
 
-        // Detach the thread - when it's done, its resources will be cleaned up.
-        // Since the main thread lives forever, it will outlive the serving threads.
-        pthread_detach(the_thread);
+    const char *unix_path = getenv("UNIX_SOCKET");
+    if (unix_path != NULL) {
+        int unix_fd = listen_unix_socket(unix_path);
+        log_info("Serving on Unix socket %s", unix_path);
+        pthread_t the_thread;
+        if (pthread_create(&the_thread, &thread_attr, accept_loop, (void *)(intptr_t)unix_fd) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
     }
+
+    accept_loop((void *)(intptr_t)sockfd);
     return 0;
-}
\ No newline at end of file
+}
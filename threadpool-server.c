@@ -3,42 +3,119 @@
 //
 // Eli Bendersky [http://eli.thegreenplace.net]
 // This code is in the public domain.
+//
+// When connections wait too long for a pool thread, new ones, and queued ones
+// past the target, are turned away with a '!' (busy) byte in place of the
+// '*' ack and closed, instead of queueing without bound, even while
+// long-lived connections hold every pool thread; see tpool_shed_config_t.
+// Environment:
+//   SHED_TARGET_MS    acceptable queueing delay; default 5, 0 disables
+//   SHED_INTERVAL_MS  how long it may be exceeded before shedding; default 100
+//   MAX_QUEUE         hard cap on queued connections; default 0 (none)
+//   WORK_US           simulated work per connection before the ack, for load
+//                     tests; default 0
+//   TPOOL_TRACE_FILE  with tpool.c built with -DTPOOL_TRACE, SIGUSR2 logs the
+//                     pool's latency histograms and writes its Chrome trace
+//                     here
+//   UNIX_SOCKET       also accept on this Unix socket; see listen_unix_socket
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "capture.h"
+#include "logger.h"
+#include "metrics.h"
+#include "probes.h"
 #include "utils.h"
 #include "tpool.h"
 
+// How long the acceptor waits when out of descriptors and unable to turn the
+// pending connection away, before trying again.
+#define ACCEPT_BACKOFF_MS 100
+
 static const int num_threads = 4;
 
+// Bytes taken per recv; each worker keeps a buffer this size in its arena.
+#define RECV_BATCH 16384
+
+static int work_us;
+
 typedef struct { int sockfd; } thread_config_t;
 typedef enum { WAIT_FOR_MSG, IN_MSG } ProcessingState;
 
+// Closes the connection on a peer reset, exits on any other send error.
+static bool send_all(int sockfd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(sockfd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == ECONNRESET || errno == EPIPE) {
+                return false;
+            }
+            perror("send error");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
 void serve_connection(int sockfd)
 {
-    if (send(sockfd, "*", 1, 0) < 1) {
+    uint32_t conn = capture_open_conn();
+
+    if (send(sockfd, "*", 1, MSG_NOSIGNAL) < 1) {
+        if (errno == ECONNRESET || errno == EPIPE) {
+            capture_close_conn(conn);
+            close(sockfd);
+            metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+            return;
+        }
         perror("send");
         exit(1);
     }
 
+    // From the worker's arena when run by the pool; the stack otherwise.
+    uint8_t stack_buf[1024];
+    uint8_t *buf = tpool_scratch(RECV_BATCH);
+    size_t buf_size = RECV_BATCH;
+    if (buf == NULL) {
+        buf = stack_buf;
+        buf_size = sizeof(stack_buf);
+    }
+
     ProcessingState state = WAIT_FOR_MSG;
 
     while (1) {
-        uint8_t buf[1024];
-        int len = recv(sockfd, buf, sizeof(buf), 0);
+        int len = recv(sockfd, buf, buf_size, 0);
         if (len < 0) {
+            if (errno == ECONNRESET) {
+                break;
+            }
             perror("recv");
             exit(1);
         } else if (len == 0) {
             break;
         }
-    
+        capture_data(conn, buf, len);
+        uint64_t start_ns = metrics_now_ns();
+        metrics_add(METRIC_BYTES_RECEIVED, len);
+
+        // The reply is built over the bytes already consumed and sent in
+        // one go.
+        size_t out = 0;
         for (int i=0; i<len; ++i) {
             switch (state) {
             case WAIT_FOR_MSG:
@@ -49,34 +126,62 @@ void serve_connection(int sockfd)
             case IN_MSG:
                 if (buf[i] == '$') {
                     state = WAIT_FOR_MSG;
+                    metrics_add(METRIC_MESSAGES, 1);
                 } else {
-                    buf[i] += 1;
-                    if (send(sockfd, &buf[i], 1, 0) < 1) {
-                        perror("send error");
-                        exit(1);
-                        close(sockfd);
-                        return;
-                    }
+                    buf[out++] = buf[i] + 1;
                 }
                 break;
             }
         }
+        if (out > 0) {
+            metrics_add(METRIC_BYTES_SENT, out);
+            if (!send_all(sockfd, buf, out)) {
+                break;
+            }
+        }
+        if (start_ns != 0) {
+            metrics_observe(HIST_MESSAGE_PROCESSING_NS, metrics_now_ns() - start_ns);
+        }
     }
+    capture_close_conn(conn);
+    close(sockfd);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+}
+
+
+// Sends the busy reply and hangs up.
+static void reject_connection(int sockfd)
+{
+    send(sockfd, "!", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
     close(sockfd);
+    metrics_add(METRIC_CONNECTIONS_REJECTED, 1);
 }
 
+// Runs instead of server_thread for connections the pool sheds.
+static void shed_connection(void* arg) {
+    thread_config_t *config = (thread_config_t *)arg;
+    int sockfd = config->sockfd;
+    free(config);
+
+    log_debug("shedding connection with socket %d", sockfd);
+    reject_connection(sockfd);
+}
 
 void server_thread(void* arg) {
     thread_config_t *config = (thread_config_t *)arg;
     int sockfd = config->sockfd;
     free(config);
 
+    if (work_us > 0) {
+        usleep(work_us);
+    }
+
     // This cast will work for Linux, but in general casting pthread_id to an
     // integral type isn't portable.
     unsigned long id = (unsigned long)pthread_self();
-    printf("Thread %lu created to handle connection with socket %d\n", id, sockfd);
+    log_info("Thread %lu created to handle connection with socket %d", id, sockfd);
     serve_connection(sockfd);
-    printf("Thread %lu done\n", id);
+    log_info("Thread %lu done", id);
     return;
 }
 
@@ -84,16 +189,16 @@ void server_thread(void* arg) {
 void* wait_for_client(void* arg) {
     
     unsigned long id = (unsigned long)pthread_self();
-    printf("Thread %lu created waiting for connection.\n", id);
+    log_info("Thread %lu created waiting for connection.", id);
     thread_config_t* config = (thread_config_t*)arg;
     int sockfd = config->sockfd;
 
-    struct sockaddr_in peer_addr;
+    struct sockaddr_storage peer_addr;
     socklen_t peer_addr_len = sizeof(peer_addr);
     int newfd = accept(sockfd, (struct sockaddr*)&peer_addr, &peer_addr_len);
 
     id = (unsigned long)pthread_self();
-    printf("Thread %lu handling connection with socket %d\n", id, newfd);
+    log_info("Thread %lu handling connection with socket %d", id, newfd);
 
     while(1) {
         if (newfd < 0) {
@@ -101,47 +206,208 @@ void* wait_for_client(void* arg) {
             exit(1);
         }
         config->sockfd = newfd;
-        report_peer_connected(&peer_addr, peer_addr_len);
+        tune_accepted_socket(newfd);
+        report_peer_connected(newfd, (struct sockaddr*)&peer_addr, peer_addr_len);
         server_thread(config);
-        printf("returned from server_thread\n");
+        log_debug("returned from server_thread");
+    }
+
+    log_info("Thread %lu done", id);
+}
+
+static uint64_t tpool_queue_gauge(void *arg)
+{
+    return tpool_queue_len(arg);
+}
+
+// Blocks SIGUSR2 in this thread, and so in the threads it creates after, and
+// returns a descriptor that reads it instead.
+static int trace_signal_fd(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        perror("signalfd");
+        exit(1);
     }
+    return fd;
+}
 
-    printf("Thread %lu done\n", id);
+static void log_tpool_hist(const char *name, const tpool_hist_t *h)
+{
+    log_info("tpool %-10s n=%" PRIu64 " mean=%" PRIu64 "ns p50<=%" PRIu64 "ns p99<=%" PRIu64
+             "ns max=%" PRIu64 "ns", name, h->count, h->count ? h->sum_ns / h->count : 0,
+             tpool_hist_percentile(h, 50), tpool_hist_percentile(h, 99), h->max_ns);
+}
+
+static void report_tpool_trace(int sigfd, tpool_t *tp, const char *path)
+{
+    struct signalfd_siginfo info;
+    while (read(sigfd, &info, sizeof(info)) == sizeof(info)) {
+    }
+
+    tpool_stats_t *stats = tpool_get_stats(tp);
+    if (stats == NULL) {
+        log_warn("tpool tracing is not compiled in; build tpool.c with -DTPOOL_TRACE");
+        return;
+    }
+    log_tpool_hist("queue wait", &stats->queue_wait);
+    log_tpool_hist("run", &stats->run);
+    log_tpool_hist("shed", &stats->shed);
+    log_tpool_hist("lock wait", &stats->lock_wait);
+    log_tpool_hist("lock hold", &stats->lock_hold);
+    for (size_t i = 0; i < stats->num_workers; i++) {
+        log_info("tpool worker %zu: %" PRIu64 " tasks, %.1f%% busy", i,
+                 stats->workers[i].tasks, stats->workers[i].utilization * 100);
+    }
+    free(stats);
+
+    if (tpool_trace_dump(tp, path)) {
+        log_info("wrote tpool trace to %s", path);
+    } else {
+        log_error("couldn't write tpool trace to %s", path);
+    }
+}
+
+// Accepts one connection from sockfd and queues it for the pool, or turns it
+// away if the pool is shedding or full.
+static void accept_connection(tpool_t *tp, int sockfd)
+{
+    struct sockaddr_storage peer_addr;
+    socklen_t peer_addr_len = sizeof(peer_addr);
+    int newfd = accept(sockfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
+    if (newfd < 0) {
+        if (errno == EMFILE || errno == ENFILE) {
+            // Every queued connection holds a descriptor, so this is what
+            // overload looks like: turn the pending one away, as shedding
+            // would, rather than leave it queued.
+            if (!accept_drop_pending(sockfd)) {
+                usleep(ACCEPT_BACKOFF_MS * 1000);
+            }
+        } else if (errno != ECONNABORTED && errno != EINTR) {
+            perror("ERROR on accept");
+            exit(1);
+        }
+        return;
+    }
+    tune_accepted_socket(newfd);
+    report_peer_connected(newfd, (struct sockaddr*)&peer_addr, peer_addr_len);
+    metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+    PROBE1(accept, newfd);
+
+    // While the pool is shedding, don't even queue new connections.
+    if (tpool_overloaded(tp)) {
+        reject_connection(newfd);
+        return;
+    }
+
+    // Each task owns (and frees) its own config.
+    thread_config_t* config = (thread_config_t*)malloc(sizeof(*config));
+    if (!config) {
+        perror("OOM");
+        exit(1);
+    }
+    config->sockfd = newfd;
+    if (!tpool_add_work_sheddable(tp, server_thread, shed_connection, config)) {
+        free(config);
+        reject_connection(newfd);
+    }
 }
 
 int main(int argc, char **argv)
 {
     tpool_t *tp;
 
-    setvbuf(stdout, NULL, _IONBF, 0);
+    // Before any thread is started, so that all of them inherit the mask.
+    const char *trace_file = getenv("TPOOL_TRACE_FILE");
+    int sigfd = trace_file != NULL ? trace_signal_fd() : -1;
+
+    logger_init(LOG_LEVEL_INFO);
 
     int portnum = 9090;
     if (argc >= 2) {
         portnum = atoi(argv[1]);
     }
-    printf("Serving on port %d\n", portnum);
-    fflush(stdout);
+    log_info("Serving on port %d", portnum);
 
     int sockfd = listen_inet_socket(portnum);
+    tpool_options_t opts = {.arena_size = RECV_BATCH};
+    tp = tpool_create_opts(num_threads, &opts);
 
-    thread_config_t* config = (thread_config_t*)malloc(sizeof(*config));
-    if (!config) {
-        perror("OOM");
-        exit(1);
+    tpool_shed_config_t shed = {
+        .target_ns = 5 * 1000000ull,
+        .interval_ns = 100 * 1000000ull,
+    };
+    if (getenv("SHED_TARGET_MS") != NULL) {
+        shed.target_ns = atoi(getenv("SHED_TARGET_MS")) * 1000000ull;
+    }
+    if (getenv("SHED_INTERVAL_MS") != NULL) {
+        shed.interval_ns = atoi(getenv("SHED_INTERVAL_MS")) * 1000000ull;
+    }
+    if (getenv("MAX_QUEUE") != NULL) {
+        shed.max_queue = atoi(getenv("MAX_QUEUE"));
+    }
+    if (getenv("WORK_US") != NULL) {
+        work_us = atoi(getenv("WORK_US"));
+    }
+    tpool_set_shedding(tp, &shed);
+
+    // With STATS_PORT set, the accept loop also serves the metrics endpoint,
+    // with TPOOL_TRACE_FILE it takes SIGUSR2, and with UNIX_SOCKET it accepts
+    // there too.
+    struct pollfd pfds[4] = {{.fd = sockfd, .events = POLLIN},
+                             {.fd = -1, .events = POLLIN},
+                             {.fd = sigfd, .events = POLLIN},
+                             {.fd = -1, .events = POLLIN}};
+    const char *stats_port = getenv("STATS_PORT");
+    if (stats_port != NULL) {
+        metrics_enable();
+        metrics_register_gauge("server_tpool_queue_length", tpool_queue_gauge, tp);
+        pfds[1].fd = metrics_listen(atoi(stats_port));
+        log_info("Serving stats on port %d", atoi(stats_port));
+    }
+    const char *unix_path = getenv("UNIX_SOCKET");
+    if (unix_path != NULL) {
+        pfds[3].fd = listen_unix_socket(unix_path);
+        log_info("Serving on Unix socket %s", unix_path);
     }
-    tp = tpool_create(num_threads);
-    config->sockfd = sockfd;
+
+    // With shedding on, the loop also wakes up every SHED_TARGET_MS to shed
+    // the connections that have been queued longer: once long-lived ones
+    // hold every worker, nothing is dequeued, and they would wait forever.
+    int timeout_ms = -1;
+    if (shed.target_ns != 0) {
+        timeout_ms = shed.target_ns >= 1000000 ? shed.target_ns / 1000000 : 1;
+    }
+    accept_reserve_init();
     for (;;) {
-        struct sockaddr_in peer_addr;
-        socklen_t peer_addr_len = sizeof(peer_addr);
-        int newfd = accept(sockfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
-        if (newfd < 0) {
-            perror("ERROR on accept");
+        if (timeout_ms < 0 && pfds[1].fd < 0 && pfds[2].fd < 0 && pfds[3].fd < 0) {
+            accept_connection(tp, sockfd);
+            continue;
+        }
+        tpool_shed_expired(tp);
+        if (poll(pfds, 4, timeout_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
             exit(1);
         }
-        report_peer_connected(&peer_addr, peer_addr_len);
-        config->sockfd = newfd;
-        tpool_add_work(tp, server_thread, config);
+        if (pfds[1].revents & POLLIN) {
+            metrics_serve_pending(pfds[1].fd);
+        }
+        if (pfds[2].revents & POLLIN) {
+            report_tpool_trace(sigfd, tp, trace_file);
+        }
+        if (pfds[0].revents & POLLIN) {
+            accept_connection(tp, sockfd);
+        }
+        if (pfds[3].revents & POLLIN) {
+            accept_connection(tp, pfds[3].fd);
+        }
     }
     tpool_wait(tp);
     return 0;
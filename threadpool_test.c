@@ -8,12 +8,26 @@
 static const size_t num_threads = 4;
 static const size_t num_items   = 100;
 
+// Each worker's count of the tasks it ran, kept in its worker-local context.
+static void *worker_init(void *arg)
+{
+    return calloc(1, sizeof(size_t));
+}
+
+static void worker_teardown(void *local, void *arg)
+{
+    printf("tid=%lu ran %zu tasks\n", pthread_self(), *(size_t *)local);
+    free(local);
+}
+
 void worker(void *arg)
 {
     int *val = arg;
     int  old = *val;
+    size_t *ran = tpool_worker_local();
 
     *val += 1000;
+    *ran += 1;
     printf("tid=%lu, old=%d, val=%d\n", pthread_self(), old, *val);
 
     usleep(100000);
@@ -24,8 +38,12 @@ int main(int argc, char **argv)
     tpool_t *tm;
     int     *vals;
     size_t   i;
+    tpool_options_t opts = {
+        .init     = worker_init,
+        .teardown = worker_teardown,
+    };
 
-    tm   = tpool_create(num_threads);
+    tm   = tpool_create_opts(num_threads, &opts);
     vals = calloc(num_items, sizeof(*vals));
 
     for (i=0; i<num_items; i++) {
@@ -1,16 +1,31 @@
 #include "tpool.h"
 
+#include <inttypes.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "probes.h"
 
 struct tpool_work {
     thread_func_t func;
+    thread_func_t shed;
     void *arg;
+    uint64_t enqueued_ns;
+#ifdef TPOOL_TRACE
+    uint64_t trace_enqueued; // Ticks.
+    uint64_t trace_id;
+#endif
     struct tpool_work *next;
 };
 typedef struct tpool_work tpool_work_t;
 
+typedef struct tpool_tracer tpool_tracer_t;
+
 struct tpool {
     tpool_work_t *work_first;
     tpool_work_t *work_last;
@@ -19,10 +34,288 @@ struct tpool {
     pthread_cond_t working_cond;
     size_t working_cnt;
     size_t thread_cnt;
+    size_t queued_cnt;
     bool stop;
+
+    // Load shedding; all under work_mutex.
+    tpool_shed_config_t shed;
+    uint64_t first_above_ns; // When the delay will have been high for an interval.
+    uint64_t rearm_until_ns; // Until when a new episode starts at once.
+    bool shedding;
+
+    tpool_options_t opts;
+
+#ifdef TPOOL_TRACE
+    tpool_tracer_t *tracers; // One per worker, then one for everybody else.
+    size_t num_workers;
+    _Atomic size_t next_worker;
+    uint64_t next_task; // Under work_mutex.
+    uint64_t created_ns;
+    uint64_t created_ticks;
+#endif
 };
 
-static tpool_work_t *tpool_work_create(thread_func_t func, void *arg)
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Tracing; see tpool.h. The helpers below are what the pool calls either
+// way, and compile to the bare pthread calls without TPOOL_TRACE.
+typedef enum {
+    TRACE_QUEUE,
+    TRACE_RUN,
+    TRACE_SHED,
+    TRACE_LOCK_WAIT,
+    TRACE_LOCK_HOLD,
+    TRACE_KINDS
+} trace_kind_t;
+
+#ifdef TPOOL_TRACE
+
+#ifndef TPOOL_TRACE_EVENTS
+#define TPOOL_TRACE_EVENTS 16384 // Per ring; a power of two.
+#endif
+
+typedef struct {
+    uint64_t start; // Ticks.
+    uint64_t end;
+    uint64_t task;
+    uint32_t kind;
+} trace_event_t;
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+    _Atomic uint64_t buckets[TPOOL_HIST_BUCKETS];
+} trace_hist_t;
+
+// Only one thread writes to a ring at a time, so head is published with a
+// plain release store; a reader copies the events out and then drops any
+// that head shows may have been overwritten meanwhile.
+struct tpool_tracer {
+    _Atomic uint64_t head;
+    uint64_t held_since;
+    trace_hist_t hists[TRACE_KINDS];
+    trace_event_t *events;
+} __attribute__((aligned(64)));
+
+// ns per tick, 32.32 fixed point.
+static uint64_t ns_per_tick;
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t trace_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now_ns();
+#endif
+}
+
+static void trace_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t ns = now_ns();
+    uint64_t ticks = trace_ticks();
+    struct timespec ts = {.tv_nsec = 10000000};
+    nanosleep(&ts, NULL);
+    ns_per_tick = ((now_ns() - ns) << 32) / (trace_ticks() - ticks);
+#else
+    ns_per_tick = 1ull << 32;
+#endif
+}
+
+static inline uint64_t ticks_to_ns(uint64_t ticks)
+{
+    return (unsigned __int128)ticks * ns_per_tick >> 32;
+}
+
+static inline void trace_bump(_Atomic uint64_t *c, uint64_t n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static void trace_record(tpool_tracer_t *tr, trace_kind_t kind, uint64_t start, uint64_t end,
+                         uint64_t task)
+{
+    uint64_t ns = ticks_to_ns(end - start);
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= TPOOL_HIST_BUCKETS) {
+        bucket = TPOOL_HIST_BUCKETS - 1;
+    }
+    trace_hist_t *h = &tr->hists[kind];
+    trace_bump(&h->count, 1);
+    trace_bump(&h->sum_ns, ns);
+    trace_bump(&h->buckets[bucket], 1);
+    if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+    }
+
+    uint64_t head = atomic_load_explicit(&tr->head, memory_order_relaxed);
+    tr->events[head & (TPOOL_TRACE_EVENTS - 1)] =
+        (trace_event_t){.start = start, .end = end, .task = task, .kind = kind};
+    atomic_store_explicit(&tr->head, head + 1, memory_order_release);
+}
+
+static inline uint64_t trace_now(void)
+{
+    return trace_ticks();
+}
+
+static inline tpool_tracer_t *worker_tracer(tpool_t *tm)
+{
+    return &tm->tracers[atomic_fetch_add(&tm->next_worker, 1)];
+}
+
+static inline tpool_tracer_t *other_tracer(tpool_t *tm)
+{
+    return &tm->tracers[tm->num_workers];
+}
+
+static inline void tpool_lock(tpool_t *tm, tpool_tracer_t *tr)
+{
+    uint64_t start = trace_ticks();
+    pthread_mutex_lock(&(tm->work_mutex));
+    tr->held_since = trace_ticks();
+    trace_record(tr, TRACE_LOCK_WAIT, start, tr->held_since, 0);
+}
+
+static inline void tpool_unlock(tpool_t *tm, tpool_tracer_t *tr)
+{
+    trace_record(tr, TRACE_LOCK_HOLD, tr->held_since, trace_ticks(), 0);
+    pthread_mutex_unlock(&(tm->work_mutex));
+}
+
+static inline void tpool_cond_wait(tpool_t *tm, tpool_tracer_t *tr, pthread_cond_t *cond)
+{
+    trace_record(tr, TRACE_LOCK_HOLD, tr->held_since, trace_ticks(), 0);
+    pthread_cond_wait(cond, &(tm->work_mutex));
+    tr->held_since = trace_ticks();
+}
+
+// Under work_mutex, as the task joins the queue and as a worker takes it.
+static inline void trace_enqueued(tpool_t *tm, tpool_work_t *work)
+{
+    work->trace_id = ++tm->next_task;
+}
+
+static inline void trace_dequeued(tpool_tracer_t *tr, tpool_work_t *work)
+{
+    trace_record(tr, TRACE_QUEUE, work->trace_enqueued, trace_ticks(), work->trace_id);
+}
+
+static inline void trace_task(tpool_tracer_t *tr, trace_kind_t kind, uint64_t start,
+                              tpool_work_t *work)
+{
+    trace_record(tr, kind, start, trace_ticks(), work->trace_id);
+}
+
+// trace_task for a task run off the lock by some other thread than the
+// workers, whose shared tracer is only written under work_mutex.
+static void trace_other_task(tpool_t *tm, trace_kind_t kind, uint64_t start,
+                             tpool_work_t *work)
+{
+    uint64_t end = trace_ticks();
+    tpool_lock(tm, other_tracer(tm));
+    trace_record(other_tracer(tm), kind, start, end, work->trace_id);
+    tpool_unlock(tm, other_tracer(tm));
+}
+
+static void trace_init(tpool_t *tm, size_t num)
+{
+    pthread_once(&calibrate_once, trace_calibrate);
+    tm->num_workers = num;
+    tm->created_ns = now_ns();
+    tm->created_ticks = trace_ticks();
+    tm->tracers = aligned_alloc(64, (num + 1) * sizeof(*tm->tracers));
+    if (tm->tracers == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    memset(tm->tracers, 0, (num + 1) * sizeof(*tm->tracers));
+    for (size_t i = 0; i <= num; i++) {
+        tm->tracers[i].events = calloc(TPOOL_TRACE_EVENTS, sizeof(trace_event_t));
+        if (tm->tracers[i].events == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+    }
+}
+
+static void trace_free(tpool_t *tm)
+{
+    for (size_t i = 0; i <= tm->num_workers; i++) {
+        free(tm->tracers[i].events);
+    }
+    free(tm->tracers);
+}
+
+#else
+
+static inline uint64_t trace_now(void)
+{
+    return 0;
+}
+
+static inline tpool_tracer_t *worker_tracer(tpool_t *tm)
+{
+    return NULL;
+}
+
+static inline tpool_tracer_t *other_tracer(tpool_t *tm)
+{
+    return NULL;
+}
+
+static inline void tpool_lock(tpool_t *tm, tpool_tracer_t *tr)
+{
+    pthread_mutex_lock(&(tm->work_mutex));
+}
+
+static inline void tpool_unlock(tpool_t *tm, tpool_tracer_t *tr)
+{
+    pthread_mutex_unlock(&(tm->work_mutex));
+}
+
+static inline void tpool_cond_wait(tpool_t *tm, tpool_tracer_t *tr, pthread_cond_t *cond)
+{
+    pthread_cond_wait(cond, &(tm->work_mutex));
+}
+
+static inline void trace_enqueued(tpool_t *tm, tpool_work_t *work)
+{
+}
+
+static inline void trace_dequeued(tpool_tracer_t *tr, tpool_work_t *work)
+{
+}
+
+static inline void trace_task(tpool_tracer_t *tr, trace_kind_t kind, uint64_t start,
+                              tpool_work_t *work)
+{
+}
+
+static inline void trace_other_task(tpool_t *tm, trace_kind_t kind, uint64_t start,
+                                    tpool_work_t *work)
+{
+}
+
+static void trace_init(tpool_t *tm, size_t num)
+{
+}
+
+static void trace_free(tpool_t *tm)
+{
+}
+
+#endif
+
+static tpool_work_t *tpool_work_create(thread_func_t func, thread_func_t shed, void *arg)
 {
     tpool_work_t *work;
 
@@ -32,7 +325,12 @@ static tpool_work_t *tpool_work_create(thread_func_t func, void *arg)
     
     work = malloc(sizeof(*work));
     work->func = func;
+    work->shed = shed;
     work->arg = arg;
+    work->enqueued_ns = now_ns();
+#ifdef TPOOL_TRACE
+    work->trace_enqueued = trace_ticks();
+#endif
     work->next = NULL;
     return work;
 }
@@ -58,6 +356,7 @@ static tpool_work_t *tpool_work_get(tpool_t *tm)
         return NULL;
     }
     
+    tm->queued_cnt--;
     if (work->next == NULL) { // If last task in pool
         tm->work_first = NULL;
         tm->work_last = NULL;
@@ -68,47 +367,228 @@ static tpool_work_t *tpool_work_get(tpool_t *tm)
 }
 
 
+// Notes that the queueing delay is above target at now, and returns whether
+// it has stayed there for an interval, i.e. whether the pool is shedding.
+// Must be called with work_mutex held.
+static bool tpool_delay_above(tpool_t *tm, uint64_t now)
+{
+    if (tm->first_above_ns == 0) {
+        // Right after an episode the overload is most likely still there,
+        // so don't wait out another interval to act on it.
+        tm->first_above_ns = now < tm->rearm_until_ns ? now : now + tm->shed.interval_ns;
+    }
+    if (now >= tm->first_above_ns) {
+        tm->shedding = true;
+    }
+    return tm->shedding;
+}
+
+// Notes that the delay is back under target at now, ending any episode.
+// Must be called with work_mutex held.
+static void tpool_delay_gone(tpool_t *tm, uint64_t now)
+{
+    if (tm->shedding) {
+        tm->rearm_until_ns = now + tm->shed.interval_ns;
+        tm->shedding = false;
+    }
+    tm->first_above_ns = 0;
+}
+
+// Decides whether the task just dequeued at now, after waiting sojourn_ns,
+// should be shed. Must be called with work_mutex held.
+static bool tpool_should_shed(tpool_t *tm, uint64_t sojourn_ns, uint64_t now)
+{
+    // A task that got through in time, or an empty queue, means any delay
+    // was a burst that's now gone.
+    if (sojourn_ns < tm->shed.target_ns || tm->queued_cnt == 0) {
+        tpool_delay_gone(tm, now);
+        return false;
+    }
+
+    // CoDel proper drops at an increasing rate to make TCP senders back off;
+    // new connections don't back off, so while the delay stands everything
+    // that has already waited past the target goes.
+    return tpool_delay_above(tm, now);
+}
+
+// Checks the wait of the oldest queued task so far. Dequeues alone can't
+// notice a standing queue when every worker is tied up in a long task, so
+// callers adding or asking about work look at the queue head as well. An
+// empty queue ends shedding, as it does on dequeue; a young head doesn't,
+// since that task may yet wait as long as the rest. Must be called with
+// work_mutex held.
+static void tpool_check_head(tpool_t *tm)
+{
+    if (tm->shed.target_ns == 0) {
+        return;
+    }
+    uint64_t now = now_ns();
+    if (tm->work_first == NULL) {
+        tpool_delay_gone(tm, now);
+    } else if (now - tm->work_first->enqueued_ns >= tm->shed.target_ns) {
+        tpool_delay_above(tm, now);
+    }
+}
+
+// Scratch allocations are rounded up to keep every one of them aligned.
+#define SCRATCH_ALIGN _Alignof(max_align_t)
+
+// A malloc'd allocation that didn't fit the arena.
+typedef struct scratch_overflow {
+    struct scratch_overflow *next;
+    max_align_t data[];
+} scratch_overflow_t;
+
+typedef struct {
+    void *local;
+    uint8_t *arena;
+    size_t arena_size;
+    size_t arena_used;
+    scratch_overflow_t *overflow;
+} tpool_worker_ctx_t;
+
+static __thread tpool_worker_ctx_t *current_worker;
+
+static void worker_start(tpool_t *tm, tpool_worker_ctx_t *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    if (tm->opts.arena_size > 0) {
+        ctx->arena_size = (tm->opts.arena_size + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+        ctx->arena = aligned_alloc(64, (ctx->arena_size + 63) & ~(size_t)63);
+        if (ctx->arena == NULL) {
+            perror("OOM");
+            exit(1);
+        }
+        // Fault it in from this thread, so the pages come from its node.
+        memset(ctx->arena, 0, ctx->arena_size);
+    }
+    if (tm->opts.init != NULL) {
+        ctx->local = tm->opts.init(tm->opts.arg);
+    }
+}
+
+static void worker_scratch_reset(tpool_worker_ctx_t *ctx)
+{
+    ctx->arena_used = 0;
+    while (ctx->overflow != NULL) {
+        scratch_overflow_t *next = ctx->overflow->next;
+        free(ctx->overflow);
+        ctx->overflow = next;
+    }
+}
+
+static void worker_stop(tpool_t *tm, tpool_worker_ctx_t *ctx)
+{
+    if (tm->opts.teardown != NULL) {
+        tm->opts.teardown(ctx->local, tm->opts.arg);
+    }
+    worker_scratch_reset(ctx);
+    free(ctx->arena);
+}
+
+void *tpool_worker_local(void)
+{
+    return current_worker != NULL ? current_worker->local : NULL;
+}
+
+void *tpool_scratch(size_t size)
+{
+    tpool_worker_ctx_t *ctx = current_worker;
+    if (ctx == NULL) {
+        return NULL;
+    }
+    size = (size + SCRATCH_ALIGN - 1) & ~(SCRATCH_ALIGN - 1);
+    if (size <= ctx->arena_size - ctx->arena_used) {
+        void *p = ctx->arena + ctx->arena_used;
+        ctx->arena_used += size;
+        return p;
+    }
+    scratch_overflow_t *o = malloc(sizeof(*o) + size);
+    if (o == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    o->next = ctx->overflow;
+    ctx->overflow = o;
+    return o->data;
+}
+
 static void *tpool_worker(void *arg)
 {
     tpool_t *tm = arg;
+    tpool_tracer_t *tr = worker_tracer(tm);
     tpool_work_t *work;
+    bool shed;
+    tpool_worker_ctx_t ctx;
 
+    worker_start(tm, &ctx);
     while (1) {
-        pthread_mutex_lock(&(tm->work_mutex));
+        tpool_lock(tm, tr);
 
         if (tm->stop) {
             break;
         }
 
         if (tm->work_first == NULL) {
-            pthread_cond_wait(&(tm->work_cond), &(tm->work_mutex));
+            tpool_cond_wait(tm, tr, &(tm->work_cond));
         }
         
 
         work = tpool_work_get(tm);
+        if (work != NULL) {
+            trace_dequeued(tr, work);
+        }
+        shed = false;
+        if (work != NULL && tm->shed.target_ns != 0) {
+            uint64_t now = now_ns();
+            shed = tpool_should_shed(tm, now - work->enqueued_ns, now) && work->shed != NULL;
+        }
         tm->working_cnt++;
-        pthread_mutex_unlock(&(tm->work_mutex));
+        tpool_unlock(tm, tr);
 
         if (work != NULL) {
-            work->func(work->arg);
+            current_worker = &ctx;
+            uint64_t start = trace_now();
+            if (shed) {
+                PROBE1(task_shed, work->enqueued_ns);
+                work->shed(work->arg);
+                trace_task(tr, TRACE_SHED, start, work);
+            } else {
+                PROBE1(task_start, work->enqueued_ns);
+                work->func(work->arg);
+                PROBE0(task_finish);
+                trace_task(tr, TRACE_RUN, start, work);
+            }
+            current_worker = NULL;
+            worker_scratch_reset(&ctx);
             tpool_work_destroy(work);
         }
 
-        pthread_mutex_lock(&(tm->work_mutex));
+        tpool_lock(tm, tr);
         tm->working_cnt--;
         if (tm->work_first == NULL && !tm->stop && tm->working_cnt == 0) {
             pthread_cond_signal(&(tm->working_cond));
         }
-        pthread_mutex_unlock(&(tm->work_mutex));
+        tpool_unlock(tm, tr);
     }
 
+    // Off the lock, but before tpool_destroy can go on: teardown may use
+    // whatever opts.arg points to.
+    tpool_unlock(tm, tr);
+    worker_stop(tm, &ctx);
+    tpool_lock(tm, tr);
     tm->thread_cnt--;
     pthread_cond_signal(&(tm->working_cond));
-    pthread_mutex_unlock(&(tm->work_mutex));
+    tpool_unlock(tm, tr);
     return NULL;
 }
 
 tpool_t *tpool_create(size_t num)
+{
+    return tpool_create_opts(num, NULL);
+}
+
+tpool_t *tpool_create_opts(size_t num, const tpool_options_t *opts)
 {
     tpool_t *tm;
     pthread_t thread;
@@ -120,6 +600,9 @@ tpool_t *tpool_create(size_t num)
 
     tm = calloc(1, sizeof(*tm));
     tm->thread_cnt = num;
+    if (opts != NULL) {
+        tm->opts = *opts;
+    }
 
     pthread_mutex_init(&(tm->work_mutex), NULL);
     pthread_cond_init(&(tm->work_cond), NULL);
@@ -127,6 +610,7 @@ tpool_t *tpool_create(size_t num)
 
     tm->work_first = NULL;
     tm->work_last = NULL;
+    trace_init(tm, num);
 
     for (i=0; i<num; ++i){
         pthread_create(&thread, NULL, tpool_worker, tm);
@@ -144,7 +628,7 @@ void tpool_destroy(tpool_t *tm)
         return;
     }
     
-    pthread_mutex_lock(&(tm->work_mutex));
+    tpool_lock(tm, other_tracer(tm));
     work = tm->work_first;
     while (work != NULL) {
         work2 = work->next;
@@ -154,7 +638,7 @@ void tpool_destroy(tpool_t *tm)
 
     tm->stop = true;
     pthread_cond_broadcast(&(tm->work_cond));
-    pthread_mutex_unlock(&(tm->work_mutex));
+    tpool_unlock(tm, other_tracer(tm));
 
     tpool_wait(tm);
 
@@ -162,11 +646,17 @@ void tpool_destroy(tpool_t *tm)
     pthread_cond_destroy(&(tm->work_cond));
     pthread_cond_destroy(&(tm->working_cond));
 
+    trace_free(tm);
     free(tm);
 }
 
 
 bool tpool_add_work(tpool_t *tm, thread_func_t func, void *arg)
+{
+    return tpool_add_work_sheddable(tm, func, NULL, arg);
+}
+
+bool tpool_add_work_sheddable(tpool_t *tm, thread_func_t func, thread_func_t shed, void *arg)
 {
 //    printf("Adding task\n");
     tpool_work_t *work;
@@ -175,12 +665,18 @@ bool tpool_add_work(tpool_t *tm, thread_func_t func, void *arg)
         return false;
     }
     
-    work = tpool_work_create(func, arg);
+    work = tpool_work_create(func, shed, arg);
     if (work == NULL) {
         return false;
     }
     
-    pthread_mutex_lock(&(tm->work_mutex));
+    tpool_lock(tm, other_tracer(tm));
+    tpool_check_head(tm);
+    if (tm->shed.max_queue != 0 && tm->queued_cnt >= tm->shed.max_queue) {
+        tpool_unlock(tm, other_tracer(tm));
+        tpool_work_destroy(work);
+        return false;
+    }
     if (tm->work_first == NULL) {
         tm->work_first = work;
         tm->work_last = tm->work_first;
@@ -188,9 +684,12 @@ bool tpool_add_work(tpool_t *tm, thread_func_t func, void *arg)
         tm->work_last->next = work;
         tm->work_last = work;
     }
+    tm->queued_cnt++;
+    trace_enqueued(tm, work);
+    PROBE1(task_enqueue, tm->queued_cnt);
 
     pthread_cond_broadcast(&(tm->work_cond));
-    pthread_mutex_unlock(&(tm->work_mutex));
+    tpool_unlock(tm, other_tracer(tm));
 
     return true;
 }
@@ -201,13 +700,279 @@ void tpool_wait(tpool_t *tm)
     if (tm == NULL)
         return;
     
-    pthread_mutex_lock(&(tm->work_mutex));
+    tpool_lock(tm, other_tracer(tm));
     while(1) {
         if ((!tm->stop && tm->working_cnt != 0) || (tm->stop && tm->thread_cnt != 0)) {
-            pthread_cond_wait(&(tm->working_cond), &(tm->work_mutex));
+            tpool_cond_wait(tm, other_tracer(tm), &(tm->working_cond));
         } else {
             break;
         }
     }
-    pthread_mutex_unlock(&(tm->work_mutex));
-}
\ No newline at end of file
+    tpool_unlock(tm, other_tracer(tm));
+}
+
+size_t tpool_queue_len(tpool_t *tm)
+{
+    size_t len;
+
+    if (tm == NULL)
+        return 0;
+
+    tpool_lock(tm, other_tracer(tm));
+    len = tm->queued_cnt;
+    tpool_unlock(tm, other_tracer(tm));
+    return len;
+}
+
+void tpool_set_shedding(tpool_t *tm, const tpool_shed_config_t *config)
+{
+    if (tm == NULL)
+        return;
+
+    tpool_lock(tm, other_tracer(tm));
+    tm->shed = *config;
+    tm->first_above_ns = 0;
+    tm->rearm_until_ns = 0;
+    tm->shedding = false;
+    tpool_unlock(tm, other_tracer(tm));
+}
+
+bool tpool_overloaded(tpool_t *tm)
+{
+    bool overloaded;
+
+    if (tm == NULL)
+        return false;
+
+    tpool_lock(tm, other_tracer(tm));
+    tpool_check_head(tm);
+    overloaded = tm->shedding;
+    tpool_unlock(tm, other_tracer(tm));
+    return overloaded;
+}
+
+size_t tpool_shed_expired(tpool_t *tm)
+{
+    tpool_work_t *expired = NULL;
+    tpool_work_t **tail = &expired;
+    size_t n = 0;
+
+    if (tm == NULL)
+        return 0;
+
+    tpool_lock(tm, other_tracer(tm));
+    tpool_check_head(tm);
+    if (tm->shedding) {
+        uint64_t now = now_ns();
+        tpool_work_t *prev = NULL;
+        tpool_work_t *work = tm->work_first;
+        // The queue is in enqueue order, so the expired tasks come first.
+        while (work != NULL && now - work->enqueued_ns >= tm->shed.target_ns) {
+            tpool_work_t *next = work->next;
+            if (work->shed != NULL) {
+                if (prev == NULL) {
+                    tm->work_first = next;
+                } else {
+                    prev->next = next;
+                }
+                if (tm->work_last == work) {
+                    tm->work_last = prev;
+                }
+                tm->queued_cnt--;
+                trace_dequeued(other_tracer(tm), work);
+                work->next = NULL;
+                *tail = work;
+                tail = &work->next;
+            } else {
+                prev = work;
+            }
+            work = next;
+        }
+    }
+    tpool_unlock(tm, other_tracer(tm));
+
+    while (expired != NULL) {
+        tpool_work_t *next = expired->next;
+        uint64_t start = trace_now();
+        PROBE1(task_shed, expired->enqueued_ns);
+        expired->shed(expired->arg);
+        trace_other_task(tm, TRACE_SHED, start, expired);
+        tpool_work_destroy(expired);
+        expired = next;
+        n++;
+    }
+    return n;
+}
+
+uint64_t tpool_hist_percentile(const tpool_hist_t *h, double p)
+{
+    if (h->count == 0)
+        return 0;
+
+    uint64_t rank = h->count * p / 100;
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < TPOOL_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t bound = i == 0 ? 0 : 1ull << i;
+            return bound < h->max_ns ? bound : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+#ifdef TPOOL_TRACE
+
+static void hist_add(tpool_hist_t *dst, trace_hist_t *src)
+{
+    dst->count += atomic_load_explicit(&src->count, memory_order_relaxed);
+    dst->sum_ns += atomic_load_explicit(&src->sum_ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&src->max_ns, memory_order_relaxed);
+    if (max > dst->max_ns) {
+        dst->max_ns = max;
+    }
+    for (int i = 0; i < TPOOL_HIST_BUCKETS; i++) {
+        dst->buckets[i] += atomic_load_explicit(&src->buckets[i], memory_order_relaxed);
+    }
+}
+
+tpool_stats_t *tpool_get_stats(tpool_t *tm)
+{
+    if (tm == NULL)
+        return NULL;
+
+    tpool_stats_t *stats = calloc(1, sizeof(*stats) + tm->num_workers * sizeof(stats->workers[0]));
+    if (stats == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+    tpool_hist_t *dst[TRACE_KINDS] = {
+        [TRACE_QUEUE] = &stats->queue_wait,
+        [TRACE_RUN] = &stats->run,
+        [TRACE_SHED] = &stats->shed,
+        [TRACE_LOCK_WAIT] = &stats->lock_wait,
+        [TRACE_LOCK_HOLD] = &stats->lock_hold,
+    };
+    stats->elapsed_ns = now_ns() - tm->created_ns;
+    stats->num_workers = tm->num_workers;
+    for (size_t i = 0; i <= tm->num_workers; i++) {
+        trace_hist_t *hists = tm->tracers[i].hists;
+        for (int kind = 0; kind < TRACE_KINDS; kind++) {
+            hist_add(dst[kind], &hists[kind]);
+        }
+        if (i == tm->num_workers) {
+            break;
+        }
+        tpool_worker_stats_t *w = &stats->workers[i];
+        for (int kind = TRACE_RUN; kind <= TRACE_SHED; kind++) {
+            w->tasks += atomic_load_explicit(&hists[kind].count, memory_order_relaxed);
+            w->busy_ns += atomic_load_explicit(&hists[kind].sum_ns, memory_order_relaxed);
+        }
+        w->utilization = stats->elapsed_ns ? (double)w->busy_ns / stats->elapsed_ns : 0;
+    }
+    return stats;
+}
+
+// Copies out the events of a ring that are still intact, oldest first;
+// returns how many.
+static size_t trace_snapshot(tpool_tracer_t *tr, trace_event_t *out)
+{
+    uint64_t head = atomic_load_explicit(&tr->head, memory_order_acquire);
+    uint64_t first = head > TPOOL_TRACE_EVENTS ? head - TPOOL_TRACE_EVENTS : 0;
+    for (uint64_t i = first; i < head; i++) {
+        out[i - first] = tr->events[i & (TPOOL_TRACE_EVENTS - 1)];
+    }
+    atomic_thread_fence(memory_order_acquire);
+    // The writer may be overwriting the slot after its new head already.
+    uint64_t now = atomic_load_explicit(&tr->head, memory_order_relaxed);
+    uint64_t intact = now >= TPOOL_TRACE_EVENTS ? now - TPOOL_TRACE_EVENTS + 1 : 0;
+    if (intact <= first) {
+        return head - first;
+    }
+    if (intact >= head) {
+        return 0;
+    }
+    memmove(out, out + (intact - first), (head - intact) * sizeof(*out));
+    return head - intact;
+}
+
+static const char *const trace_names[TRACE_KINDS] = {
+    [TRACE_QUEUE] = "queued",
+    [TRACE_RUN] = "run",
+    [TRACE_SHED] = "shed",
+    [TRACE_LOCK_WAIT] = "lock wait",
+    [TRACE_LOCK_HOLD] = "lock held",
+};
+
+bool tpool_trace_dump(tpool_t *tm, const char *path)
+{
+    if (tm == NULL)
+        return false;
+
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return false;
+    }
+    trace_event_t *events = malloc(TPOOL_TRACE_EVENTS * sizeof(*events));
+    if (events == NULL) {
+        perror("OOM");
+        exit(1);
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+               "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"tpool\"}}");
+    for (size_t i = 0; i <= tm->num_workers; i++) {
+        int tid = i + 1;
+        if (i < tm->num_workers) {
+            fprintf(f, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+                       "\"args\":{\"name\":\"worker %zu\"}}", tid, i);
+        } else {
+            fprintf(f, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\","
+                       "\"args\":{\"name\":\"other threads\"}}", tid);
+        }
+
+        size_t n = trace_snapshot(&tm->tracers[i], events);
+        for (size_t j = 0; j < n; j++) {
+            const trace_event_t *ev = &events[j];
+            // Guards against TSC skew between cores.
+            double ts = ev->start > tm->created_ticks
+                            ? ticks_to_ns(ev->start - tm->created_ticks) / 1000.0 : 0;
+            double dur = ticks_to_ns(ev->end - ev->start) / 1000.0;
+            if (ev->kind == TRACE_QUEUE) {
+                fprintf(f, ",\n{\"ph\":\"b\",\"cat\":\"queue\",\"name\":\"queued\",\"id\":%" PRIu64
+                           ",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", ev->task, tid, ts);
+                fprintf(f, ",\n{\"ph\":\"e\",\"cat\":\"queue\",\"name\":\"queued\",\"id\":%" PRIu64
+                           ",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", ev->task, tid, ts + dur);
+            } else {
+                fprintf(f, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                           "\"dur\":%.3f", trace_names[ev->kind], tid, ts, dur);
+                if (ev->task != 0) {
+                    fprintf(f, ",\"args\":{\"task\":%" PRIu64 "}", ev->task);
+                }
+                fputc('}', f);
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+    free(events);
+
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+#else
+
+tpool_stats_t *tpool_get_stats(tpool_t *tm)
+{
+    return NULL;
+}
+
+bool tpool_trace_dump(tpool_t *tm, const char *path)
+{
+    return false;
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct tpool tpool_t;
 
@@ -11,7 +12,122 @@ typedef void (*thread_func_t)(void *arg);
 tpool_t *tpool_create(size_t num);
 void tpool_destroy(tpool_t *tm);
 
+// Per-worker context, for tpool_create_opts. Each worker calls init(arg), if
+// set, on its own thread before taking any task, and its tasks get the result
+// from tpool_worker_local(); teardown(local, arg) runs on the worker as it
+// exits in tpool_destroy, which waits for it. arena_size, if nonzero, gives
+// each worker a scratch arena of that many bytes for tpool_scratch().
+typedef struct {
+    void *(*init)(void *arg);
+    void (*teardown)(void *local, void *arg);
+    void *arg;
+    size_t arena_size;
+} tpool_options_t;
+
+// Like tpool_create, with the worker setup in opts.
+tpool_t *tpool_create_opts(size_t num, const tpool_options_t *opts);
+
+// The calling worker's init result, or NULL when not called from a task.
+void *tpool_worker_local(void);
+
+// Allocates size bytes, aligned for any type, from the calling worker's
+// arena: a pointer bump, in memory the worker allocated and touched itself,
+// so it sits on the worker's NUMA node and, reused task after task, stays in
+// its core's cache. Everything is freed at once when the task returns, so
+// nothing is freed by hand. Requests the arena can't fit fall back to
+// malloc, freed along with the rest. Returns NULL when not called from a
+// task.
+void *tpool_scratch(size_t size);
+
 bool tpool_add_work(tpool_t *tm, thread_func_t func, void *arg);
 void tpool_wait(tpool_t *tm);
 
+// Number of queued tasks that no worker has picked up yet.
+size_t tpool_queue_len(tpool_t *tm);
+
+// Load shedding, after CoDel: the pool tracks how long each task waited in
+// the queue. Once that delay has stayed above target_ns for interval_ns, the
+// queue is considered standing rather than a burst, and the pool sheds:
+// tpool_overloaded() turns true so that callers can reject new work up
+// front, and dequeued tasks that waited longer than target_ns are handed to
+// their shed function instead. Shedding stops as soon as a task gets through
+// within target_ns. A zero target disables it. max_queue, if
+// nonzero, caps the number of queued tasks regardless.
+typedef struct {
+    uint64_t target_ns;
+    uint64_t interval_ns;
+    size_t max_queue;
+} tpool_shed_config_t;
+
+void tpool_set_shedding(tpool_t *tm, const tpool_shed_config_t *config);
+
+// Like tpool_add_work, but shed(arg) runs in place of func(arg) if the pool
+// sheds this task. Both return false if the queue is at max_queue.
+bool tpool_add_work_sheddable(tpool_t *tm, thread_func_t func, thread_func_t shed, void *arg);
+
+// True while the pool is shedding. This and tpool_add_work_sheddable also
+// check how long the oldest queued task has waited so far, so a standing
+// queue is noticed even while every worker is busy with a long task and
+// nothing gets dequeued.
+bool tpool_overloaded(tpool_t *tm);
+
+// While the pool is shedding, takes the queued tasks that have waited longer
+// than target_ns, and have a shed function, off the queue and runs their
+// shed functions on the calling thread; returns how many. Workers only shed
+// what they dequeue, so when tasks can hold them for long, as whole
+// connections do, call this periodically so that the queue doesn't just
+// sit there.
+size_t tpool_shed_expired(tpool_t *tm);
+
+// Tracing, compiled in with -DTPOOL_TRACE; without it the pool has no trace
+// code at all, tpool_get_stats returns NULL and tpool_trace_dump false.
+//
+// Each worker records into a ring of its own how long every task it took
+// waited in the queue and ran, and how long it waited for work_mutex and
+// then held it; threads adding work or querying the pool share one more
+// ring, written under the mutex. Timestamps are TSC ticks on x86 (assumed
+// invariant and in sync across cores), converted to ns with a calibration
+// taken by the first tpool_create. Every duration also lands in the ring's
+// histograms, which cover the pool's whole life; the rings keep the last
+// TPOOL_TRACE_EVENTS events each, for the trace.
+
+#define TPOOL_HIST_BUCKETS 48
+
+// Bucket i counts durations in [2^(i-1), 2^i) ns; bucket 0 counts zeros.
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[TPOOL_HIST_BUCKETS];
+} tpool_hist_t;
+
+typedef struct {
+    uint64_t tasks;     // Run or shed.
+    uint64_t busy_ns;   // Spent in them.
+    double utilization; // busy_ns over elapsed_ns.
+} tpool_worker_stats_t;
+
+typedef struct {
+    uint64_t elapsed_ns;     // Since tpool_create.
+    tpool_hist_t queue_wait; // From tpool_add_work to a worker taking it.
+    tpool_hist_t run;        // In the task function.
+    tpool_hist_t shed;       // In the shed function.
+    tpool_hist_t lock_wait;  // Acquiring work_mutex, all threads.
+    tpool_hist_t lock_hold;  // Holding it, condition waits excluded.
+    size_t num_workers;
+    tpool_worker_stats_t workers[];
+} tpool_stats_t;
+
+// Returns a snapshot of the histograms for the caller to free(), or NULL.
+tpool_stats_t *tpool_get_stats(tpool_t *tm);
+
+// Upper bound of the bucket holding the p-th percentile (0 to 100) of h.
+uint64_t tpool_hist_percentile(const tpool_hist_t *h, double p);
+
+// Writes the events still in the rings to path as Chrome trace event JSON,
+// for chrome://tracing or ui.perfetto.dev: a track per worker with its tasks
+// and lock waits and holds, one for the other threads, and each task's
+// queue wait as an async slice.
+bool tpool_trace_dump(tpool_t *tm, const char *path);
+
 #endif /* __TPOOL_H__ */
\ No newline at end of file
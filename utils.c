@@ -1,27 +1,153 @@
+#define _GNU_SOURCE
+
 #include "utils.h"
 
+#include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
-#include <netdb.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
 
-#define N_BACKLOG 64
+// Default listen queue length. The kernel silently caps it at
+// net.core.somaxconn; LISTEN_BACKLOG or SOCKET_TUNING's backlog= in the
+// environment overrides it.
+#define N_BACKLOG SOMAXCONN
 
-void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen) {
-    char hostbuf[NI_MAXHOST];
-    char portbuf[NI_MAXSERV];
-    if (getnameinfo((struct sockaddr*)sa, salen, hostbuf, NI_MAXHOST, portbuf, NI_MAXSERV, 0) == 0) {
-        printf("peer (%s, %s) connected\n", hostbuf, portbuf);
+void report_peer_connected(int sockfd, const struct sockaddr* sa, socklen_t salen) {
+    // Numeric formatting only: a reverse DNS lookup here would block the
+    // accepting thread for as long as the resolver takes.
+    char hostbuf[INET6_ADDRSTRLEN];
+    if (sa->sa_family == AF_INET && salen >= sizeof(struct sockaddr_in)) {
+        const struct sockaddr_in* sin = (const struct sockaddr_in*)sa;
+        inet_ntop(AF_INET, &sin->sin_addr, hostbuf, sizeof(hostbuf));
+        log_info("peer (%s, %u) connected", hostbuf, ntohs(sin->sin_port));
+    } else if (sa->sa_family == AF_INET6 && salen >= sizeof(struct sockaddr_in6)) {
+        const struct sockaddr_in6* sin6 = (const struct sockaddr_in6*)sa;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, hostbuf, sizeof(hostbuf));
+        log_info("peer (%s, %u) connected", hostbuf, ntohs(sin6->sin6_port));
+    } else if (sa->sa_family == AF_UNIX) {
+        peer_credentials_t cred;
+        if (unix_peer_credentials(sockfd, &cred)) {
+            log_info("peer (unix, pid %d, uid %u, gid %u) connected", (int)cred.pid,
+                     (unsigned)cred.uid, (unsigned)cred.gid);
+        } else {
+            log_info("peer (unix) connected");
+        }
     } else {
-        printf("peer (unknown) connected\n");
+        log_info("peer (unknown) connected");
+    }
+}
+
+static socket_tuning_t tuning;
+static bool tuning_loaded = false;
+
+bool socket_tuning_parse(socket_tuning_t* t, const char* spec) {
+    char* copy = strdup(spec);
+    if (copy == NULL) {
+        return false;
+    }
+
+    bool ok = true;
+    char* saveptr = NULL;
+    for (char* tok = strtok_r(copy, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+        char* eq = strchr(tok, '=');
+        int val = 1;
+        if (eq != NULL) {
+            *eq = '\0';
+            val = atoi(eq + 1);
+        }
+
+        if (strcmp(tok, "nodelay") == 0) {
+            t->nodelay = val != 0;
+        } else if (strcmp(tok, "defer_accept") == 0) {
+            t->defer_accept_sec = val;
+        } else if (strcmp(tok, "fastopen") == 0) {
+            t->fastopen_qlen = eq ? val : 256;
+        } else if (strcmp(tok, "rcvbuf") == 0) {
+            t->rcvbuf = val;
+        } else if (strcmp(tok, "sndbuf") == 0) {
+            t->sndbuf = val;
+        } else if (strcmp(tok, "busy_poll") == 0) {
+            t->busy_poll_usec = eq ? val : 50;
+        } else if (strcmp(tok, "incoming_cpu") == 0) {
+            t->incoming_cpu = val;
+        } else if (strcmp(tok, "ipv6") == 0) {
+            t->ipv6 = val != 0;
+        } else if (strcmp(tok, "backlog") == 0) {
+            t->backlog = val;
+        } else {
+            log_warn("unknown socket tuning option '%s'", tok);
+            ok = false;
+        }
+    }
+
+    free(copy);
+    return ok;
+}
+
+socket_tuning_t* socket_tuning(void) {
+    if (!tuning_loaded) {
+        tuning = (socket_tuning_t){.incoming_cpu = -1, .backlog = N_BACKLOG};
+
+        const char *env = getenv("LISTEN_BACKLOG");
+        if (env != NULL && atoi(env) > 0) {
+            tuning.backlog = atoi(env);
+        }
+        env = getenv("SOCKET_TUNING");
+        if (env != NULL) {
+            socket_tuning_parse(&tuning, env);
+        }
+        tuning_loaded = true;
+    }
+    return &tuning;
+}
+
+int listen_backlog(void) {
+    return socket_tuning()->backlog;
+}
+
+static void set_int_option(int sockfd, int level, int optname, int val, const char* name) {
+    if (setsockopt(sockfd, level, optname, &val, sizeof(val)) < 0) {
+        log_warn("setsockopt %s=%d: %s", name, val, strerror(errno));
+    }
+}
+
+// Options that affect each connection. They are set on the listener too,
+// since Linux copies them into sockets at accept time; the explicit calls in
+// tune_accepted_socket keep behavior the same where that doesn't hold.
+static void apply_connection_options(int sockfd, const socket_tuning_t* t, bool tcp) {
+    if (tcp && t->nodelay) {
+        set_int_option(sockfd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    }
+    if (t->rcvbuf > 0) {
+        set_int_option(sockfd, SOL_SOCKET, SO_RCVBUF, t->rcvbuf, "SO_RCVBUF");
+    }
+    if (t->sndbuf > 0) {
+        set_int_option(sockfd, SOL_SOCKET, SO_SNDBUF, t->sndbuf, "SO_SNDBUF");
+    }
+    if (t->busy_poll_usec > 0) {
+        set_int_option(sockfd, SOL_SOCKET, SO_BUSY_POLL, t->busy_poll_usec, "SO_BUSY_POLL");
     }
 }
 
 int listen_inet_socket(int portnum) {
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    const socket_tuning_t* t = socket_tuning();
+
+    int family = t->ipv6 ? AF_INET6 : AF_INET;
+    int sockfd = socket(family, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("ERROR opening socket");
         exit(1);
@@ -32,18 +158,45 @@ int listen_inet_socket(int portnum) {
         perror("setsockopt");
     }
 
-    struct sockaddr_in serv_addr;
+    apply_connection_options(sockfd, t, true);
+    if (t->incoming_cpu >= 0) {
+        set_int_option(sockfd, SOL_SOCKET, SO_INCOMING_CPU, t->incoming_cpu, "SO_INCOMING_CPU");
+    }
+
+    struct sockaddr_storage serv_addr;
+    socklen_t serv_addr_len;
     memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(portnum);
+    if (t->ipv6) {
+        // Dual stack: IPv4 clients show up as v4-mapped IPv6 addresses.
+        set_int_option(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, 0, "IPV6_V6ONLY");
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&serv_addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = in6addr_any;
+        sin6->sin6_port = htons(portnum);
+        serv_addr_len = sizeof(*sin6);
+    } else {
+        struct sockaddr_in* sin = (struct sockaddr_in*)&serv_addr;
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = INADDR_ANY;
+        sin->sin_port = htons(portnum);
+        serv_addr_len = sizeof(*sin);
+    }
 
-    if (bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+    if (bind(sockfd, (struct sockaddr*)&serv_addr, serv_addr_len) < 0) {
         perror("ERROR on binding");
         exit(1);
     }
 
-    if (listen(sockfd, N_BACKLOG) < 0) {
+    // Wake the acceptor only once the client has sent data (or the timeout
+    // expires), rather than on the bare handshake.
+    if (t->defer_accept_sec > 0) {
+        set_int_option(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, t->defer_accept_sec, "TCP_DEFER_ACCEPT");
+    }
+    if (t->fastopen_qlen > 0) {
+        set_int_option(sockfd, IPPROTO_TCP, TCP_FASTOPEN, t->fastopen_qlen, "TCP_FASTOPEN");
+    }
+
+    if (listen(sockfd, t->backlog) < 0) {
         perror("ERROR on listen");
         exit(1);
     }
@@ -51,6 +204,90 @@ int listen_inet_socket(int portnum) {
     return sockfd;
 }
 
+void tune_accepted_socket(int sockfd) {
+    const socket_tuning_t* t = socket_tuning();
+    // Only nodelay cares what the socket is, so the lookup is skipped without it.
+    int domain = AF_INET;
+    if (t->nodelay) {
+        socklen_t len = sizeof(domain);
+        getsockopt(sockfd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    }
+    apply_connection_options(sockfd, t, domain != AF_UNIX);
+}
+
+socklen_t unix_socket_address(const char* path, struct sockaddr_un* sun) {
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(sun->sun_path)) {
+        return 0;
+    }
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, path, len);
+    if (path[0] == '@') {
+        // Abstract names start with a NUL and, unlike paths, take every byte
+        // of the given length, so the address mustn't include any padding.
+        sun->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+    return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+// True if a socket file at sun is left over from a process that's gone,
+// which is what connect() refusing it means.
+static bool stale_socket_file(const struct sockaddr_un* sun, socklen_t len) {
+    struct stat st;
+    if (lstat(sun->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    bool stale = connect(fd, (const struct sockaddr*)sun, len) < 0 && errno == ECONNREFUSED;
+    close(fd);
+    return stale;
+}
+
+int listen_unix_socket(const char* path) {
+    const socket_tuning_t* t = socket_tuning();
+
+    struct sockaddr_un sun;
+    socklen_t len = unix_socket_address(path, &sun);
+    if (len == 0) {
+        fprintf(stderr, "bad Unix socket path '%s'\n", path);
+        exit(1);
+    }
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        perror("ERROR opening socket");
+        exit(1);
+    }
+    apply_connection_options(sockfd, t, false);
+
+    if (path[0] != '@' && stale_socket_file(&sun, len)) {
+        unlink(path);
+    }
+    if (bind(sockfd, (struct sockaddr*)&sun, len) < 0) {
+        perror("ERROR on binding");
+        exit(1);
+    }
+    if (listen(sockfd, t->backlog) < 0) {
+        perror("ERROR on listen");
+        exit(1);
+    }
+    return sockfd;
+}
+
+bool unix_peer_credentials(int sockfd, peer_credentials_t* cred) {
+    struct ucred uc;
+    socklen_t len = sizeof(uc);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &uc, &len) < 0 || uc.pid == 0) {
+        return false;
+    }
+    *cred = (peer_credentials_t){.pid = uc.pid, .uid = uc.uid, .gid = uc.gid};
+    return true;
+}
+
 void make_socket_non_blocking(int sockfd) {
     int flags = fcntl(sockfd, F_GETFL, 0);
     if (flags == -1) {
@@ -61,4 +298,46 @@ void make_socket_non_blocking(int sockfd) {
         perror("fcntl F_SETFL O_NONBLOCK");
         exit(1);
     }
-}
\ No newline at end of file
+}
+
+int accept_nonblocking(int listenfd, struct sockaddr* sa, socklen_t* salen) {
+    return accept4(listenfd, sa, salen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+static __thread int reserve_fd = -1;
+
+void accept_reserve_init(void) {
+    if (reserve_fd < 0) {
+        reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+}
+
+bool accept_drop_pending(int listenfd) {
+    static _Atomic uint64_t dropped;
+    static _Atomic time_t last_warning;
+    int err = errno;
+
+    if (reserve_fd < 0) {
+        // Lost to ENFILE last time; there may be room again.
+        accept_reserve_init();
+        if (reserve_fd < 0) {
+            return false;
+        }
+    }
+    close(reserve_fd);
+    int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd >= 0) {
+        close(fd);
+        dropped++;
+    }
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    time_t now = time(NULL);
+    time_t last = last_warning;
+    if (now != last && dropped > 0 &&
+        atomic_compare_exchange_strong(&last_warning, &last, now)) {
+        log_warn("accept: %s; dropped %lu connection(s)", strerror(err),
+                 (unsigned long)atomic_exchange(&dropped, 0));
+    }
+    return true;
+}
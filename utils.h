@@ -2,17 +2,102 @@
 #define UTILS_H
 
 #include <netinet/in.h>
+#include <stdbool.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
-// Reports a peer connection to stdout. sa is the data populated by a successful
-// accept() call.
-void report_peer_connected(const struct sockaddr_in* sa, socklen_t salen);
+// Reports a peer connection through the async logger, using the numeric host
+// and port only, or for Unix socket peers their credentials. sa is the data
+// populated by a successful accept() call of sockfd.
+void report_peer_connected(int sockfd, const struct sockaddr* sa, socklen_t salen);
 
-// Creates a bound and listening INET socket on the given port number. Returns
-// the socket fd when successful; dies in case of errors.
+// Socket options applied by listen_inet_socket and tune_accepted_socket. Zero
+// (or -1 for incoming_cpu) leaves the kernel default in place.
+typedef struct {
+    bool nodelay;         // TCP_NODELAY: don't hold back small writes.
+    int defer_accept_sec; // TCP_DEFER_ACCEPT on the listener. Only useful
+                          // when clients speak first: with the '*' ack the
+                          // server speaks first, so every accept is delayed
+                          // by this timeout.
+    int fastopen_qlen;    // TCP_FASTOPEN queue length on the listener.
+    int rcvbuf;           // SO_RCVBUF in bytes.
+    int sndbuf;           // SO_SNDBUF in bytes.
+    int busy_poll_usec;   // SO_BUSY_POLL: spin in recv before sleeping.
+    int incoming_cpu;     // SO_INCOMING_CPU on the listener.
+    bool ipv6;            // Listen on [::] in dual-stack mode.
+    int backlog;          // listen() queue length.
+} socket_tuning_t;
+
+// Parses a comma-separated spec such as "nodelay,rcvbuf=262144,busy_poll=50"
+// into t, leaving unmentioned fields as they are. Options without a value
+// are switched on. Returns false if any option was not recognized.
+bool socket_tuning_parse(socket_tuning_t* t, const char* spec);
+
+// Process-wide tuning profile, loaded on first use from the SOCKET_TUNING
+// (spec as above) and LISTEN_BACKLOG environment variables. Callers may
+// modify it before creating the listener.
+socket_tuning_t* socket_tuning(void);
+
+// Listen queue length used by the listeners: the socket_tuning() profile's
+// backlog, so SOCKET_TUNING's backlog= if given, else LISTEN_BACKLOG from the
+// environment if set, else SOMAXCONN.
+int listen_backlog(void);
+
+// Creates a bound and listening socket on the given port number, applying the
+// socket_tuning() profile. Returns the socket fd when successful; dies in case
+// of errors.
 int listen_inet_socket(int portnum);
 
+// Applies the per-connection part of the socket_tuning() profile to a socket
+// returned by accept(). TCP-only options are skipped for Unix sockets.
+void tune_accepted_socket(int sockfd);
+
+// Unix domain stream sockets, for clients on the same host: they skip the
+// TCP/IP stack that loopback TCP goes through. A path starting with '@'
+// names a socket in Linux's abstract namespace (no file, gone with the last
+// descriptor); anything else is a filesystem path. Every server takes
+// UNIX_SOCKET from the environment and, if set, listens there as well as on
+// its TCP port, serving both alike.
+
+// Fills in sun for path and returns its length, or 0 if path is too long.
+socklen_t unix_socket_address(const char* path, struct sockaddr_un* sun);
+
+// Creates a bound and listening Unix stream socket at path, with the buffer
+// sizes and backlog of the socket_tuning() profile. A socket file nobody
+// listens on any more is replaced. Returns the socket fd; dies in case of
+// errors.
+int listen_unix_socket(const char* path);
+
+// What the kernel recorded about a Unix socket peer when it connected
+// (SO_PEERCRED): the client can't forge it, so it identifies who's on the
+// other end without any handshake.
+typedef struct {
+    pid_t pid;
+    uid_t uid;
+    gid_t gid;
+} peer_credentials_t;
+
+// Returns false if sockfd isn't a connected Unix socket.
+bool unix_peer_credentials(int sockfd, peer_credentials_t* cred);
+
 void make_socket_non_blocking(int sockfd);
 
-#endif
\ No newline at end of file
+// Accepts one pending connection with the new socket already non-blocking and
+// close-on-exec, saving the two fcntl calls of make_socket_non_blocking.
+// Returns the new fd, or -1 with errno set (EAGAIN once the queue is drained).
+int accept_nonblocking(int listenfd, struct sockaddr* sa, socklen_t* salen);
+
+// Out of descriptors (EMFILE, ENFILE), accept leaves the connection queued
+// and a level-triggered listener stays readable, so an event loop would spin
+// on it. accept_reserve_init sets one descriptor aside for the calling
+// thread, before it accepts anything. After accept fails that way,
+// accept_drop_pending spends the reserve to accept the oldest queued
+// connection and close it at once, so that the client sees it closed rather
+// than hanging, and then takes the reserve back. It logs a warning at most
+// once a second, with the count dropped since. Returns false if the thread
+// had no reserve to spend, and the caller should back off instead.
+void accept_reserve_init(void);
+bool accept_drop_pending(int listenfd);
+
+#endif